@@ -35,21 +35,15 @@ FIND_PACKAGE_HANDLE_STANDARD_ARGS(esp_det
     esp_det_LIBRARY
     esp_det_INCLUDE_DIR)
 
-find_package(esp_eb REQUIRED)
-find_package(esp_cmd REQUIRED)
 find_package(esp_cfg REQUIRED)
 find_package(esp_json REQUIRED)
 
 set(esp_det_INCLUDE_DIRS
     ${esp_det_INCLUDE_DIR}
-    ${esp_eb_INCLUDE_DIRS}
-    ${esp_cmd_INCLUDE_DIRS}
     ${esp_cfg_INCLUDE_DIRS}
     ${esp_json_INCLUDE_DIRS})
 
 set(esp_det_LIBRARIES
     ${esp_det_LIBRARY}
-    ${esp_eb_LIBRARIES}
-    ${esp_cmd_LIBRARIES}
     ${esp_cfg_LIBRARIES}
     ${esp_json_LIBRARIES})
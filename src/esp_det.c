@@ -16,25 +16,70 @@
 
 
 #include <esp_det.h>
-#include <esp_eb.h>
-#include <esp_cmd.h>
-#include <esp_json.h>
+#include <espconn.h>
+#if ESP_DET_CMD_CJSON
+  #include <esp_json.h>
+#endif
 #include <mem.h>
+#include <stddef.h>
+#include "esp_det_jrnl.h"
+#include "esp_det_srv.h"
+#include "esp_det_trace.h"
 
-// Event names.
-#define ESP_DET_EV_MAIN "espDetMain"
-#define ESP_DET_EV_GOT_IP "espDetGotIp"
-#define ESP_DET_EV_DISC "espDetDisc"
-#define ESP_DET_EV_USER "espDetUser"
-#define ESP_DET_EV_DISC_SRV "espDetDiscSrv"
+// The library events.
+typedef enum {
+  ESP_DET_EV_MAIN,     // Run the current detection stage.
+  ESP_DET_EV_GOT_IP,   // Got IP address from access point.
+  ESP_DET_EV_DISC,     // Disconnected from access point.
+  ESP_DET_EV_USER,     // Call user program callback.
+  ESP_DET_EV_DISC_SRV, // Send discovery broadcast.
+  ESP_DET_EV_CNT,      // The number of events.
+} det_ev;
+
+/**
+ * Function prototype for library event handlers.
+ *
+ * @param arg The event argument.
+ */
+typedef void (det_ev_cb)(void *arg);
+
+// The pending library event.
+typedef struct {
+  os_timer_t timer; // The event timer.
+  void *arg;        // The event argument.
+} det_ev_slot;
 
 // Supported commands.
 #define ESP_DET_CMD_SET_AP "setAp"
 #define ESP_DET_CMD_SET_SRV "setSrv"
+#define ESP_DET_CMD_GET_STATS "getStats"
+#define ESP_DET_CMD_SET_ALL "setAll"
 #define ESP_DET_CMD_DISCOVERY "iotDiscovery"
 
+// The first byte of binary commands and responses.
+#define ESP_DET_BIN_MAGIC 0xA5
+// The size of binary response header (magic, command ID, success, code).
+#define ESP_DET_BIN_HDR 5
+
+// Maximum length of IP address string in commands.
+#define ESP_DET_IP_STR_MAX 16
+// Maximum length of access point name in commands (SSID and NULL).
+#define ESP_DET_STA_NAME_MAX 33
+// Maximum length of access point password in commands (passphrase and NULL).
+#define ESP_DET_STA_PASS_MAX 65
+// Maximum length of command name and JSON keys.
+#define ESP_DET_KEY_MAX 16
+// Maximum length of discovery broadcast payload.
+#define ESP_DET_DIS_MSG_MAX 112
+// The length of the nonce string (8 hex digits and NULL).
+#define ESP_DET_NONCE_MAX 9
+// Maximum length of command response.
+#define ESP_DET_RES_MAX 320
+
 #define ESP_DET_FAST_CALL 10
 #define ESP_DET_SLOW_CALL 500
+// How often in milliseconds the time spent in the current stage is updated.
+#define ESP_DET_STAGE_TICK (10 * 60 * 1000)
 
 // The ESP detection stages.
 typedef enum {
@@ -55,26 +100,164 @@ typedef struct STORE_ATTR {
   char srv_pass[ESP_DET_SRV_PASS_MAX]; // The main server password.
   char ap_name[ESP_DET_AP_NAME_MAX];   // The access name.
   char ap_pass[ESP_DET_AP_PASS_MAX];   // The access point password.
+  uint8_t ap_bssid[6]; // The BSSID of the last successful connection.
+  uint8_t ap_ch;       // The channel of the last successful connection. Zero if unknown.
+  uint32_t ip;         // The last IP address.
+  uint32_t netmask;    // The last netmask.
+  uint32_t gw;         // The last gateway address.
+  uint32_t mgr_ip;     // The manager address discovery is unicast to. Zero if unknown.
 } flash_cfg;
 
+// The flash_cfg layout stored by esp_cfg with ESP_DET_CFG_MAGIC_V1.
+typedef struct STORE_ATTR {
+  uint8_t magic;
+  uint32_t load_cnt;
+  uint32_t srv_ip;
+  uint16_t srv_port;
+  esp_det_st stage;
+  char srv_user[ESP_DET_SRV_USER_MAX];
+  char srv_pass[ESP_DET_SRV_PASS_MAX];
+  char ap_name[ESP_DET_AP_NAME_MAX];
+  char ap_pass[ESP_DET_AP_PASS_MAX];
+} flash_cfg_v1;
+
+// The command identifiers.
+typedef enum {
+  ESP_DET_CMD_ID_UNKNOWN,   // Values are also command IDs in binary commands.
+  ESP_DET_CMD_ID_SET_AP,
+  ESP_DET_CMD_ID_SET_SRV,
+  ESP_DET_CMD_ID_GET_STATS,
+  ESP_DET_CMD_ID_SET_ALL,
+  ESP_DET_CMD_ID_CNT,       // The number of command IDs.
+} det_cmd_id;
+
+// The command key flags. Set in det_cmd.keys when key was decoded.
+#define ESP_DET_KEY_CMD  0x01
+#define ESP_DET_KEY_NAME 0x02
+#define ESP_DET_KEY_PASS 0x04
+#define ESP_DET_KEY_IP   0x08
+#define ESP_DET_KEY_PORT 0x10
+#define ESP_DET_KEY_USER 0x20
+#define ESP_DET_KEY_SRV_PASS 0x40
+#define ESP_DET_KEY_NONCE 0x80
+#define ESP_DET_KEY_MGR  0x100
+
+// The decoded command.
+typedef struct {
+  det_cmd_id id;   // The command identifier.
+  uint8_t bin_id;  // The command ID byte as received in binary command.
+  uint16_t keys;   // The ESP_DET_KEY_* flags of decoded keys.
+  uint16_t port;   // The main server port.
+  char cmd[ESP_DET_KEY_MAX];       // The command name.
+  char name[ESP_DET_STA_NAME_MAX]; // The access point name.
+  char pass[ESP_DET_STA_PASS_MAX]; // The access point or main server password.
+  char ip[ESP_DET_IP_STR_MAX];     // The main server IP.
+  char user[ESP_DET_SRV_USER_MAX]; // The main server username.
+  char srv_pass[ESP_DET_SRV_PASS_MAX]; // The main server password in setAll command.
+  char nonce[ESP_DET_NONCE_MAX];       // The nonce from discovery broadcast.
+  char mgr[ESP_DET_IP_STR_MAX];        // The manager IP.
+} det_cmd;
+
+// The command key types.
+typedef enum {
+  ESP_DET_KT_STR,
+  ESP_DET_KT_NUM,
+} det_key_type;
+
+// The command key description.
+typedef struct {
+  const char *name;  // The JSON key name.
+  uint16_t flag;     // The ESP_DET_KEY_* flag.
+  det_key_type type; // The expected value type.
+  uint16_t off;      // The offset of the destination field in det_cmd.
+  uint16_t size;     // The size of the destination field.
+} det_key;
+
+// The response writer.
+typedef struct {
+  uint8_t *buf; // The response buffer.
+  uint16 size;  // The response buffer size.
+  uint16 len;   // The number of bytes written.
+  bool ovf;     // Set when response did not fit in the buffer.
+  bool bin;     // Write binary response.
+} det_wr;
+
+// The command response.
+typedef struct {
+  bool success;    // Is response a success or failure.
+  uint16 code;     // The error code if success is false, 0 otherwise.
+  const char *msg; // The response message.
+  void (*extra)(det_wr *wr); // Writes additional response keys. May be NULL.
+} det_resp;
+
+// The command receive buffer.
+typedef struct {
+  uint8_t *buf; // The message buffer.
+  uint16 size;  // The message buffer size.
+  uint16 len;   // The number of bytes received.
+  uint16 done;  // The number of received bytes already decrypted.
+  uint16 out;   // The number of decrypted bytes at the beginning of buf.
+  bool ovf;     // Set when message did not fit in the buffer.
+  const uint8_t *src; // The received message for esp_det_enc_dec callback.
+} det_rx;
+
+// The RTC memory magic number.
+#define ESP_DET_RTC_MAGIC 0x44455452
+
+// The boot counter kept in RTC memory.
+typedef struct {
+  uint32_t magic;    // The ESP_DET_RTC_MAGIC.
+  uint32_t load_cnt; // The boot counter.
+  uint32_t sum;      // The checksum.
+} det_rtc;
+
 // The ESP detection global state.
 typedef struct {
   bool det_srv;       // Set to true to detect main server.
   bool connected;     // Set to true if we are connected to access point.
-  bool dm_run;        // Was detect me stage running.
-  char *ap_pass;      // The password for access point created in ESP_DET_ST_DM.
+  bool cmd_run;       // Is command server running.
+  char ap_pass[ESP_DET_AP_PASS_MAX]; // The password for access point created in ESP_DET_ST_DM.
   uint8_t ap_cn;      // The channel to use for access point created in ESP_DET_ST_DM.
   uint8_t dm_err_cnt; // Unsuccessful switches to ESP_DET_ST_DM.
   uint8_t cn_err_cnt; // Unsuccessful switches to ESP_DET_ST_CN.
   uint8_t sr_err_cnt; // Unsuccessful switches to ESP_DET_ST_DS.
+  uint32_t ds_ivl;    // The next discovery broadcast interval. Zero if not started.
+  uint32_t ds_time;   // The time spent in ESP_DET_ST_DS waiting for main server configuration.
+  uint32_t rnd;       // The random generator state.
+  uint32_t cn_ivl;    // The next reconnection delay. Zero if not reconnecting.
+  bool ap_down;       // Access point which worked before is not reachable.
   uint32 brd_addr;    // Broadcast address. Set every time we get an IP address.
   esp_det_st stage;   // The current detection stage.
   esp_det_done_cb *done_cb;    // The user program callback.
   esp_det_disconnect *disc_cb; // The wifi disconnection callback.
   esp_det_enc_dec *encrypt_cb; // Encryption callback.
   esp_det_enc_dec *decrypt_cb; // Decryption callback.
-  os_timer_t *ip_to;             // The maximum time for acquiring IP.
-  struct espconn udp_conn;       // The UDP broadcast connection.
+  os_timer_t ip_to;              // The maximum time for acquiring IP.
+  bool ip_to_armed;              // Is ip_to timer armed.
+  bool ip_to_disc;               // Did ip_to timer disconnect and schedule the next attempt.
+  struct espconn udp_conn;       // The UDP connection used in ESP_DET_ST_DS stage.
+  esp_udp udp;                   // The UDP connection details.
+  bool udp_open;                 // Is UDP connection open.
+  uint32 udp_peer;               // The sender of UDP command being handled.
+  bool fast;                     // Is fast reconnect in progress.
+  bool fast_fail;                // Did fast reconnect fail.
+  bool dhcp_renew;               // Is DHCP taking over the reused IP address.
+  uint8_t cn_bssid[6];           // The BSSID of the current connection.
+  uint8_t cn_ch;                 // The channel of the current connection.
+  struct ip_info cn_ip;          // The IP of the current connection.
+  uint16 dis_len;                         // The discovery payload length. Zero if not built yet.
+  char dis_msg[ESP_DET_DIS_MSG_MAX];      // The discovery broadcast payload.
+  char nonce[ESP_DET_NONCE_MAX];          // The nonce UDP commands must carry. Empty if not set.
+  uint32_t cfg_wr_cnt;  // The number of esp_cfg writes since boot.
+  uint32_t brd_cnt;     // The number of discovery broadcasts sent since boot.
+  uint32_t rcn_cnt;     // The number of scheduled reconnects since boot.
+  uint32_t disc_cnt;    // The number of disconnects since boot.
+  uint32_t disc_mask;   // The disconnect reasons seen since boot.
+  uint8_t disc_last;    // The last disconnect reason.
+  uint32_t heap_min;    // The free heap low-water mark.
+  uint32_t stage_ms;    // The milliseconds spent in the current stage till stage_tick.
+  uint32_t stage_tick;  // The system time in microseconds stage_ms was last updated at.
+  os_timer_t stage_to;  // Updates stage_ms before the system time wraps.
 } det_state;
 
 // The configuration loaded from flash.
@@ -83,22 +266,122 @@ static flash_cfg *g_cfg;
 // The detection state.
 static det_state *g_sta;
 
+// The in place encryption callback.
+static esp_det_crypt *g_crypt_enc;
+// The in place decryption callback.
+static esp_det_crypt *g_crypt_dec;
+
+#if ESP_DET_STATIC
+static flash_cfg g_cfg_mem;
+static det_state g_sta_mem;
+// The command decryption buffer, also the plaintext copy esp_det_enc_dec
+// encryption callback reads the response from.
+static uint8_t g_req_mem[ESP_DET_CMD_REQ_MAX + 1 > ESP_DET_RES_MAX ? ESP_DET_CMD_REQ_MAX + 1 : ESP_DET_RES_MAX];
+// The UDP response buffer.
+static uint8_t g_res_mem[ESP_DET_RES_MAX];
+#endif
+
+#if ESP_DET_CMD_CJSON
+// The user program cJSON allocator. Empty for cJSON defaults.
+static cJSON_Hooks g_json_hooks;
+#endif
+
 ///////////////////////////////////////////////////////////////////////////////
 // Declarations                                                              //
 ///////////////////////////////////////////////////////////////////////////////
 
-static esp_cfg_err ICACHE_FLASH_ATTR load_config();
+static esp_det_err ICACHE_FLASH_ATTR load_config();
+
+static esp_det_err ICACHE_FLASH_ATTR cfg_write();
 
-static esp_cfg_err ICACHE_FLASH_ATTR cfg_reset();
+static esp_det_err ICACHE_FLASH_ATTR cfg_reset();
 
-static esp_cfg_err ICACHE_FLASH_ATTR cfg_set_stage(esp_det_st stage);
+static esp_det_err ICACHE_FLASH_ATTR cfg_set_stage(esp_det_st stage);
+
+static bool ICACHE_FLASH_ATTR udp_open();
+
+static void ICACHE_FLASH_ATTR udp_close();
 
 static bool ICACHE_FLASH_ATTR udp_send_dis_packet(uint32 ip, uint32 port);
 
-static unsigned short ICACHE_FLASH_ATTR cmd_handle_cb(uint8_t *res,
-                                                      uint16 res_len,
-                                                      const uint8_t *req,
-                                                      uint16_t req_len);
+static void ICACHE_FLASH_ATTR cmd_discovery();
+
+static void ICACHE_FLASH_ATTR main_e_cb(void *arg);
+
+static void ICACHE_FLASH_ATTR got_ip_e_cb(void *arg);
+
+static void ICACHE_FLASH_ATTR disc_e_cb(void *arg);
+
+static void ICACHE_FLASH_ATTR call_user_e_cb(void *arg);
+
+static void ICACHE_FLASH_ATTR send_udp_br_e_cb(void *arg);
+
+static bool ICACHE_FLASH_ATTR has_decrypt();
+
+static uint16 ICACHE_FLASH_ATTR cmd_handle_cb(uint8_t *res,
+                                              uint16 res_len,
+                                              uint8_t *req,
+                                              uint16 req_len);
+
+///////////////////////////////////////////////////////////////////////////////
+// Events                                                                    //
+///////////////////////////////////////////////////////////////////////////////
+
+// The event handlers indexed by det_ev.
+static det_ev_cb *const ev_handlers[ESP_DET_EV_CNT] = {
+  main_e_cb,
+  got_ip_e_cb,
+  disc_e_cb,
+  call_user_e_cb,
+  send_udp_br_e_cb,
+};
+
+// The pending events indexed by det_ev.
+static det_ev_slot g_ev[ESP_DET_EV_CNT];
+
+/** Run event handler when its timer fires. */
+static void ICACHE_FLASH_ATTR
+ev_timer_cb(void *arg)
+{
+  det_ev ev = (det_ev) ((uint32_t) arg);
+  ev_handlers[ev](g_ev[ev].arg);
+}
+
+/**
+ * Trigger library event after delay.
+ *
+ * Every event has one timer so triggering event which is already
+ * pending reschedules it with the new delay and argument.
+ *
+ * @param ev    The event.
+ * @param delay The delay in milliseconds.
+ * @param arg   The event argument.
+ */
+static void ICACHE_FLASH_ATTR
+ev_trigger_delayed(det_ev ev, uint32_t delay, void *arg)
+{
+  det_ev_slot *slot = &g_ev[ev];
+
+  os_timer_disarm(&slot->timer);
+  os_timer_setfn(&slot->timer, (os_timer_func_t *) ev_timer_cb, (void *) ((uint32_t) ev));
+  slot->arg = arg;
+  os_timer_arm(&slot->timer, delay, false);
+}
+
+/**
+ * Trigger library event.
+ *
+ * The handler runs from the timer so it never runs inside the
+ * SDK callback triggering it.
+ *
+ * @param ev  The event.
+ * @param arg The event argument.
+ */
+static void ICACHE_FLASH_ATTR
+ev_trigger(det_ev ev, void *arg)
+{
+  ev_trigger_delayed(ev, 0, arg);
+}
 
 ///////////////////////////////////////////////////////////////////////////////
 // ESP detection                                                             //
@@ -107,11 +390,10 @@ static unsigned short ICACHE_FLASH_ATTR cmd_handle_cb(uint8_t *res,
 /**
  * Call user provided callback.
  *
- * @param event The event name.
- * @param arg   The data passed to the event.
+ * @param arg The data passed to the event.
  */
 static void ICACHE_FLASH_ATTR
-call_user_e_cb(const char *event, void *arg)
+call_user_e_cb(void *arg)
 {
   g_sta->done_cb((esp_det_err) ((uint32_t) arg));
 }
@@ -154,7 +436,7 @@ create_ap()
   os_memset(ap_name, 0, ESP_DET_AP_NAME_MAX);
   os_sprintf(ap_name, "IOT_%02X%02X%02X%02X%02X%02X", MAC2STR(mac_address));
 
-  ESP_DET_DEBUG("Creating access point %s / %s\n", ap_name, g_sta->ap_pass);
+  ESP_DET_DEBUG("Creating access point on channel %d.\n", g_sta->ap_cn);
 
   // Make sure we are in correct opmode.
   if (wifi_get_opmode() != STATIONAP_MODE) {
@@ -204,7 +486,9 @@ create_ap()
 }
 
 /**
- * Set access point connection details and write it to flash.
+ * Set access point connection details.
+ *
+ * The configuration is written to flash by the following cfg_write.
  *
  * @param ap_name The access point name.
  * @param ap_pass The access point password.
@@ -217,44 +501,182 @@ cfg_set_ap(char *ap_name, char *ap_pass)
   struct station_config station_config;
 
   strlcpy(g_cfg->ap_name, ap_name, ESP_DET_AP_NAME_MAX);
-  strlcpy(g_cfg->ap_pass, ap_pass, ESP_DET_AP_NAME_MAX);
+  strlcpy(g_cfg->ap_pass, ap_pass, ESP_DET_AP_PASS_MAX);
+  g_cfg->ap_ch = 0;
 
-  ESP_DET_DEBUG("Setting access point config: %s/%s\n", ap_name, ap_pass);
+  ESP_DET_DEBUG("Setting access point config: %s\n", g_cfg->ap_name);
 
   os_memset(&station_config, 0, sizeof(struct station_config));
-  strlcpy((char *) station_config.ssid, ap_name, 32);
-  strlcpy((char *) station_config.password, ap_pass, 64);
+  // The SDK fields are not NULL terminated when full.
+  os_strncpy((char *) station_config.ssid, ap_name, 32);
+  os_strncpy((char *) station_config.password, ap_pass, 64);
 
   ETS_UART_INTR_DISABLE();
   bool success = wifi_station_set_config(&station_config);
   ETS_UART_INTR_ENABLE();
   if (success == false) return ESP_DET_ERR_AP;
 
-  esp_cfg_err err = esp_cfg_write(ESP_DET_CFG_IDX);
-  if (err != ESP_CFG_OK) return ESP_DET_ERR_CFG;
-
   return ESP_DET_OK;
 }
 
 /**
- * Save main server connection details to flash.
+ * Set main server connection details.
+ *
+ * The configuration is written to flash by the following cfg_write.
  *
  * @param ip   The main server IP address.
  * @param port The main server port.
  * @param user The main server user.
  * @param pass The main server password.
- *
- * @return The status of flash operation.
  */
-static esp_cfg_err ICACHE_FLASH_ATTR
+static void ICACHE_FLASH_ATTR
 cfg_set_srv(uint32_t ip, uint16_t port, char *user, char *pass)
 {
   g_cfg->srv_ip = ip;
   g_cfg->srv_port = port;
   strlcpy(g_cfg->srv_user, user, ESP_DET_SRV_USER_MAX);
   strlcpy(g_cfg->srv_pass, pass, ESP_DET_SRV_PASS_MAX);
+}
+
+/**
+ * Update fast reconnect details with current connection.
+ *
+ * @return Returns true if details changed and need to be written to flash.
+ */
+static bool ICACHE_FLASH_ATTR
+cfg_set_fast()
+{
+  if (g_sta->cn_ch == 0) return false;
+
+  if (g_cfg->ap_ch == g_sta->cn_ch
+      && os_memcmp(g_cfg->ap_bssid, g_sta->cn_bssid, 6) == 0
+      && g_cfg->ip == g_sta->cn_ip.ip.addr
+      && g_cfg->netmask == g_sta->cn_ip.netmask.addr
+      && g_cfg->gw == g_sta->cn_ip.gw.addr) {
+    return false;
+  }
+
+  os_memcpy(g_cfg->ap_bssid, g_sta->cn_bssid, 6);
+  g_cfg->ap_ch = g_sta->cn_ch;
+  g_cfg->ip = g_sta->cn_ip.ip.addr;
+  g_cfg->netmask = g_sta->cn_ip.netmask.addr;
+  g_cfg->gw = g_sta->cn_ip.gw.addr;
+
+  return true;
+}
+
+/**
+ * Configure station to connect directly to the last known access point.
+ *
+ * @return Returns true if fast reconnect was set up.
+ */
+static bool ICACHE_FLASH_ATTR
+fast_setup()
+{
+  struct station_config station_config;
+
+  if (g_sta->fast_fail || g_cfg->ap_ch == 0) return false;
+  if (!wifi_station_get_config(&station_config)) return false;
+
+  station_config.bssid_set = 1;
+  os_memcpy(station_config.bssid, g_cfg->ap_bssid, 6);
+
+  ETS_UART_INTR_DISABLE();
+  bool success = wifi_station_set_config_current(&station_config);
+  ETS_UART_INTR_ENABLE();
+  if (!success) return false;
+
+  wifi_set_channel(g_cfg->ap_ch);
+
+#if ESP_DET_FAST_IP
+  struct ip_info ip_info;
+  ip_info.ip.addr = g_cfg->ip;
+  ip_info.netmask.addr = g_cfg->netmask;
+  ip_info.gw.addr = g_cfg->gw;
+
+  wifi_station_dhcpc_stop();
+  if (!wifi_set_ip_info(STATION_IF, &ip_info)) wifi_station_dhcpc_start();
+#endif
+
+  ESP_DET_DEBUG("Fast reconnect to " MACSTR " on channel %d.\n", MAC2STR(g_cfg->ap_bssid), g_cfg->ap_ch);
+
+  return true;
+}
+
+/** Fall back from fast reconnect to regular connection. */
+static void ICACHE_FLASH_ATTR
+fast_revert()
+{
+  struct station_config station_config;
+
+  ESP_DET_DEBUG("Fast reconnect failed.\n");
+
+  g_sta->fast = false;
+  g_sta->fast_fail = true;
+
+  if (wifi_station_get_config(&station_config)) {
+    station_config.bssid_set = 0;
+    ETS_UART_INTR_DISABLE();
+    wifi_station_set_config_current(&station_config);
+    ETS_UART_INTR_ENABLE();
+  }
+
+#if ESP_DET_FAST_IP
+  wifi_station_dhcpc_start();
+#endif
+}
+
+/**
+ * Seed random generator with device MAC address.
+ */
+static void ICACHE_FLASH_ATTR
+rnd_seed()
+{
+  uint8_t idx;
+  uint8 mac[6];
+
+  os_memset(mac, 0, 6);
+  wifi_get_macaddr(STATION_IF, mac);
+
+  // FNV-1a hash of the MAC address.
+  g_sta->rnd = 2166136261u;
+  for (idx = 0; idx < 6; idx++) {
+    g_sta->rnd = (g_sta->rnd ^ mac[idx]) * 16777619u;
+  }
+  if (g_sta->rnd == 0) g_sta->rnd = 1;
+}
+
+/**
+ * Return next pseudo random number.
+ *
+ * @return The random number.
+ */
+static uint32_t ICACHE_FLASH_ATTR
+rnd_next()
+{
+  // Xorshift32.
+  g_sta->rnd ^= g_sta->rnd << 13;
+  g_sta->rnd ^= g_sta->rnd >> 17;
+  g_sta->rnd ^= g_sta->rnd << 5;
+
+  return g_sta->rnd;
+}
+
+/**
+ * Apply random jitter to the interval.
+ *
+ * @param ivl    The interval.
+ * @param jitter The jitter in percents of the interval.
+ *
+ * @return The interval in range ivl +/- jitter percent.
+ */
+static uint32_t ICACHE_FLASH_ATTR
+rnd_jitter(uint32_t ivl, uint32_t jitter)
+{
+  uint32_t span = ivl * jitter / 100;
+  if (span == 0) return ivl;
 
-  return esp_cfg_write(ESP_DET_CFG_IDX);
+  return ivl - span + rnd_next() % (2 * span + 1);
 }
 
 /**
@@ -269,17 +691,86 @@ trigger_main(bool reset_cfg, uint32_t delay)
   ESP_DET_DEBUG("Triggering main with delay %d.\n", delay);
 
   if (reset_cfg) cfg_reset();
-  esp_eb_trigger_delayed(ESP_DET_EV_MAIN, delay, NULL);
+  ev_trigger_delayed(ESP_DET_EV_MAIN, delay, NULL);
+}
+
+/** Update the free heap low-water mark. */
+static void ICACHE_FLASH_ATTR
+stats_heap()
+{
+  uint32_t heap = system_get_free_heap_size();
+  if (g_sta->heap_min == 0 || heap < g_sta->heap_min) g_sta->heap_min = heap;
+}
+
+/** Start counting time spent in the current stage. */
+static void ICACHE_FLASH_ATTR
+stats_stage()
+{
+  g_sta->stage_ms = 0;
+  g_sta->stage_tick = system_get_time();
+}
+
+/**
+ * Add time since the last update to the time spent in the current stage.
+ *
+ * The system time wraps every 71 minutes so this runs from the
+ * stage_to timer every ESP_DET_STAGE_TICK milliseconds.
+ */
+static void ICACHE_FLASH_ATTR
+stats_time()
+{
+  uint32_t ms = (system_get_time() - g_sta->stage_tick) / 1000;
+
+  g_sta->stage_ms += ms;
+  g_sta->stage_tick += ms * 1000;
+}
+
+/**
+ * Record disconnect reason.
+ *
+ * @param reason The disconnect reason.
+ */
+static void ICACHE_FLASH_ATTR
+stats_disc(uint32_t reason)
+{
+  g_sta->disc_cnt++;
+  g_sta->disc_last = (uint8_t) reason;
+
+  if (reason < 24) {
+    g_sta->disc_mask |= 1UL << reason;
+  } else if (reason >= 200 && reason < 208) {
+    g_sta->disc_mask |= 1UL << (24 + reason - 200);
+  } else {
+    g_sta->disc_mask |= 1UL;
+  }
+}
+
+/**
+ * Schedule next attempt to connect to access point.
+ *
+ * Delays grow exponentially and are randomized so devices which lost
+ * the same access point do not reconnect all at the same time.
+ */
+static void ICACHE_FLASH_ATTR
+cn_schedule()
+{
+  if (g_sta->cn_ivl == 0) g_sta->cn_ivl = ESP_DET_CN_DELAY;
+  uint32_t delay = rnd_jitter(g_sta->cn_ivl, ESP_DET_CN_JITTER);
+
+  g_sta->cn_ivl = g_sta->cn_ivl * ESP_DET_CN_BACKOFF / 100;
+  if (g_sta->cn_ivl > ESP_DET_CN_DELAY_MAX) g_sta->cn_ivl = ESP_DET_CN_DELAY_MAX;
+  g_sta->rcn_cnt++;
+
+  trigger_main(false, delay);
 }
 
 void ICACHE_FLASH_ATTR
 stop_ip_to()
 {
-  if (g_sta->ip_to == NULL) return;
+  if (!g_sta->ip_to_armed) return;
 
-  os_timer_disarm(g_sta->ip_to);
-  os_free(g_sta->ip_to);
-  g_sta->ip_to = NULL;
+  os_timer_disarm(&g_sta->ip_to);
+  g_sta->ip_to_armed = false;
 }
 
 /** Getting IP address timeout callback. */
@@ -289,6 +780,25 @@ get_ip_to_cb()
   ESP_DET_DEBUG("Running get_ip_to_cb in stage %d\n", g_sta->stage);
 
   stop_ip_to();
+
+  // The next attempt is scheduled here. The disconnect event it
+  // causes must not schedule another one.
+  if (g_sta->fast) {
+    g_sta->ip_to_disc = true;
+    wifi_station_disconnect();
+    fast_revert();
+    trigger_main(false, ESP_DET_FAST_CALL);
+    return;
+  }
+
+  // Never reset configuration which worked before.
+  if (g_cfg->ap_ch != 0) {
+    g_sta->ip_to_disc = true;
+    wifi_station_disconnect();
+    cn_schedule();
+    return;
+  }
+
   cfg_reset();
   trigger_main(true, ESP_DET_FAST_CALL);
 }
@@ -296,16 +806,34 @@ get_ip_to_cb()
 /**
  * Got IP address callback.
  *
- * @param event The event name.
- * @param arg   The event argument.
+ * @param arg The event argument.
  */
 static void ICACHE_FLASH_ATTR
-got_ip_e_cb(const char *event, void *arg)
+got_ip_e_cb(void *arg)
 {
   ESP_DET_DEBUG("Running got_ip_e_cb in stage %d.\n", g_sta->stage);
+  ESP_DET_TRACE_EV(ESP_DET_TR_GOT_IP, g_sta->stage);
 
   stop_ip_to();
+
+#if ESP_DET_FAST_IP
+  // The reused address has no DHCP lease. Hand it over to DHCP so the lease
+  // is renewed and the router does not give the address to another host.
+  // Nothing changes when DHCP binds the same address.
+  if (g_sta->dhcp_renew) {
+    g_sta->dhcp_renew = false;
+    if (g_sta->connected && g_cfg->ip == g_sta->cn_ip.ip.addr) return;
+  } else if (wifi_station_dhcpc_status() == DHCP_STOPPED) {
+    g_sta->dhcp_renew = wifi_station_dhcpc_start();
+  }
+#endif
+
   g_sta->connected = true;
+  g_sta->fast = false;
+  g_sta->fast_fail = false;
+  g_sta->cn_ivl = 0;
+  g_sta->ap_down = false;
+  bool fast_changed = cfg_set_fast();
 
   if (g_sta->stage == ESP_DET_ST_CN) {
     if (g_sta->det_srv && g_cfg->srv_ip == 0) {
@@ -318,6 +846,8 @@ got_ip_e_cb(const char *event, void *arg)
     return;
   }
 
+  if (fast_changed) cfg_write();
+
   if (g_sta->stage == ESP_DET_ST_OP) {
     trigger_main(false, ESP_DET_FAST_CALL);
     return;
@@ -327,41 +857,107 @@ got_ip_e_cb(const char *event, void *arg)
 }
 
 static void ICACHE_FLASH_ATTR
-disc_e_cb(const char *event, void *arg)
+disc_e_cb(void *arg)
 {
   uint32_t reason = (uint32_t) arg;
 
   ESP_DET_DEBUG("Running disc_e_cb in stage %d reason %d.\n", g_sta->stage, reason);
+  ESP_DET_TRACE_EV(ESP_DET_TR_DISC, reason);
   g_sta->connected = false;
+  g_sta->dhcp_renew = false;
+  stats_disc(reason);
 
   if (g_sta->stage == ESP_DET_ST_DM) return;
 
-  if (g_sta->stage == ESP_DET_ST_CN) {
+  // Every attempt gets its own IP timeout.
+  stop_ip_to();
+
+  if (g_sta->ip_to_disc) {
+    g_sta->ip_to_disc = false;
+    return;
+  }
+
+  if (g_sta->fast) {
+    fast_revert();
     trigger_main(false, ESP_DET_FAST_CALL);
     return;
   }
 
+  if (g_sta->stage == ESP_DET_ST_CN) {
+    cn_schedule();
+    return;
+  }
+
   if (g_sta->disc_cb && g_sta->stage == ESP_DET_ST_OP) g_sta->disc_cb();
   cfg_set_stage(ESP_DET_ST_CN);
-  trigger_main(false, ESP_DET_FAST_CALL);
+  cn_schedule();
 }
 
 static void ICACHE_FLASH_ATTR
-send_udp_br_e_cb(const char *event, void *arg)
+send_udp_br_e_cb(void *arg)
 {
   if (g_sta->connected == false) return;
   if (g_cfg->srv_ip != 0 && g_cfg->srv_port != 0) return;
 
-  g_sta->sr_err_cnt += 1;
-  if (g_sta->sr_err_cnt >= 10) {
+  if (g_sta->ds_time >= ESP_DET_DS_BUDGET) {
     cfg_reset();
     trigger_main(true, ESP_DET_SLOW_CALL);
     return;
   }
 
-  bool success = udp_send_dis_packet(g_sta->brd_addr, ESP_DET_CMD_PORT);
-  if (success) ESP_DET_DEBUG("Broadcast #%d sent.\n", g_sta->sr_err_cnt);
-  esp_eb_trigger_delayed(ESP_DET_EV_DISC_SRV, 1000, NULL);
+  if (g_sta->sr_err_cnt < 0xFF) g_sta->sr_err_cnt += 1;
+
+  // Try the known manager first. Fall back to broadcast when it does not answer.
+  bool unicast = g_cfg->mgr_ip != 0 && g_sta->sr_err_cnt <= ESP_DET_DS_UNICAST_MISS;
+  bool success = udp_send_dis_packet(unicast ? g_cfg->mgr_ip : g_sta->brd_addr, ESP_DET_CMD_PORT);
+  if (success) {
+    ESP_DET_DEBUG("Discovery #%d sent.\n", g_sta->sr_err_cnt);
+    if (!unicast) g_sta->brd_cnt++;
+  }
+  ESP_DET_TRACE_EV(ESP_DET_TR_BRD, success);
+
+  // Exponential back off with jitter.
+  if (g_sta->ds_ivl == 0) g_sta->ds_ivl = ESP_DET_DS_INTERVAL;
+  uint32_t delay = rnd_jitter(g_sta->ds_ivl, ESP_DET_DS_JITTER);
+  g_sta->ds_time += delay;
+  g_sta->ds_ivl = g_sta->ds_ivl * ESP_DET_DS_BACKOFF / 100;
+  if (g_sta->ds_ivl > ESP_DET_DS_INTERVAL_MAX) g_sta->ds_ivl = ESP_DET_DS_INTERVAL_MAX;
+
+  ev_trigger_delayed(ESP_DET_EV_DISC_SRV, delay, NULL);
+}
+
+/**
+ * Start command server.
+ *
+ * @return Returns true on success.
+ */
+static bool ICACHE_FLASH_ATTR
+cmd_start()
+{
+  // Ciphertext may look like a frame so encrypted commands are framed
+  // only with length prefix and only when managers opted in.
+  uint8_t framing = ESP_DET_SRV_FR_LEN | ESP_DET_SRV_FR_JSON;
+  if (has_decrypt()) framing = ESP_DET_SRV_CRYPT_FRAMED ? ESP_DET_SRV_FR_LEN : 0;
+
+  sint8 cmd_err = esp_det_srv_start(ESP_DET_CMD_PORT, ESP_DET_CMD_MAX, &cmd_handle_cb, framing);
+  if (cmd_err != ESPCONN_OK) {
+    ESP_DET_ERROR("Starting command server failed with error code %d.\n", cmd_err);
+    return false;
+  }
+
+  g_sta->cmd_run = true;
+
+  return true;
+}
+
+/** Stop command server. */
+static void ICACHE_FLASH_ATTR
+cmd_stop()
+{
+  if (!g_sta->cmd_run) return;
+
+  esp_det_srv_stop();
+  g_sta->cmd_run = false;
 }
 
 /** Go into detect me stage */
@@ -374,14 +970,12 @@ stage_detect_me()
 
   // Check back off.
   g_sta->dm_err_cnt += 1;
-  if (g_sta->dm_err_cnt >= 10) {
+  if (g_sta->dm_err_cnt >= ESP_DET_DM_RETRY_MAX) {
     cfg_reset();
     trigger_main(true, ESP_DET_SLOW_CALL);
     return;
   }
 
-  g_sta->dm_run = true;
-
   // Setup
   err = create_ap();
   if (err != ESP_DET_OK) {
@@ -389,9 +983,7 @@ stage_detect_me()
     return;
   }
 
-  sint8 cmd_err = esp_cmd_start(ESP_DET_CMD_PORT, ESP_DET_CMD_MAX, &cmd_handle_cb);
-  if (cmd_err != ESPCONN_OK && cmd_err != ESP_CMD_ERR_ALREADY_STARTED) {
-    ESP_DET_ERROR("Starting command server failed with error code %d.\n", cmd_err);
+  if (!cmd_start()) {
     trigger_main(false, ESP_DET_SLOW_CALL);
     return;
   }
@@ -405,30 +997,40 @@ stage_connect()
 {
   ESP_DET_DEBUG("Running stage_connect in stage %d.\n", g_sta->stage);
 
-  g_sta->cn_err_cnt += 1;
-  if (g_sta->cn_err_cnt >= 10) {
-    cfg_reset();
-    trigger_main(true, ESP_DET_SLOW_CALL);
-    return;
+  // Disconnecting before association produces no event.
+  g_sta->ip_to_disc = false;
+
+  if (g_sta->cn_err_cnt < ESP_DET_CN_RETRY_MAX) g_sta->cn_err_cnt += 1;
+  if (g_sta->cn_err_cnt >= ESP_DET_CN_RETRY_MAX) {
+    // Credentials which never worked are reset. If they did
+    // work access point is most likely down, keep trying.
+    if (g_cfg->ap_ch == 0) {
+      cfg_reset();
+      trigger_main(true, ESP_DET_SLOW_CALL);
+      return;
+    }
+
+    if (!g_sta->ap_down) ESP_DET_DEBUG("Access point is down. Waiting for it.\n");
+    g_sta->ap_down = true;
   }
 
+  if (!g_sta->ip_to_armed) g_sta->fast = fast_setup();
+
   ETS_UART_INTR_DISABLE();
-  if (wifi_station_connect() == false) {
+  bool success = wifi_station_connect();
+  ETS_UART_INTR_ENABLE();
+  if (success == false) {
     ESP_DET_ERROR("Calling wifi_station_connect failed.\n");
+    if (g_sta->fast) fast_revert();
     trigger_main(false, ESP_DET_SLOW_CALL);
     return;
   }
-  ETS_UART_INTR_ENABLE();
 
-  if (g_sta->ip_to == NULL) {
-    g_sta->ip_to = os_zalloc(sizeof(os_timer_t));
-    if (g_sta->ip_to == NULL) {
-      ESP_DET_ERROR("Out of memory allocating os_timer_t\n");
-      return;
-    }
-    os_timer_setfn(g_sta->ip_to, (os_timer_func_t *) get_ip_to_cb, NULL);
-    // Wait 15 seconds for IP.
-    os_timer_arm(g_sta->ip_to, 15000, false);
+  if (!g_sta->ip_to_armed) {
+    os_timer_disarm(&g_sta->ip_to);
+    os_timer_setfn(&g_sta->ip_to, (os_timer_func_t *) get_ip_to_cb, NULL);
+    os_timer_arm(&g_sta->ip_to, g_sta->fast ? ESP_DET_FAST_TIMEOUT : ESP_DET_IP_TIMEOUT, false);
+    g_sta->ip_to_armed = true;
   }
 }
 
@@ -439,7 +1041,16 @@ stage_detect_srv()
   ESP_DET_DEBUG("Running stage_detect_srv in stage %d.\n", g_sta->stage);
 
   if (g_sta->stage == ESP_DET_ST_DS) {
-    esp_eb_trigger(ESP_DET_EV_DISC_SRV, NULL);
+    cmd_discovery();
+    if (!cmd_start() || !udp_open()) {
+      trigger_main(false, ESP_DET_SLOW_CALL);
+      return;
+    }
+
+    // Spread the first broadcast of devices which got IP at the same time.
+    uint32_t delay = rnd_next() % (ESP_DET_DS_INTERVAL * ESP_DET_DS_JITTER / 100 + 1);
+    g_sta->ds_time += delay;
+    ev_trigger_delayed(ESP_DET_EV_DISC_SRV, delay, NULL);
   }
 }
 
@@ -449,26 +1060,33 @@ stage_operational()
 {
   ESP_DET_DEBUG("Running stage_operational in stage %d.\n", g_sta->stage);
 
-  if (g_sta->dm_run) {
-    ESP_DET_DEBUG("Will restart...\n");
-    system_restart();
-    return;
+  // Tear down what detect me and detect main server stages set up.
+  // The station connection is kept when switching off the access point.
+  cmd_stop();
+  if (wifi_get_opmode() != STATION_MODE) {
+    if (!wifi_set_opmode_current(STATION_MODE)) {
+      ESP_DET_ERROR("Failed switching to station mode.\n");
+    }
   }
 
-  wifi_set_opmode(STATION_MODE);
-  esp_eb_trigger(ESP_DET_EV_USER, NULL);
+  ev_trigger(ESP_DET_EV_USER, NULL);
 }
 
 /**
  * Main ESP detect event handler.
  *
- * @param event The event name.
- * @param arg   The event argument.
+ * @param arg The event argument.
  */
 static void ICACHE_FLASH_ATTR
-main_e_cb(const char *event, void *arg)
+main_e_cb(void *arg)
 {
   ESP_DET_DEBUG("Running main_e_cb in stage %d.\n", g_sta->stage);
+  stats_heap();
+
+  // The UDP connection is only needed in ESP_DET_ST_DS stage.
+  // It's closed here and not when stage changes because
+  // the change may be requested by a command received on it.
+  if (g_sta->stage != ESP_DET_ST_DS) udp_close();
 
   if (g_sta->stage == ESP_DET_ST_DM) {
     stage_detect_me();
@@ -494,7 +1112,7 @@ main_e_cb(const char *event, void *arg)
 
   ESP_DET_ERROR("Unexpected stage %d. Resetting config.\n", g_sta->stage);
   cfg_reset();
-  esp_eb_trigger_delayed(ESP_DET_EV_MAIN, ESP_DET_SLOW_CALL, NULL);
+  ev_trigger_delayed(ESP_DET_EV_MAIN, ESP_DET_SLOW_CALL, NULL);
 }
 
 /**
@@ -505,16 +1123,22 @@ main_e_cb(const char *event, void *arg)
 static void ICACHE_FLASH_ATTR
 wifi_event_cb(System_Event_t *event)
 {
+  ESP_DET_TRACE_EV(ESP_DET_TR_WIFI, event->event);
+  stats_heap();
+
   switch (event->event) {
     case EVENT_STAMODE_CONNECTED:
       ESP_DET_DEBUG("Wifi event: EVENT_STAMODE_CONNECTED\n");
+
+      os_memcpy(g_sta->cn_bssid, event->event_info.connected.bssid, 6);
+      g_sta->cn_ch = event->event_info.connected.channel;
       break;
 
     case EVENT_STAMODE_DISCONNECTED:
       ESP_DET_DEBUG("Wifi event: EVENT_STAMODE_DISCONNECTED reason %d\n",
                     event->event_info.disconnected.reason);
 
-      esp_eb_trigger(ESP_DET_EV_DISC, (void *) ((uint32_t) event->event_info.disconnected.reason));
+      ev_trigger(ESP_DET_EV_DISC, (void *) ((uint32_t) event->event_info.disconnected.reason));
       break;
 
     case EVENT_STAMODE_AUTHMODE_CHANGE:
@@ -529,7 +1153,10 @@ wifi_event_cb(System_Event_t *event)
                     IP2STR(&(event->event_info.got_ip.mask)));
 
       g_sta->brd_addr = event->event_info.got_ip.ip.addr | (~event->event_info.got_ip.mask.addr);
-      esp_eb_trigger(ESP_DET_EV_GOT_IP, NULL);
+      g_sta->cn_ip.ip.addr = event->event_info.got_ip.ip.addr;
+      g_sta->cn_ip.netmask.addr = event->event_info.got_ip.mask.addr;
+      g_sta->cn_ip.gw.addr = event->event_info.got_ip.gw.addr;
+      ev_trigger(ESP_DET_EV_GOT_IP, NULL);
       break;
 
     case EVENT_STAMODE_DHCP_TIMEOUT:
@@ -585,31 +1212,30 @@ esp_det_start(char *ap_pass,
               esp_det_enc_dec *decrypt,
               bool det_srv)
 {
-  esp_cfg_err err;
+  esp_det_err err;
 
   if (g_cfg != NULL) return ESP_DET_ERR_INITIALIZED;
 
+#if ESP_DET_STATIC
+  g_cfg = &g_cfg_mem;
+  g_sta = &g_sta_mem;
+#else
   g_cfg = os_zalloc(sizeof(flash_cfg));
   if (g_cfg == NULL) return ESP_DET_ERR_MEM;
 
   g_sta = os_zalloc(sizeof(det_state));
   if (g_sta == NULL) {
     os_free(g_cfg);
+    g_cfg = NULL;
     return ESP_DET_ERR_MEM;
   }
-
-  g_sta->ap_pass = os_zalloc(ESP_DET_AP_PASS_MAX);
-  if (g_sta->ap_pass == NULL) {
-    os_free(g_cfg);
-    os_free(g_sta);
-    return ESP_DET_ERR_MEM;
-  }
+#endif
 
   err = load_config();
-  if (err != ESP_CFG_OK) {
+  if (err != ESP_DET_OK) {
     ESP_DET_ERROR("Error %d loading configuration. Resetting config.\n", err);
     err = cfg_reset();
-    if (err != ESP_CFG_OK) {
+    if (err != ESP_DET_OK) {
       ESP_DET_ERROR("Error %d resetting config.\n", err);
       return ESP_DET_ERR_CFG;
     }
@@ -622,21 +1248,22 @@ esp_det_start(char *ap_pass,
   g_sta->ap_cn = ap_cn;
   g_sta->det_srv = det_srv;
   g_sta->stage = g_cfg->stage;
+  stats_stage();
+  ESP_DET_TRACE_EV(ESP_DET_TR_STAGE, g_sta->stage);
   g_sta->connected = false;
   strlcpy(g_sta->ap_pass, ap_pass, ESP_DET_AP_PASS_MAX);
 
+  os_timer_disarm(&g_sta->stage_to);
+  os_timer_setfn(&g_sta->stage_to, (os_timer_func_t *) stats_time, NULL);
+  os_timer_arm(&g_sta->stage_to, ESP_DET_STAGE_TICK, true);
+
   init();
+  rnd_seed();
+  stats_heap();
   wifi_set_event_handler_cb(wifi_event_cb);
 
-  // Attach event handlers.
-  esp_eb_attach(ESP_DET_EV_MAIN, main_e_cb);
-  esp_eb_attach(ESP_DET_EV_GOT_IP, got_ip_e_cb);
-  esp_eb_attach(ESP_DET_EV_DISC, disc_e_cb);
-  esp_eb_attach(ESP_DET_EV_USER, call_user_e_cb);
-  esp_eb_attach(ESP_DET_EV_DISC_SRV, send_udp_br_e_cb);
-
   // Kick off the detection process.
-  esp_eb_trigger(ESP_DET_EV_MAIN, NULL);
+  ev_trigger(ESP_DET_EV_MAIN, NULL);
 
   return ESP_DET_OK;
 }
@@ -649,35 +1276,177 @@ esp_det_reset()
 }
 
 void ICACHE_FLASH_ATTR
-esp_det_get_srv(esp_det_srv *srv)
+esp_det_set_crypt(esp_det_crypt *encrypt, esp_det_crypt *decrypt)
 {
-  srv->ip = g_cfg->srv_ip;
-  srv->port = g_cfg->srv_port;
-  strlcpy(srv->user, g_cfg->srv_user, ESP_DET_SRV_USER_MAX);
-  strlcpy(srv->pass, g_cfg->srv_pass, ESP_DET_SRV_PASS_MAX);
+  g_crypt_enc = encrypt;
+  g_crypt_dec = decrypt;
 }
 
-uint32_t ICACHE_FLASH_ATTR
+#if ESP_DET_CMD_CJSON
+void ICACHE_FLASH_ATTR
+esp_det_set_json_alloc(void *(*malloc_fn)(size_t size), void (*free_fn)(void *ptr))
+{
+  g_json_hooks.malloc_fn = malloc_fn;
+  g_json_hooks.free_fn = free_fn;
+}
+#endif
+
+void ICACHE_FLASH_ATTR
+esp_det_get_stats(esp_det_stats *stats)
+{
+  os_memset(stats, 0, sizeof(esp_det_stats));
+  if (g_sta == NULL) return;
+
+  stats->stage = (uint8_t) g_sta->stage;
+  stats->dm_err_cnt = g_sta->dm_err_cnt;
+  stats->cn_err_cnt = g_sta->cn_err_cnt;
+  stats->sr_err_cnt = g_sta->sr_err_cnt;
+#if ESP_DET_CFG_JRNL
+  stats->flash_wr = esp_det_jrnl_write_cnt();
+  stats->flash_er = esp_det_jrnl_erase_cnt();
+#else
+  // Every esp_cfg write erases the sector.
+  stats->flash_wr = g_sta->cfg_wr_cnt;
+  stats->flash_er = g_sta->cfg_wr_cnt;
+#endif
+  stats->brd_cnt = g_sta->brd_cnt;
+  stats->rcn_cnt = g_sta->rcn_cnt;
+  stats->disc_cnt = g_sta->disc_cnt;
+  stats->disc_mask = g_sta->disc_mask;
+  stats->disc_last = g_sta->disc_last;
+  stats->heap_min = g_sta->heap_min;
+  stats_time();
+  stats->stage_time = g_sta->stage_ms;
+}
+
+void ICACHE_FLASH_ATTR
+esp_det_get_srv(esp_det_srv *srv)
+{
+  srv->ip = g_cfg->srv_ip;
+  srv->port = g_cfg->srv_port;
+  strlcpy(srv->user, g_cfg->srv_user, ESP_DET_SRV_USER_MAX);
+  strlcpy(srv->pass, g_cfg->srv_pass, ESP_DET_SRV_PASS_MAX);
+}
+
+uint32_t ICACHE_FLASH_ATTR
 get_start_cnt()
 {
   return g_cfg->load_cnt;
 }
 
+/**
+ * Calculate RTC memory checksum.
+ *
+ * @param rtc The RTC memory structure.
+ *
+ * @return The checksum.
+ */
+static uint32_t ICACHE_FLASH_ATTR
+rtc_sum(det_rtc *rtc)
+{
+  return ~(rtc->magic + rtc->load_cnt);
+}
+
+/**
+ * Read boot counter from RTC memory.
+ *
+ * @param load_cnt Set to the boot counter.
+ *
+ * @return Returns false if RTC memory does not hold valid counter.
+ */
+static bool ICACHE_FLASH_ATTR
+rtc_get_cnt(uint32_t *load_cnt)
+{
+  det_rtc rtc;
+
+  if (!system_rtc_mem_read(ESP_DET_RTC_BLOCK, &rtc, sizeof(det_rtc))) return false;
+  if (rtc.magic != ESP_DET_RTC_MAGIC || rtc.sum != rtc_sum(&rtc)) return false;
+
+  *load_cnt = rtc.load_cnt;
+
+  return true;
+}
+
+/**
+ * Write boot counter to RTC memory.
+ *
+ * @param load_cnt The boot counter.
+ */
+static void ICACHE_FLASH_ATTR
+rtc_set_cnt(uint32_t load_cnt)
+{
+  det_rtc rtc;
+
+  rtc.magic = ESP_DET_RTC_MAGIC;
+  rtc.load_cnt = load_cnt;
+  rtc.sum = rtc_sum(&rtc);
+
+  system_rtc_mem_write(ESP_DET_RTC_BLOCK, &rtc, sizeof(det_rtc));
+}
+
+/**
+ * Convert configuration loaded in ESP_DET_CFG_MAGIC_V1 layout.
+ *
+ * Fields added since then start empty so the first connection scans
+ * for the access point.
+ *
+ * @return Returns true if configuration was converted.
+ */
+static bool ICACHE_FLASH_ATTR
+cfg_import()
+{
+  flash_cfg_v1 old;
+
+  if (g_cfg->magic != ESP_DET_CFG_MAGIC_V1) return false;
+
+  ESP_DET_DEBUG("Importing config with magic %d.\n", ESP_DET_CFG_MAGIC_V1);
+
+  os_memcpy(&old, g_cfg, sizeof(flash_cfg_v1));
+  os_memset(g_cfg, 0, sizeof(flash_cfg));
+  g_cfg->magic = ESP_DET_CFG_MAGIC;
+  g_cfg->load_cnt = old.load_cnt;
+  g_cfg->srv_ip = old.srv_ip;
+  g_cfg->srv_port = old.srv_port;
+  g_cfg->stage = old.stage;
+  strlcpy(g_cfg->srv_user, old.srv_user, ESP_DET_SRV_USER_MAX);
+  strlcpy(g_cfg->srv_pass, old.srv_pass, ESP_DET_SRV_PASS_MAX);
+  strlcpy(g_cfg->ap_name, old.ap_name, ESP_DET_AP_NAME_MAX);
+  strlcpy(g_cfg->ap_pass, old.ap_pass, ESP_DET_AP_PASS_MAX);
+
+  return true;
+}
+
 /**
  * Load ESP detect configuration from flash.
  *
  * @return The error code.
  */
-static esp_cfg_err ICACHE_FLASH_ATTR
+static esp_det_err ICACHE_FLASH_ATTR
 load_config()
 {
-  esp_cfg_err err;
-
-  err = esp_cfg_init(ESP_DET_CFG_IDX, g_cfg, sizeof(flash_cfg));
-  if (err != ESP_CFG_OK) return err;
+#if ESP_DET_CFG_JRNL
+  esp_det_jrnl_err err;
+
+  err = esp_det_jrnl_init(g_cfg, sizeof(flash_cfg));
+  if (err != ESP_DET_JRNL_OK) return ESP_DET_ERR_CFG;
+
+  err = esp_det_jrnl_read();
+  if (err == ESP_DET_JRNL_ERR_EMPTY) {
+    // Pick up configuration written by esp_cfg before journal was used.
+    // The magic number check below catches the case when there was none.
+    if (esp_cfg_init(ESP_DET_CFG_IDX, g_cfg, sizeof(flash_cfg)) == ESP_CFG_OK) {
+      esp_cfg_read(ESP_DET_CFG_IDX);
+    }
+  } else if (err != ESP_DET_JRNL_OK) {
+    return ESP_DET_ERR_CFG;
+  }
+#else
+  if (esp_cfg_init(ESP_DET_CFG_IDX, g_cfg, sizeof(flash_cfg)) != ESP_CFG_OK) return ESP_DET_ERR_CFG;
+  if (esp_cfg_read(ESP_DET_CFG_IDX) != ESP_CFG_OK) return ESP_DET_ERR_CFG;
+#endif
 
-  err = esp_cfg_read(ESP_DET_CFG_IDX);
-  if (err != ESP_CFG_OK) return err;
+  // Configuration written by older versions is converted and written back.
+  bool imported = cfg_import();
 
   // Check if we get what we expected.
   if (g_cfg->magic != ESP_DET_CFG_MAGIC) {
@@ -685,10 +1454,35 @@ load_config()
     return cfg_reset();
   }
 
-  // Bump load counter and save.
+  // Bump load counter. It's kept in RTC memory and written to flash only
+  // every ESP_DET_CNT_SYNC boots or with any other configuration change.
+  uint32_t flash_cnt = g_cfg->load_cnt;
+  uint32_t rtc_cnt;
+  if (rtc_get_cnt(&rtc_cnt) && rtc_cnt > flash_cnt) g_cfg->load_cnt = rtc_cnt;
   g_cfg->load_cnt += 1;
+  rtc_set_cnt(g_cfg->load_cnt);
+
+  if (!imported && g_cfg->load_cnt - flash_cnt < ESP_DET_CNT_SYNC) return ESP_DET_OK;
+
+  return cfg_write();
+}
+
+/**
+ * Write configuration to flash.
+ *
+ * @return Error code.
+ */
+static esp_det_err ICACHE_FLASH_ATTR
+cfg_write()
+{
+#if ESP_DET_CFG_JRNL
+  if (esp_det_jrnl_write() != ESP_DET_JRNL_OK) return ESP_DET_ERR_CFG;
+#else
+  g_sta->cfg_wr_cnt++;
+  if (esp_cfg_write(ESP_DET_CFG_IDX) != ESP_CFG_OK) return ESP_DET_ERR_CFG;
+#endif
 
-  return esp_cfg_write(ESP_DET_CFG_IDX);
+  return ESP_DET_OK;
 }
 
 /**
@@ -698,31 +1492,40 @@ load_config()
  *
  * @return Error code.
  */
-static esp_cfg_err ICACHE_FLASH_ATTR
+static esp_det_err ICACHE_FLASH_ATTR
 cfg_set_stage(esp_det_st stage)
 {
   ESP_DET_DEBUG("Setting stage to %d.\n", stage);
+  ESP_DET_TRACE_EV(ESP_DET_TR_STAGE, stage);
 
   g_cfg->stage = stage;
   g_sta->stage = stage;
+  stats_stage();
 
   // When changing detection stage we reset the error counters.
   g_sta->dm_err_cnt = 0;
   g_sta->cn_err_cnt = 0;
   g_sta->sr_err_cnt = 0;
+  g_sta->ds_ivl = 0;
+  g_sta->ds_time = 0;
+  g_sta->nonce[0] = '\0';
   stop_ip_to();
 
-  return esp_cfg_write(ESP_DET_CFG_IDX);
+  return cfg_write();
 }
 
 /**
  * Reset ESP configuration and write it to flash.
  *
- * @return The flash operation error code.
+ * @return Error code.
  */
-static esp_cfg_err ICACHE_FLASH_ATTR
+static esp_det_err ICACHE_FLASH_ATTR
 cfg_reset()
 {
+  // The manager address survives reset so discovery is unicast to it
+  // next time. Not when the configuration on flash was not valid.
+  if (g_cfg->magic != ESP_DET_CFG_MAGIC) g_cfg->mgr_ip = 0;
+
   g_cfg->magic = ESP_DET_CFG_MAGIC;
   g_cfg->load_cnt = 0;
   g_cfg->srv_ip = 0;
@@ -732,17 +1535,27 @@ cfg_reset()
   os_memset(g_cfg->srv_pass, 0, ESP_DET_SRV_PASS_MAX);
   os_memset(g_cfg->ap_name, 0, ESP_DET_AP_NAME_MAX);
   os_memset(g_cfg->ap_pass, 0, ESP_DET_AP_PASS_MAX);
+  os_memset(g_cfg->ap_bssid, 0, 6);
+  g_cfg->ap_ch = 0;
+  g_cfg->ip = 0;
+  g_cfg->netmask = 0;
+  g_cfg->gw = 0;
 
   // Reset detection state.
   g_sta->dm_err_cnt = 0;
   g_sta->cn_err_cnt = 0;
   g_sta->sr_err_cnt = 0;
+  g_sta->ds_ivl = 0;
+  g_sta->ds_time = 0;
   g_sta->brd_addr = 0;
   g_sta->stage = g_cfg->stage;
+  stats_stage();
+  ESP_DET_TRACE_EV(ESP_DET_TR_STAGE, g_sta->stage);
   g_sta->connected = false;
   stop_ip_to();
+  rtc_set_cnt(0);
 
-  return esp_cfg_write(ESP_DET_CFG_IDX);
+  return cfg_write();
 }
 
 static uint32_t ICACHE_FLASH_ATTR
@@ -751,93 +1564,915 @@ flash_real_size(void)
   return (uint32_t) (1 << ((spi_flash_get_id() >> 16) & 0xFF));
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// Encryption                                                                //
+///////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Encrypt message in place.
+ *
+ * @param buf  The message.
+ * @param len  The message length.
+ * @param size The buffer size.
+ *
+ * @return The encrypted message length. Zero if it does not fit.
+ */
 static uint16 ICACHE_FLASH_ATTR
-encrypt(uint8_t *dst, const uint8_t *src, uint16 src_len)
+encrypt(uint8_t *buf, uint16 len, uint16 size)
 {
-  if (g_sta->encrypt_cb == NULL) {
-    os_memmove(dst, src, src_len);
-    return src_len;
-  } else {
-    return g_sta->encrypt_cb(dst, src, src_len);
+  uint16 enc_len;
+  uint8_t *src;
+
+  if (g_crypt_enc != NULL) {
+    return g_crypt_enc(buf, len, size, ESP_DET_CRYPT_FIRST | ESP_DET_CRYPT_LAST);
+  }
+  if (g_sta->encrypt_cb == NULL) return len;
+
+  // The esp_det_enc_dec callbacks do not know the buffer size.
+  // Leave room for padding up to the next block.
+  if (len > ESP_DET_RES_MAX || len + ESP_DET_CRYPT_BLOCK > size) return 0;
+
+  // The esp_det_enc_dec callbacks get separate source and destination.
+#if ESP_DET_STATIC
+  src = g_req_mem;
+#else
+  src = os_malloc(len);
+  if (src == NULL) return 0; // No more memory.
+#endif
+
+  os_memcpy(src, buf, len);
+  enc_len = g_sta->encrypt_cb(buf, src, len);
+
+#if !ESP_DET_STATIC
+  os_free(src);
+#endif
+
+  return enc_len;
+}
+
+/** Returns true if received messages must be decrypted. */
+static bool ICACHE_FLASH_ATTR
+has_decrypt()
+{
+  return g_crypt_dec != NULL || g_sta->decrypt_cb != NULL;
+}
+
+/** Returns true if messages are decrypted with esp_det_enc_dec callback. */
+static bool ICACHE_FLASH_ATTR
+has_decrypt_cb()
+{
+  return g_crypt_dec == NULL && g_sta->decrypt_cb != NULL;
+}
+
+/**
+ * Start receiving message.
+ *
+ * @param rx   The receive buffer.
+ * @param buf  The message buffer.
+ * @param size The message buffer size.
+ */
+static void ICACHE_FLASH_ATTR
+rx_begin(det_rx *rx, uint8_t *buf, uint16 size)
+{
+  os_memset(rx, 0, sizeof(det_rx));
+  rx->buf = buf;
+  rx->size = size;
+}
+
+/**
+ * Decrypt received bytes in place.
+ *
+ * @param rx    The receive buffer.
+ * @param chunk The number of bytes to decrypt.
+ * @param flags The ESP_DET_CRYPT_* flags.
+ */
+static void ICACHE_FLASH_ATTR
+rx_crypt(det_rx *rx, uint16 chunk, uint8_t flags)
+{
+  if (rx->done == 0) flags |= ESP_DET_CRYPT_FIRST;
+
+  uint16 out = g_crypt_dec(rx->buf + rx->done, chunk, rx->size - rx->done, flags);
+  if (out > chunk) out = chunk;
+
+  if (rx->out != rx->done) os_memmove(rx->buf + rx->out, rx->buf + rx->done, out);
+  rx->out += out;
+  rx->done += chunk;
+}
+
+/**
+ * Feed received bytes.
+ *
+ * Complete cipher blocks are decrypted as they arrive. The last block
+ * is held back till rx_end so the cipher can strip the padding.
+ * The esp_det_enc_dec callback decrypts the message from data to the
+ * rx buffer in rx_end so it must be fed in one call.
+ *
+ * @param rx   The receive buffer.
+ * @param data The received bytes. May point to the end of rx buffer.
+ * @param len  The number of received bytes.
+ */
+static void ICACHE_FLASH_ATTR
+rx_feed(det_rx *rx, const uint8_t *data, uint16 len)
+{
+  uint16 chunk;
+
+  if (rx->ovf) return;
+  if (len > rx->size - rx->len) {
+    rx->ovf = true;
+    return;
+  }
+
+  if (has_decrypt_cb()) {
+    rx->src = data;
+    rx->len = len;
+    return;
   }
+
+  if (data != rx->buf + rx->len) os_memcpy(rx->buf + rx->len, data, len);
+  rx->len += len;
+
+  if (g_crypt_dec == NULL) return;
+
+  chunk = rx->len - rx->done;
+  if (chunk <= ESP_DET_CRYPT_BLOCK) return;
+  rx_crypt(rx, (uint16) ((chunk - 1) / ESP_DET_CRYPT_BLOCK * ESP_DET_CRYPT_BLOCK), 0);
 }
 
+/**
+ * Finish receiving message.
+ *
+ * The decrypted message is at the beginning of the rx buffer. It is
+ * NULL terminated if there is room for it in the buffer.
+ *
+ * @param rx The receive buffer.
+ *
+ * @return The decrypted message length or 0 if it did not fit in the buffer.
+ */
 static uint16 ICACHE_FLASH_ATTR
-decrypt(uint8_t *dst, const uint8_t *src, uint16 src_len)
+rx_end(det_rx *rx)
 {
-  if (g_sta->decrypt_cb == NULL) {
-    os_memmove(dst, src, src_len);
-    return src_len;
+  if (rx->ovf) return 0;
+
+  if (g_crypt_dec != NULL) {
+    rx_crypt(rx, rx->len - rx->done, ESP_DET_CRYPT_LAST);
+  } else if (g_sta->decrypt_cb != NULL) {
+    rx->out = g_sta->decrypt_cb(rx->buf, rx->src, rx->len);
+    if (rx->out > rx->len) rx->out = rx->len;
   } else {
-    return g_sta->decrypt_cb(dst, src, src_len);
+    rx->out = rx->len;
+  }
+
+  if (rx->out < rx->size) rx->buf[rx->out] = '\0';
+
+  return rx->out;
+}
+
+#if ESP_DET_CMD_CJSON
+
+///////////////////////////////////////////////////////////////////////////////
+// cJSON arena                                                               //
+///////////////////////////////////////////////////////////////////////////////
+
+// The arena size needed to decode a command.
+#define ESP_DET_ARENA_NEED(req_len) (256 + 2 * (uint32_t) (req_len))
+
+// The bump arena cJSON allocates from while handling a command.
+typedef struct {
+  uint8_t *buf; // The arena memory.
+  uint16 size;  // The arena size.
+  uint16 pos;   // The offset of the next allocation.
+} det_arena;
+
+static det_arena g_arena;
+
+#if ESP_DET_STATIC
+static uint32_t g_arena_mem[ESP_DET_CMD_ARENA / 4];
+#endif
+
+/** The cJSON malloc hook. */
+static void *ICACHE_FLASH_ATTR
+arena_malloc(size_t size)
+{
+  void *ptr;
+
+  size = (size + 3) & ~3;
+  if (g_arena.buf == NULL || size > (size_t) (g_arena.size - g_arena.pos)) {
+    ESP_DET_DEBUG("Arena full, allocating %d bytes on heap.\n", size);
+    return g_json_hooks.malloc_fn ? g_json_hooks.malloc_fn(size) : os_malloc(size);
   }
+
+  ptr = g_arena.buf + g_arena.pos;
+  g_arena.pos += size;
+
+  return ptr;
+}
+
+/** The cJSON free hook. Memory from arena is released in arena_end. */
+static void ICACHE_FLASH_ATTR
+arena_free(void *ptr)
+{
+  uint8_t *mem = ptr;
+
+  if (mem == NULL) return;
+  if (mem >= g_arena.buf && mem < g_arena.buf + g_arena.size) return;
+
+  if (g_json_hooks.free_fn) g_json_hooks.free_fn(ptr);
+  else os_free(ptr);
+}
+
+static cJSON_Hooks arena_hooks = {arena_malloc, arena_free};
+
+/**
+ * Point cJSON at the arena for the duration of one command.
+ *
+ * @param req_len The command length.
+ */
+static void ICACHE_FLASH_ATTR
+arena_begin(uint16 req_len)
+{
+  uint32_t size = ESP_DET_ARENA_NEED(req_len);
+  if (size > ESP_DET_CMD_ARENA) size = ESP_DET_CMD_ARENA;
+
+#if ESP_DET_STATIC
+  g_arena.buf = (uint8_t *) g_arena_mem;
+  g_arena.size = (uint16) (size & ~3);
+#else
+  g_arena.buf = os_malloc(size);
+  g_arena.size = (uint16) (g_arena.buf == NULL ? 0 : size & ~3);
+#endif
+  g_arena.pos = 0;
+
+  cJSON_InitHooks(&arena_hooks);
+}
+
+/** Release the arena and restore the user program cJSON allocator. */
+static void ICACHE_FLASH_ATTR
+arena_end()
+{
+  cJSON_InitHooks(g_json_hooks.malloc_fn || g_json_hooks.free_fn ? &g_json_hooks : NULL);
+
+#if !ESP_DET_STATIC
+  if (g_arena.buf != NULL) os_free(g_arena.buf);
+#endif
+  g_arena.buf = NULL;
+  g_arena.size = 0;
+  g_arena.pos = 0;
 }
 
+#endif
+
 ///////////////////////////////////////////////////////////////////////////////
 // Command handling                                                          //
 ///////////////////////////////////////////////////////////////////////////////
 
+// The keys recognized in commands.
+// The index in the table is the key tag in binary commands.
+static const det_key cmd_keys[] = {
+  {"cmd",  ESP_DET_KEY_CMD,  ESP_DET_KT_STR, offsetof(det_cmd, cmd),  ESP_DET_KEY_MAX},
+  {"name", ESP_DET_KEY_NAME, ESP_DET_KT_STR, offsetof(det_cmd, name), ESP_DET_STA_NAME_MAX},
+  {"pass", ESP_DET_KEY_PASS, ESP_DET_KT_STR, offsetof(det_cmd, pass), ESP_DET_STA_PASS_MAX},
+  {"ip",   ESP_DET_KEY_IP,   ESP_DET_KT_STR, offsetof(det_cmd, ip),   ESP_DET_IP_STR_MAX},
+  {"port", ESP_DET_KEY_PORT, ESP_DET_KT_NUM, offsetof(det_cmd, port), sizeof(uint16_t)},
+  {"user", ESP_DET_KEY_USER, ESP_DET_KT_STR, offsetof(det_cmd, user), ESP_DET_SRV_USER_MAX},
+  {"srvPass", ESP_DET_KEY_SRV_PASS, ESP_DET_KT_STR, offsetof(det_cmd, srv_pass), ESP_DET_SRV_PASS_MAX},
+  {"nonce", ESP_DET_KEY_NONCE, ESP_DET_KT_STR, offsetof(det_cmd, nonce), ESP_DET_NONCE_MAX},
+  {"mgr",  ESP_DET_KEY_MGR,  ESP_DET_KT_STR, offsetof(det_cmd, mgr),  ESP_DET_IP_STR_MAX},
+};
+
+#define ESP_DET_KEY_CNT (sizeof(cmd_keys) / sizeof(cmd_keys[0]))
+
+/**
+ * Find command key description by name.
+ *
+ * @param name The key name.
+ *
+ * @return The key description or NULL if key is not supported.
+ */
+static const det_key *ICACHE_FLASH_ATTR
+cmd_key_find(const char *name)
+{
+  uint8_t idx;
+
+  for (idx = 0; idx < ESP_DET_KEY_CNT; idx++) {
+    if (os_strcmp(cmd_keys[idx].name, name) == 0) return &cmd_keys[idx];
+  }
+
+  return NULL;
+}
+
+/**
+ * Resolve command identifier from its name.
+ *
+ * @param cmd The decoded command.
+ */
+static void ICACHE_FLASH_ATTR
+cmd_resolve_id(det_cmd *cmd)
+{
+  if (os_strcmp(cmd->cmd, ESP_DET_CMD_SET_AP) == 0) {
+    cmd->id = ESP_DET_CMD_ID_SET_AP;
+  } else if (os_strcmp(cmd->cmd, ESP_DET_CMD_SET_SRV) == 0) {
+    cmd->id = ESP_DET_CMD_ID_SET_SRV;
+  } else if (os_strcmp(cmd->cmd, ESP_DET_CMD_GET_STATS) == 0) {
+    cmd->id = ESP_DET_CMD_ID_GET_STATS;
+  } else if (os_strcmp(cmd->cmd, ESP_DET_CMD_SET_ALL) == 0) {
+    cmd->id = ESP_DET_CMD_ID_SET_ALL;
+  } else {
+    cmd->id = ESP_DET_CMD_ID_UNKNOWN;
+  }
+}
+
+#if ESP_DET_CMD_CJSON
+
+/**
+ * Decode command using cJSON.
+ *
+ * @param cmd The command to decode to.
+ * @param buf The NULL terminated JSON string.
+ * @param len The JSON string length.
+ *
+ * @return Error code.
+ */
+static esp_det_err ICACHE_FLASH_ATTR
+cmd_decode(det_cmd *cmd, const char *buf, uint16 len)
+{
+  uint8_t idx;
+  cJSON *item;
+
+  os_memset(cmd, 0, sizeof(det_cmd));
+
+  arena_begin(len);
+  cJSON *json = cJSON_Parse(buf);
+  if (json == NULL) {
+    arena_end();
+    return ESP_DET_ERR_CMD_BAD_JSON;
+  }
+
+  for (idx = 0; idx < ESP_DET_KEY_CNT; idx++) {
+    const det_key *key = &cmd_keys[idx];
+
+    item = cJSON_GetObjectItem(json, key->name);
+    if (item == NULL) continue;
+
+    if (key->type == ESP_DET_KT_STR && item->type == cJSON_String) {
+      if (os_strlen(item->valuestring) >= key->size) {
+        cJSON_Delete(json);
+        arena_end();
+        return ESP_DET_ERR_CMD_BAD_FORMAT;
+      }
+      strlcpy((char *) cmd + key->off, item->valuestring, key->size);
+      cmd->keys |= key->flag;
+    } else if (key->type == ESP_DET_KT_NUM && item->type == cJSON_Number) {
+      if (item->valuedouble < 0 || item->valuedouble > 0xFFFF || item->valuedouble != item->valueint) {
+        cJSON_Delete(json);
+        arena_end();
+        return ESP_DET_ERR_CMD_BAD_FORMAT;
+      }
+      *((uint16_t *) ((char *) cmd + key->off)) = (uint16_t) item->valueint;
+      cmd->keys |= key->flag;
+    }
+  }
+
+  cJSON_Delete(json);
+  arena_end();
+
+  if ((cmd->keys & ESP_DET_KEY_CMD) == 0) return ESP_DET_ERR_CMD_BAD_FORMAT;
+  cmd_resolve_id(cmd);
+
+  return ESP_DET_OK;
+}
+
+#else
+
+// The tok_number value of numbers which are not unsigned 32 bit integers.
+#define ESP_DET_NUM_INVALID 0xFFFFFFFF
+
+// The JSON tokenizer state.
+typedef struct {
+  const char *buf; // The JSON string.
+  uint16 len;      // The JSON string length.
+  uint16 pos;      // The current position.
+} det_tok;
+
+/** Skip white spaces. Returns current character or 0 at the end of input. */
+static char ICACHE_FLASH_ATTR
+tok_skip_ws(det_tok *tok)
+{
+  while (tok->pos < tok->len) {
+    char c = tok->buf[tok->pos];
+    if (c != ' ' && c != '\t' && c != '\n' && c != '\r') return c;
+    tok->pos++;
+  }
+
+  return 0;
+}
+
+/**
+ * Read four hex digits of \u escape.
+ *
+ * @param tok The tokenizer positioned after the "\u".
+ * @param cp  The decoded UTF-16 code unit.
+ *
+ * @return Returns false if escape is malformed.
+ */
+static bool ICACHE_FLASH_ATTR
+tok_hex4(det_tok *tok, uint32_t *cp)
+{
+  uint8_t idx;
+
+  if (tok->pos + 4 > tok->len) return false;
+
+  *cp = 0;
+  for (idx = 0; idx < 4; idx++) {
+    char h = tok->buf[tok->pos++];
+    *cp <<= 4;
+    if (h >= '0' && h <= '9') *cp |= h - '0';
+    else if (h >= 'a' && h <= 'f') *cp |= h - 'a' + 10;
+    else if (h >= 'A' && h <= 'F') *cp |= h - 'A' + 10;
+    else return false;
+  }
+
+  return true;
+}
+
+/**
+ * Encode code point as UTF-8.
+ *
+ * @param dst The destination of at least 4 bytes.
+ * @param cp  The code point.
+ *
+ * @return The number of bytes written.
+ */
+static uint8_t ICACHE_FLASH_ATTR
+tok_utf8(char *dst, uint32_t cp)
+{
+  if (cp < 0x80) {
+    dst[0] = (char) cp;
+    return 1;
+  }
+
+  if (cp < 0x800) {
+    dst[0] = (char) (0xC0 | (cp >> 6));
+    dst[1] = (char) (0x80 | (cp & 0x3F));
+    return 2;
+  }
+
+  if (cp < 0x10000) {
+    dst[0] = (char) (0xE0 | (cp >> 12));
+    dst[1] = (char) (0x80 | ((cp >> 6) & 0x3F));
+    dst[2] = (char) (0x80 | (cp & 0x3F));
+    return 3;
+  }
+
+  dst[0] = (char) (0xF0 | (cp >> 18));
+  dst[1] = (char) (0x80 | ((cp >> 12) & 0x3F));
+  dst[2] = (char) (0x80 | ((cp >> 6) & 0x3F));
+  dst[3] = (char) (0x80 | (cp & 0x3F));
+  return 4;
+}
+
 /**
- * Build JSON response object template.
+ * Read JSON string.
+ *
+ * The tokenizer must be positioned at the opening quote. The \u escapes
+ * are decoded to UTF-8. At most dst_size - 1 bytes are copied, the rest
+ * of the string is skipped. Multi byte characters are never split.
+ *
+ * @param tok      The tokenizer.
+ * @param dst      The destination buffer. May be NULL to skip the string.
+ * @param dst_size The destination buffer size.
+ * @param ovf      Set to true if string did not fit in dst. May be NULL.
+ *
+ * @return Returns false if string is malformed.
+ */
+static bool ICACHE_FLASH_ATTR
+tok_string(det_tok *tok, char *dst, uint16 dst_size, bool *ovf)
+{
+  uint32_t cp, low;
+  char utf8[4];
+  uint8_t cnt;
+  bool full = false;
+  uint16 dst_len = 0;
+
+  tok->pos++; // Opening quote.
+  while (tok->pos < tok->len) {
+    char c = tok->buf[tok->pos++];
+
+    if (c == '"') {
+      if (dst != NULL) dst[dst_len] = 0;
+      return true;
+    }
+
+    utf8[0] = c;
+    cnt = 1;
+
+    if (c == '\\') {
+      if (tok->pos >= tok->len) return false;
+      c = tok->buf[tok->pos++];
+      switch (c) {
+        case 'b': utf8[0] = '\b'; break;
+        case 'f': utf8[0] = '\f'; break;
+        case 'n': utf8[0] = '\n'; break;
+        case 'r': utf8[0] = '\r'; break;
+        case 't': utf8[0] = '\t'; break;
+        case 'u':
+          if (!tok_hex4(tok, &cp)) return false;
+          if (cp >= 0xD800 && cp <= 0xDBFF) {
+            // High surrogate must be followed by low surrogate.
+            if (tok->pos + 2 > tok->len) return false;
+            if (tok->buf[tok->pos] != '\\' || tok->buf[tok->pos + 1] != 'u') return false;
+            tok->pos += 2;
+            if (!tok_hex4(tok, &low) || low < 0xDC00 || low > 0xDFFF) return false;
+            cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+          } else if (cp == 0 || (cp >= 0xDC00 && cp <= 0xDFFF)) {
+            return false;
+          }
+          cnt = tok_utf8(utf8, cp);
+          break;
+        default: // Quote, backslash and slash.
+          utf8[0] = c;
+          break;
+      }
+    }
+
+    if (dst == NULL) continue;
+    if (!full && dst_len + cnt < dst_size) {
+      os_memcpy(dst + dst_len, utf8, cnt);
+      dst_len += cnt;
+    } else {
+      full = true;
+      if (ovf != NULL) *ovf = true;
+    }
+  }
+
+  return false;
+}
+
+/**
+ * Read JSON number as unsigned integer.
+ *
+ * Numbers which are negative, have fraction or exponent or do not
+ * fit in uint32_t are read as ESP_DET_NUM_INVALID.
+ *
+ * @param tok The tokenizer.
+ * @param dst The destination.
+ *
+ * @return Returns false if number is malformed.
+ */
+static bool ICACHE_FLASH_ATTR
+tok_number(det_tok *tok, uint32_t *dst)
+{
+  uint16 start;
+  uint8_t digit;
+  bool inv = false;
+  uint32_t val = 0;
+
+  if (tok->buf[tok->pos] == '-') {
+    inv = true;
+    tok->pos++;
+  }
+
+  start = tok->pos;
+  while (tok->pos < tok->len && tok->buf[tok->pos] >= '0' && tok->buf[tok->pos] <= '9') {
+    digit = (uint8_t) (tok->buf[tok->pos++] - '0');
+    if (val > (ESP_DET_NUM_INVALID - digit) / 10) inv = true;
+    val = val * 10 + digit;
+  }
+  if (tok->pos == start) return false;
+
+  while (tok->pos < tok->len) {
+    char c = tok->buf[tok->pos];
+    if ((c < '0' || c > '9') && c != '.' && c != 'e' && c != 'E' && c != '+' && c != '-') break;
+    inv = true;
+    tok->pos++;
+  }
+
+  *dst = inv ? ESP_DET_NUM_INVALID : val;
+
+  return true;
+}
+
+/**
+ * Skip any JSON value including nested objects and arrays.
+ *
+ * @param tok The tokenizer.
+ *
+ * @return Returns false if value is malformed.
+ */
+static bool ICACHE_FLASH_ATTR
+tok_skip_value(det_tok *tok)
+{
+  uint32_t num;
+  uint8_t depth = 0;
+
+  do {
+    char c = tok_skip_ws(tok);
+    switch (c) {
+      case '"':
+        if (!tok_string(tok, NULL, 0, NULL)) return false;
+        break;
+      case '{':
+      case '[':
+        depth++;
+        tok->pos++;
+        break;
+      case '}':
+      case ']':
+        if (depth == 0) return false;
+        depth--;
+        tok->pos++;
+        break;
+      case ',':
+      case ':':
+        if (depth == 0) return false;
+        tok->pos++;
+        break;
+      case 't':
+      case 'n':
+        if (tok->pos + 4 > tok->len) return false;
+        if (os_strncmp(&tok->buf[tok->pos], c == 't' ? "true" : "null", 4) != 0) return false;
+        tok->pos += 4;
+        break;
+      case 'f':
+        if (tok->pos + 5 > tok->len) return false;
+        if (os_strncmp(&tok->buf[tok->pos], "false", 5) != 0) return false;
+        tok->pos += 5;
+        break;
+      default:
+        if (c != '-' && (c < '0' || c > '9')) return false;
+        if (!tok_number(tok, &num)) return false;
+        break;
+    }
+  } while (depth > 0);
+
+  return true;
+}
+
+/**
+ * Decode command with single pass JSON tokenizer.
+ *
+ * Known keys are copied directly to command fields,
+ * unknown keys are skipped. Does not allocate memory.
+ *
+ * @param cmd The command to decode to.
+ * @param buf The JSON string.
+ * @param len The JSON string length.
+ *
+ * @return Error code.
+ */
+static esp_det_err ICACHE_FLASH_ATTR
+cmd_decode(det_cmd *cmd, const char *buf, uint16 len)
+{
+  uint32_t num;
+  det_tok tok = {buf, len, 0};
+  char name[ESP_DET_KEY_MAX];
+
+  os_memset(cmd, 0, sizeof(det_cmd));
+
+  if (tok_skip_ws(&tok) != '{') return ESP_DET_ERR_CMD_BAD_JSON;
+  tok.pos++;
+
+  if (tok_skip_ws(&tok) == '}') {
+    tok.pos++;
+  } else {
+    while (true) {
+      if (tok_skip_ws(&tok) != '"') return ESP_DET_ERR_CMD_BAD_JSON;
+      if (!tok_string(&tok, name, ESP_DET_KEY_MAX, NULL)) return ESP_DET_ERR_CMD_BAD_JSON;
+      const det_key *key = cmd_key_find(name);
+
+      if (tok_skip_ws(&tok) != ':') return ESP_DET_ERR_CMD_BAD_JSON;
+      tok.pos++;
+
+      char c = tok_skip_ws(&tok);
+      if (key != NULL && key->type == ESP_DET_KT_STR && c == '"') {
+        bool ovf = false;
+        if (!tok_string(&tok, (char *) cmd + key->off, key->size, &ovf)) return ESP_DET_ERR_CMD_BAD_JSON;
+        if (ovf) return ESP_DET_ERR_CMD_BAD_FORMAT;
+        cmd->keys |= key->flag;
+      } else if (key != NULL && key->type == ESP_DET_KT_NUM && (c == '-' || (c >= '0' && c <= '9'))) {
+        if (!tok_number(&tok, &num)) return ESP_DET_ERR_CMD_BAD_JSON;
+        if (num > 0xFFFF) return ESP_DET_ERR_CMD_BAD_FORMAT;
+        *((uint16_t *) ((char *) cmd + key->off)) = (uint16_t) num;
+        cmd->keys |= key->flag;
+      } else if (!tok_skip_value(&tok)) {
+        return ESP_DET_ERR_CMD_BAD_JSON;
+      }
+
+      c = tok_skip_ws(&tok);
+      tok.pos++;
+      if (c == '}') break;
+      if (c != ',') return ESP_DET_ERR_CMD_BAD_JSON;
+    }
+  }
+
+  if ((cmd->keys & ESP_DET_KEY_CMD) == 0) return ESP_DET_ERR_CMD_BAD_FORMAT;
+  cmd_resolve_id(cmd);
+
+  return ESP_DET_OK;
+}
+
+#endif
+
+/**
+ * Decode binary command.
+ *
+ *   | magic (1) | command ID (1) | tag (1) | len (1) | value (len) | ... |
+ *
+ * Tags are indexes in cmd_keys table. Strings are not NULL terminated,
+ * numbers are big endian and IP may also be sent as 4 raw bytes.
+ * Unknown tags are skipped.
+ *
+ * @param cmd The command to decode to.
+ * @param buf The command bytes.
+ * @param len The command length.
+ *
+ * @return Error code.
+ */
+static esp_det_err ICACHE_FLASH_ATTR
+cmd_decode_bin(det_cmd *cmd, const uint8_t *buf, uint16 len)
+{
+  uint16 pos = 2;
+
+  os_memset(cmd, 0, sizeof(det_cmd));
+  if (len < 2) return ESP_DET_ERR_CMD_BAD_FORMAT;
+
+  cmd->bin_id = buf[1];
+  cmd->id = buf[1] < ESP_DET_CMD_ID_CNT ? (det_cmd_id) buf[1] : ESP_DET_CMD_ID_UNKNOWN;
+  cmd->keys |= ESP_DET_KEY_CMD;
+
+  while (pos < len) {
+    if (pos + 2 > len || pos + 2 + buf[pos + 1] > len) return ESP_DET_ERR_CMD_BAD_FORMAT;
+
+    uint8_t tag = buf[pos];
+    uint8_t val_len = buf[pos + 1];
+    const uint8_t *val = &buf[pos + 2];
+    pos += 2 + val_len;
+
+    if (tag == 0 || tag >= ESP_DET_KEY_CNT) continue;
+    const det_key *key = &cmd_keys[tag];
+    char *dst = (char *) cmd + key->off;
+
+    if (key->type == ESP_DET_KT_NUM) {
+      if (val_len != 2) return ESP_DET_ERR_CMD_BAD_FORMAT;
+      *((uint16_t *) dst) = (uint16_t) ((val[0] << 8) | val[1]);
+    } else if ((key->flag == ESP_DET_KEY_IP || key->flag == ESP_DET_KEY_MGR) && val_len == 4) {
+      os_sprintf(dst, IPSTR, val[0], val[1], val[2], val[3]);
+    } else {
+      if (val_len >= key->size) return ESP_DET_ERR_CMD_BAD_FORMAT;
+      os_memcpy(dst, val, val_len);
+      dst[val_len] = '\0';
+    }
+
+    cmd->keys |= key->flag;
+  }
+
+  return ESP_DET_OK;
+}
+
+/**
+ * Build response.
  *
  * @param success Is response a success or failure.
  * @param msg     The response message.
  * @param code    The error code if success is false, 0 otherwise.
  *
- * @return  Returns cJSON pointer or NULL on error.
+ * @return The response.
+ */
+static det_resp ICACHE_FLASH_ATTR
+cmd_resp_tpl(bool success, const char *msg, uint16 code)
+{
+  det_resp resp = {success, code, msg, NULL};
+  return resp;
+}
+
+/**
+ * Append string to the response buffer.
+ *
+ * @param wr  The response writer.
+ * @param str The NULL terminated string.
+ */
+static void ICACHE_FLASH_ATTR
+wr_str(det_wr *wr, const char *str)
+{
+  while (*str != '\0') {
+    if (wr->len == wr->size) {
+      wr->ovf = true;
+      return;
+    }
+    wr->buf[wr->len++] = (uint8_t) *str++;
+  }
+}
+
+/**
+ * Append unsigned number to the response buffer.
+ *
+ * @param wr  The response writer.
+ * @param num The number.
  */
-static cJSON *ICACHE_FLASH_ATTR
-cmd_resp_tpl(bool success, char *msg, uint16 code)
+static void ICACHE_FLASH_ATTR
+wr_num(det_wr *wr, uint32_t num)
 {
-  cJSON *json = cJSON_CreateObject();
-  if (json == NULL) return NULL;
+  char str[11];
+  uint8_t idx = sizeof(str) - 1;
+
+  str[idx] = '\0';
+  do {
+    str[--idx] = (char) ('0' + num % 10);
+    num /= 10;
+  } while (num != 0);
 
-  cJSON_AddItemToObject(json, "success", cJSON_CreateBool(success));
-  cJSON_AddItemToObject(json, "code", cJSON_CreateNumber((double) code));
-  cJSON_AddItemToObject(json, "msg", cJSON_CreateString(msg));
+  wr_str(wr, &str[idx]);
+}
+
+/**
+ * Append bytes to the response buffer.
+ *
+ * @param wr  The response writer.
+ * @param src The bytes to append.
+ * @param len The number of bytes.
+ */
+static void ICACHE_FLASH_ATTR
+wr_bytes(det_wr *wr, const uint8_t *src, uint16 len)
+{
+  if (len > wr->size - wr->len) {
+    wr->ovf = true;
+    return;
+  }
 
-  return json;
+  os_memcpy(wr->buf + wr->len, src, len);
+  wr->len += len;
 }
 
 /**
- * Send response.
+ * Write response to the buffer and encrypt it in place.
+ *
+ * Binary response:
  *
- * @param dst     The pointer to response string.
- * @param dst_len The maximum response length in bytes.
- * @param resp    The command to send as a response.
+ *   | magic (1) | command ID (1) | success (1) | code (2) | tag (1) | len (1) | value (len) | ... |
  *
- * @return Returns true if response set, false otherwise.
+ * @param dst     The response buffer.
+ * @param dst_len The response buffer length.
+ * @param resp    The response to write.
+ * @param bin     Set to true to write binary response.
+ * @param id      The command ID byte echoed in binary response.
+ *
+ * @return The response length or 0 if it does not fit.
  */
 static uint16 ICACHE_FLASH_ATTR
-cmd_resp(uint8_t *dst, uint16 dst_len, cJSON *resp)
+cmd_resp(uint8_t *dst, uint16 dst_len, const det_resp *resp, bool bin, uint8_t id)
 {
-  uint16 resp_len = 0;
+  det_wr wr = {dst, dst_len, 0, false, bin};
+
+  if (bin) {
+    uint8_t hdr[ESP_DET_BIN_HDR] = {ESP_DET_BIN_MAGIC, id, resp->success,
+                                    (uint8_t) (resp->code >> 8), (uint8_t) resp->code};
+    wr_bytes(&wr, hdr, ESP_DET_BIN_HDR);
+    if (resp->extra != NULL) resp->extra(&wr);
+  } else {
+    // Messages are library literals and never need escaping.
+    wr_str(&wr, resp->success ? "{\"success\":true,\"code\":" : "{\"success\":false,\"code\":");
+    wr_num(&wr, resp->code);
+    wr_str(&wr, ",\"msg\":\"");
+    wr_str(&wr, resp->msg);
+    wr_str(&wr, "\"");
+    if (resp->extra != NULL) resp->extra(&wr);
+    wr_str(&wr, "}");
+  }
 
-  char *resp_str = cJSON_PrintUnformatted(resp);
-  if (resp_str != NULL) {
-    os_printf("sending: %s -> %d\n", resp_str, strlen(resp_str));
-    resp_len = encrypt(dst, (const uint8_t *) resp_str, (uint16) strlen(resp_str));
-    os_free(resp_str);
+  if (wr.ovf) {
+    ESP_DET_ERROR("Response does not fit in %d bytes.\n", dst_len);
+    return 0;
   }
 
-  return resp_len;
+  ESP_DET_DEBUG("Sending %d byte response.\n", wr.len);
+
+  return encrypt(dst, wr.len, dst_len);
 }
 
-static cJSON *ICACHE_FLASH_ATTR
-cmd_set_ap(cJSON *cmd)
+static det_resp ICACHE_FLASH_ATTR
+cmd_set_ap(det_cmd *cmd)
 {
-  // Validate JSON.
+  // Validate command.
 
-  cJSON *ap_name = cJSON_GetObjectItem(cmd, "name");
-  if (ap_name == NULL) {
+  if ((cmd->keys & ESP_DET_KEY_NAME) == 0) {
     return cmd_resp_tpl(false, "missing name key", ESP_DET_ERR_CMD);
   }
 
-  cJSON *ap_pass = cJSON_GetObjectItem(cmd, "pass");
-  if (ap_pass == NULL) {
+  if ((cmd->keys & ESP_DET_KEY_PASS) == 0) {
     return cmd_resp_tpl(false, "missing pass key", ESP_DET_ERR_CMD);
   }
 
+  if (os_strlen(cmd->name) >= ESP_DET_AP_NAME_MAX) {
+    return cmd_resp_tpl(false, "name too long", ESP_DET_ERR_CMD);
+  }
+
+  if (os_strlen(cmd->pass) >= ESP_DET_AP_PASS_MAX) {
+    return cmd_resp_tpl(false, "pass too long", ESP_DET_ERR_CMD);
+  }
+
+  if ((cmd->keys & ESP_DET_KEY_MGR) && ipaddr_addr(cmd->mgr) == IPADDR_NONE) {
+    return cmd_resp_tpl(false, "invalid manager address", ESP_DET_ERR_CMD);
+  }
+
   // Check valid stages this command can be run.
 
   if (g_sta->stage != ESP_DET_ST_DM) {
@@ -846,148 +2481,353 @@ cmd_set_ap(cJSON *cmd)
 
   // Make changes.
 
-  esp_det_err err = cfg_set_ap(ap_name->valuestring, ap_pass->valuestring);
+  esp_det_err err = cfg_set_ap(cmd->name, cmd->pass);
   if (err != ESP_DET_OK) {
     return cmd_resp_tpl(false, "failed setting access point", err);
   }
 
-  // Update detection stage.
+  if (cmd->keys & ESP_DET_KEY_MGR) g_cfg->mgr_ip = ipaddr_addr(cmd->mgr);
+
+  // Update detection stage. This also writes configuration to flash.
 
-  if (cfg_set_stage(ESP_DET_ST_CN) != ESP_CFG_OK) {
+  if (cfg_set_stage(ESP_DET_ST_CN) != ESP_DET_OK) {
     return cmd_resp_tpl(false, "failed setting config stage", ESP_DET_ERR_CFG);
   }
 
   // Success.
 
+  trigger_main(false, 250);
   return cmd_resp_tpl(true, "access point set", 0);
 }
 
-/** Build UDP discovery broadcast payload. */
-static char *ICACHE_FLASH_ATTR
+/**
+ * Set access point and main server configuration at once.
+ *
+ * After connecting to the access point device goes straight to
+ * ESP_DET_ST_OP skipping main server discovery.
+ */
+static det_resp ICACHE_FLASH_ATTR
+cmd_set_all(det_cmd *cmd)
+{
+  uint16_t need = ESP_DET_KEY_NAME | ESP_DET_KEY_PASS | ESP_DET_KEY_IP
+                 | ESP_DET_KEY_PORT | ESP_DET_KEY_USER | ESP_DET_KEY_SRV_PASS;
+
+  // Validate command.
+
+  if ((cmd->keys & need) != need) {
+    return cmd_resp_tpl(false, "missing keys", ESP_DET_ERR_CMD);
+  }
+
+  if (os_strlen(cmd->name) >= ESP_DET_AP_NAME_MAX) {
+    return cmd_resp_tpl(false, "name too long", ESP_DET_ERR_CMD);
+  }
+
+  if (os_strlen(cmd->pass) >= ESP_DET_AP_PASS_MAX) {
+    return cmd_resp_tpl(false, "pass too long", ESP_DET_ERR_CMD);
+  }
+
+  uint32_t ip = ipaddr_addr(cmd->ip);
+  if (ip == IPADDR_NONE || cmd->port == 0) {
+    return cmd_resp_tpl(false, "invalid main server address", ESP_DET_ERR_CMD);
+  }
+
+  if ((cmd->keys & ESP_DET_KEY_MGR) && ipaddr_addr(cmd->mgr) == IPADDR_NONE) {
+    return cmd_resp_tpl(false, "invalid manager address", ESP_DET_ERR_CMD);
+  }
+
+  // Check valid stages this command can be run.
+
+  if (g_sta->stage != ESP_DET_ST_DM) {
+    return cmd_resp_tpl(false, "unexpected stage", ESP_DET_ERR_CMD);
+  }
+
+  // Make changes.
+
+  esp_det_err err = cfg_set_ap(cmd->name, cmd->pass);
+  if (err != ESP_DET_OK) {
+    return cmd_resp_tpl(false, "failed setting access point", err);
+  }
+
+  if (cmd->keys & ESP_DET_KEY_MGR) g_cfg->mgr_ip = ipaddr_addr(cmd->mgr);
+
+  cfg_set_srv(ip, cmd->port, cmd->user, cmd->srv_pass);
+
+  // Update detection stage. This also writes configuration to flash.
+
+  if (cfg_set_stage(ESP_DET_ST_CN) != ESP_DET_OK) {
+    return cmd_resp_tpl(false, "failed setting config stage", ESP_DET_ERR_CFG);
+  }
+
+  // Success.
+
+  trigger_main(false, 250);
+  return cmd_resp_tpl(true, "configuration set", 0);
+}
+
+/**
+ * Build UDP discovery broadcast payload.
+ *
+ * The payload changes only with the nonce so it is built once
+ * and reused for every broadcast till the nonce changes.
+ */
+static void ICACHE_FLASH_ATTR
 cmd_discovery()
 {
   uint8 mac[6];
-  char mac_str[ESP_DET_AP_NAME_MAX];
+
+  // The nonce comes from the hardware random generator. The rnd_next
+  // sequence is derived from the MAC sent in the broadcast and repeats
+  // after every boot.
+  if (g_sta->nonce[0] == '\0') {
+    os_sprintf(g_sta->nonce, "%08X", (uint32_t) os_random());
+    g_sta->dis_len = 0;
+  }
+
+  if (g_sta->dis_len != 0) return;
 
   os_memset(mac, 0, 6);
-  os_memset(mac_str, 0, ESP_DET_AP_NAME_MAX);
   wifi_get_macaddr(STATION_IF, mac);
-  os_sprintf(mac_str, "%02X%02X%02X%02X%02X%02X", MAC2STR(mac));
 
-  cJSON *resp = cJSON_CreateObject();
-  cJSON_AddItemToObject(resp, "cmd", cJSON_CreateString(ESP_DET_CMD_DISCOVERY));
-  cJSON_AddItemToObject(resp, "mac", cJSON_CreateString(mac_str));
-  cJSON_AddItemToObject(resp, "memory", cJSON_CreateNumber(flash_real_size()));
+  g_sta->dis_len = (uint16) os_sprintf(g_sta->dis_msg,
+                                       "{\"cmd\":\"%s\",\"mac\":\"%02X%02X%02X%02X%02X%02X\",\"memory\":%u,\"nonce\":\"%s\"}",
+                                       ESP_DET_CMD_DISCOVERY,
+                                       MAC2STR(mac),
+                                       flash_real_size(),
+                                       g_sta->nonce);
+}
+
+/**
+ * Append number key to the response buffer.
+ *
+ * @param wr   The response writer.
+ * @param tag  The key tag in binary response.
+ * @param name The key name in JSON response.
+ * @param num  The number.
+ */
+static void ICACHE_FLASH_ATTR
+wr_key(det_wr *wr, uint8_t tag, const char *name, uint32_t num)
+{
+  if (wr->bin) {
+    uint8_t tlv[6] = {tag, 4, (uint8_t) (num >> 24), (uint8_t) (num >> 16), (uint8_t) (num >> 8), (uint8_t) num};
+    wr_bytes(wr, tlv, sizeof(tlv));
+    return;
+  }
+
+  wr_str(wr, ",\"");
+  wr_str(wr, name);
+  wr_str(wr, "\":");
+  wr_num(wr, num);
+}
+
+/** Write statistics keys to getStats response. */
+static void ICACHE_FLASH_ATTR
+cmd_stats_wr(det_wr *wr)
+{
+  esp_det_stats stats;
+
+  esp_det_get_stats(&stats);
+  wr_key(wr, 1, "stage", stats.stage);
+  wr_key(wr, 2, "dmErr", stats.dm_err_cnt);
+  wr_key(wr, 3, "cnErr", stats.cn_err_cnt);
+  wr_key(wr, 4, "srErr", stats.sr_err_cnt);
+  wr_key(wr, 5, "flashWr", stats.flash_wr);
+  wr_key(wr, 6, "flashEr", stats.flash_er);
+  wr_key(wr, 7, "brd", stats.brd_cnt);
+  wr_key(wr, 8, "rcn", stats.rcn_cnt);
+  wr_key(wr, 9, "disc", stats.disc_cnt);
+  wr_key(wr, 10, "discMask", stats.disc_mask);
+  wr_key(wr, 11, "discLast", stats.disc_last);
+  wr_key(wr, 12, "heapMin", stats.heap_min);
+  wr_key(wr, 13, "stageTime", stats.stage_time);
+}
 
-  char *json = cJSON_PrintUnformatted(resp);
-  cJSON_Delete(resp);
+static det_resp ICACHE_FLASH_ATTR
+cmd_get_stats(det_cmd *cmd)
+{
+  det_resp resp = cmd_resp_tpl(true, "stats", 0);
+  resp.extra = cmd_stats_wr;
 
-  return json;
+  return resp;
 }
 
-static cJSON *ICACHE_FLASH_ATTR
-cmd_set_srv(cJSON *cmd)
+static det_resp ICACHE_FLASH_ATTR
+cmd_set_srv(det_cmd *cmd)
 {
-  // Validate JSON.
+  // Validate command.
 
-  cJSON *srvIp = cJSON_GetObjectItem(cmd, "ip");
-  if (srvIp == NULL) {
+  if ((cmd->keys & ESP_DET_KEY_IP) == 0) {
     return cmd_resp_tpl(false, "missing ip key", ESP_DET_ERR_AP);
   }
 
-  cJSON *srvPort = cJSON_GetObjectItem(cmd, "port");
-  if (srvPort == NULL) {
+  if ((cmd->keys & ESP_DET_KEY_PORT) == 0) {
     return cmd_resp_tpl(false, "missing port key", ESP_DET_ERR_AP);
   }
 
-  cJSON *srvUser = cJSON_GetObjectItem(cmd, "user");
-  if (srvUser == NULL) {
+  if ((cmd->keys & ESP_DET_KEY_USER) == 0) {
     return cmd_resp_tpl(false, "missing user key", ESP_DET_ERR_AP);
   }
 
-  cJSON *srvPass = cJSON_GetObjectItem(cmd, "pass");
-  if (srvPass == NULL) {
+  if ((cmd->keys & ESP_DET_KEY_PASS) == 0) {
     return cmd_resp_tpl(false, "missing pass key", ESP_DET_ERR_AP);
   }
 
+  if (os_strlen(cmd->pass) >= ESP_DET_SRV_PASS_MAX) {
+    return cmd_resp_tpl(false, "pass too long", ESP_DET_ERR_CMD);
+  }
+
   // Check valid stages this command can be run.
 
   if (g_sta->stage != ESP_DET_ST_DS) {
     return cmd_resp_tpl(false, "unexpected stage", ESP_DET_ERR_CMD);
   }
 
+  uint32_t ip = ipaddr_addr(cmd->ip);
+  if (ip == IPADDR_NONE || cmd->port == 0) {
+    return cmd_resp_tpl(false, "invalid main server address", ESP_DET_ERR_CMD);
+  }
+
   // Make changes.
 
-  uint32_t ip = ipaddr_addr(srvIp->valuestring);
-  esp_cfg_err err = cfg_set_srv(ip, (uint16_t) srvPort->valueint, srvUser->valuestring, srvPass->valuestring);
-  if (err != ESP_CFG_OK) {
-    return cmd_resp_tpl(false, "failed setting main server", err);
-  }
+  cfg_set_srv(ip, cmd->port, cmd->user, cmd->pass);
 
-  // Update detection stage.
+  // Update detection stage. This also writes configuration to flash.
 
-  if (cfg_set_stage(ESP_DET_ST_OP) != ESP_CFG_OK) {
+  if (cfg_set_stage(ESP_DET_ST_OP) != ESP_DET_OK) {
     return cmd_resp_tpl(false, "failed setting config stage", ESP_DET_ERR_CFG);
   }
 
   // Success.
 
+  trigger_main(false, 250);
   return cmd_resp_tpl(true, "main server set", 0);
 }
 
 /**
- * Handle command callback.
+ * Handle command.
  *
  * @param res      Pointer to response buffer.
  * @param res_len  The response buffer length.
  * @param req      The client command.
  * @param req_len  The client command length.
+ * @param in_place Set to true if command may be decrypted in the req buffer.
+ * @param udp      Set to true for commands received over UDP. They must carry
+ *                 the nonce from the last discovery broadcast and are not
+ *                 responded to when malformed, unknown or replayed.
+ *
+ * @return The response length.
  */
 static uint16 ICACHE_FLASH_ATTR
-cmd_handle_cb(uint8_t *res, uint16 res_len, const uint8_t *req, uint16_t req_len)
+cmd_handle(uint8_t *res, uint16 res_len, uint8_t *req, uint16_t req_len, bool in_place, bool udp)
 {
-  uint16 resp_len = 0;
-  cJSON *cmd_json = NULL;
-  cJSON *json_resp = NULL;
-
-  uint8_t *buff = os_zalloc(req_len + 1);
-  if (buff == NULL) return 0; // No more memory.
+  uint16 cmd_len;
+  det_cmd cmd;
+  esp_det_err err;
+  det_resp resp;
+  det_rx rx;
+  uint8_t *buff = NULL;
+
+  // The tokenizer does not need NULL terminated command so when there
+  // is nothing to decrypt or it can be done in place the command is
+  // parsed straight from the req buffer. Nothing is written to it
+  // unless in_place is set.
+  if (!ESP_DET_CMD_CJSON && !has_decrypt_cb() && (in_place || !has_decrypt())) {
+    rx_begin(&rx, req, req_len);
+  } else {
+#if ESP_DET_STATIC
+    buff = g_req_mem;
+    rx_begin(&rx, buff, sizeof(g_req_mem));
+#else
+    buff = os_malloc(req_len + 1);
+    if (buff == NULL) return 0; // No more memory.
+    rx_begin(&rx, buff, (uint16) (req_len + 1));
+#endif
+  }
 
-  // We cast because AES can decode in place.
-  decrypt(buff, req, req_len);
-  os_printf("Handling cmd: %s %d -> %d\n", buff, req_len, strlen((const char *) buff));
+  // Commands too long are reported as malformed.
+  rx_feed(&rx, req, req_len);
+  cmd_len = rx_end(&rx);
+  ESP_DET_DEBUG("Handling %d byte command.\n", cmd_len);
 
-  cmd_json = cJSON_Parse((const char *) buff);
-  if (cmd_json == NULL) {
-    json_resp = cmd_resp_tpl(false, "could not decode json", ESP_DET_ERR_CMD_BAD_JSON);
-    os_free(buff);
-    return cmd_resp(res, res_len, json_resp);
+  // Binary commands never start with valid JSON character.
+  bool bin = cmd_len > 0 && rx.buf[0] == ESP_DET_BIN_MAGIC;
+  if (bin) {
+    err = cmd_decode_bin(&cmd, rx.buf, cmd_len);
+  } else {
+    err = cmd_decode(&cmd, (const char *) rx.buf, cmd_len);
   }
-
-  cJSON *det_cmd = cJSON_GetObjectItem(cmd_json, "cmd");
-  if (det_cmd == NULL) {
-    json_resp = cmd_resp_tpl(false, "bad command format", ESP_DET_ERR_CMD_BAD_FORMAT);
-    cJSON_Delete(cmd_json);
-    os_free(buff);
-    return cmd_resp(res, res_len, json_resp);
+#if !ESP_DET_STATIC
+  if (buff != NULL) os_free(buff);
+#endif
+
+  // UDP commands must carry the nonce from the last discovery broadcast,
+  // so captured datagrams can not be replayed. With ESP_DET_TCP_NONCE the
+  // same goes for TCP commands changing configuration in stage DS.
+  bool nonce_ok = g_sta->nonce[0] != '\0' && os_strcmp(cmd.nonce, g_sta->nonce) == 0;
+  bool need_nonce = udp || (ESP_DET_TCP_NONCE && g_sta->stage == ESP_DET_ST_DS
+                            && cmd.id != ESP_DET_CMD_ID_UNKNOWN
+                            && cmd.id != ESP_DET_CMD_ID_GET_STATS);
+
+  if (udp) {
+    if (err != ESP_DET_OK || cmd.id == ESP_DET_CMD_ID_UNKNOWN) return 0;
+    if (!nonce_ok) {
+      ESP_DET_DEBUG("Dropping UDP command with bad nonce.\n");
+      return 0;
+    }
   }
 
-  if (strcmp(det_cmd->valuestring, ESP_DET_CMD_SET_AP) == 0) {
-    json_resp = cmd_set_ap(cmd_json);
-  } else if (strcmp(det_cmd->valuestring, ESP_DET_CMD_SET_SRV) == 0) {
-    json_resp = cmd_set_srv(cmd_json);
+  // The sender heard our discovery, so the next discovery is unicast to it.
+  // Its address is written to flash together with the configuration the
+  // command changes.
+  uint32_t mgr_ip = g_cfg->mgr_ip;
+  if (udp) g_cfg->mgr_ip = g_sta->udp_peer;
+
+  if (err == ESP_DET_ERR_CMD_BAD_JSON) {
+    resp = cmd_resp_tpl(false, "could not decode json", ESP_DET_ERR_CMD_BAD_JSON);
+  } else if (err != ESP_DET_OK) {
+    resp = cmd_resp_tpl(false, "bad command format", ESP_DET_ERR_CMD_BAD_FORMAT);
+  } else if (need_nonce && !nonce_ok) {
+    resp = cmd_resp_tpl(false, "bad nonce", ESP_DET_ERR_CMD);
+  } else if (cmd.id == ESP_DET_CMD_ID_SET_AP) {
+    resp = cmd_set_ap(&cmd);
+  } else if (cmd.id == ESP_DET_CMD_ID_SET_SRV) {
+    resp = cmd_set_srv(&cmd);
+  } else if (cmd.id == ESP_DET_CMD_ID_GET_STATS) {
+    resp = cmd_get_stats(&cmd);
+  } else if (cmd.id == ESP_DET_CMD_ID_SET_ALL) {
+    resp = cmd_set_all(&cmd);
   } else {
-    json_resp = cmd_resp_tpl(false, "unknown command", ESP_DET_ERR_CMD);
+    resp = cmd_resp_tpl(false, "unknown command", ESP_DET_ERR_CMD);
+  }
+
+  // Every nonce is accepted once. The next broadcast carries a new one.
+  if (need_nonce && resp.success) {
+    g_sta->nonce[0] = '\0';
+    cmd_discovery();
+
+    // The getStats command is the only one not writing configuration.
+    if (udp && cmd.id == ESP_DET_CMD_ID_GET_STATS && g_cfg->mgr_ip != mgr_ip) cfg_write();
   }
+  if (!resp.success) g_cfg->mgr_ip = mgr_ip;
 
-  resp_len = cmd_resp(res, res_len, json_resp);
-  if (cJSON_GetObjectItem(json_resp, "success")->type == cJSON_True) trigger_main(false, 250);
+  stats_heap();
+  ESP_DET_TRACE_EV(ESP_DET_TR_CMD, resp.success);
 
-  cJSON_Delete(cmd_json);
-  cJSON_Delete(json_resp);
-  os_free(buff);
+  return cmd_resp(res, res_len, &resp, bin, cmd.bin_id);
+}
 
-  return resp_len;
+/**
+ * Handle command callback.
+ *
+ * @param res      Pointer to response buffer.
+ * @param res_len  The response buffer length.
+ * @param req      The client command.
+ * @param req_len  The client command length.
+ */
+static uint16 ICACHE_FLASH_ATTR
+cmd_handle_cb(uint8_t *res, uint16 res_len, uint8_t *req, uint16 req_len)
+{
+  // The command is in the connection reassembly buffer so it may be decrypted in place.
+  return cmd_handle(res, res_len, req, req_len, true, false);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -995,44 +2835,116 @@ cmd_handle_cb(uint8_t *res, uint16 res_len, const uint8_t *req, uint16_t req_len
 ///////////////////////////////////////////////////////////////////////////////
 
 /**
- * Send UDP discovery broadcast.
+ * Receive commands on UDP connection.
  *
- * @param ip   The broadcast IP.
- * @param port The port.
+ * Every device in ESP_DET_ST_DS stage listens on the same port so we
+ * also receive other devices discovery broadcasts. Only recognized
+ * commands carrying the current nonce are responded to.
+ *
+ * @param arg  The espconn structure.
+ * @param data The received data.
+ * @param len  The received data length.
+ */
+static void ICACHE_FLASH_ATTR
+udp_recv_cb(void *arg, char *data, unsigned short len)
+{
+  sint8 err;
+  remot_info *remote = NULL;
+  struct espconn *conn = arg;
+  uint8_t *res;
+
+  if (espconn_get_connection_info(conn, &remote, 0) != ESPCONN_OK) return;
+  os_memcpy(&g_sta->udp_peer, remote->remote_ip, 4);
+
+#if ESP_DET_STATIC
+  res = g_res_mem;
+#else
+  res = os_malloc(ESP_DET_RES_MAX);
+  if (res == NULL) return; // No more memory.
+#endif
+
+  uint16 res_len = cmd_handle(res, ESP_DET_RES_MAX, (uint8_t *) data, len, true, true);
+  if (res_len > 0) {
+    os_memcpy(conn->proto.udp->remote_ip, remote->remote_ip, 4);
+    conn->proto.udp->remote_port = remote->remote_port;
+
+    if ((err = espconn_send(conn, res, res_len)) != ESPCONN_OK) {
+      ESP_DET_ERROR("Failed sending UDP response with error: %d.\n", err);
+    }
+  }
+
+#if !ESP_DET_STATIC
+  os_free(res);
+#endif
+}
+
+/**
+ * Open UDP connection for discovery broadcasts and commands.
  *
- * @return
+ * @return Returns true on success.
  */
 static bool ICACHE_FLASH_ATTR
-udp_send_dis_packet(uint32 ip, uint32 port)
+udp_open()
 {
   sint8 err;
-  static esp_udp udp;
-  uint8 *ip_bytes = (uint8 *) &ip;
 
+  if (g_sta->udp_open) return true;
+
+  os_memset(&g_sta->udp_conn, 0, sizeof(struct espconn));
+  os_memset(&g_sta->udp, 0, sizeof(esp_udp));
   g_sta->udp_conn.type = ESPCONN_UDP;
   g_sta->udp_conn.state = ESPCONN_NONE;
-  g_sta->udp_conn.proto.udp = &udp;
-
-  ESP_DET_DEBUG("Sending broadcast to %d.%d.%d.%d:%d\n", IP2STR(&ip), port);
-
-  os_memcpy(g_sta->udp_conn.proto.udp->remote_ip, ip_bytes, 4);
-  g_sta->udp_conn.proto.udp->remote_port = port;
+  g_sta->udp_conn.proto.udp = &g_sta->udp;
+  g_sta->udp.local_port = ESP_DET_CMD_PORT;
 
   if ((err = espconn_create(&g_sta->udp_conn)) != 0) {
     ESP_DET_ERROR("Creating UDP connection failed (%d).\n", err);
     return false;
   }
 
-  char *json = cmd_discovery();
-  sint8 result = espconn_send(&g_sta->udp_conn, (uint8 *) json, (uint16) strlen(json));
-  os_free(json);
-  if (result != ESPCONN_OK) {
-    ESP_DET_ERROR("Failed sending UDP broadcast with error: %d.\n", err);
-    return false;
-  }
+  espconn_regist_recvcb(&g_sta->udp_conn, udp_recv_cb);
+  g_sta->udp_open = true;
+
+  return true;
+}
+
+/** Close UDP connection. */
+static void ICACHE_FLASH_ATTR
+udp_close()
+{
+  sint8 err;
+
+  if (!g_sta->udp_open) return;
 
   if ((err = espconn_delete(&g_sta->udp_conn)) != 0) {
     ESP_DET_ERROR("Failed to close UDP connection with error: %d.\n", err);
+  }
+  g_sta->udp_open = false;
+}
+
+/**
+ * Send UDP discovery packet.
+ *
+ * @param ip   The broadcast or manager IP.
+ * @param port The port.
+ *
+ * @return Returns true on success.
+ */
+static bool ICACHE_FLASH_ATTR
+udp_send_dis_packet(uint32 ip, uint32 port)
+{
+  sint8 err;
+  uint8 *ip_bytes = (uint8 *) &ip;
+
+  if (!g_sta->udp_open) return false;
+
+  ESP_DET_DEBUG("Sending discovery to %d.%d.%d.%d:%d\n", IP2STR(&ip), port);
+
+  os_memcpy(g_sta->udp.remote_ip, ip_bytes, 4);
+  g_sta->udp.remote_port = port;
+
+  if ((err = espconn_send(&g_sta->udp_conn, (uint8 *) g_sta->dis_msg, g_sta->dis_len)) != ESPCONN_OK) {
+    ESP_DET_ERROR("Failed sending UDP discovery with error: %d.\n", err);
     return false;
   }
 
@@ -0,0 +1,283 @@
+/*
+ * Copyright 2017 Rafal Zajac <rzajac@gmail.com>.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+// The append only flash journal.
+//
+// Every journal sector starts with a header word followed by records:
+//
+//   | magic (4) | seq (4) | record | record | ... | 0xFF ... |
+//
+// Each record is a header word followed by data padded to 4 bytes:
+//
+//   | off (2) | len (1) | crc (1) | data (len) | padding |
+//
+// A record replaces len bytes at offset off of the structure. The first
+// record in a sector is always a snapshot of the whole structure so every
+// sector can be replayed on its own. The sector with the valid snapshot
+// and the highest sequence number is the active one. When the active
+// sector is full the next one is erased and starts with a new snapshot.
+
+#include <esp_det.h>
+#include "esp_det_jrnl.h"
+
+// The journal sector magic number.
+#define ESP_DET_JRNL_MAGIC 0x4E524A44
+// The size of the sector and record headers.
+#define ESP_DET_JRNL_HDR_SIZE 4
+// The offset of the first record in a sector.
+#define ESP_DET_JRNL_REC_START 8
+// The value of the not written flash word.
+#define ESP_DET_JRNL_EMPTY 0xFFFFFFFF
+
+// Round up to 4 bytes.
+#define ESP_DET_JRNL_ALIGN(x) (((x) + 3) & ~3)
+
+// The journal state.
+typedef struct {
+  uint8_t *data;  // The structure kept in the journal.
+  uint16 size;    // The structure size.
+  uint8_t sector; // The index of active sector (0 to ESP_DET_JRNL_SECTORS - 1).
+  uint32_t seq;   // The active sector sequence number.
+  uint16 pos;     // The offset of the next record in the active sector.
+  bool compact;   // Set when next write must start a new sector.
+  uint32_t writes; // The number of journal writes.
+  uint32_t erases; // The number of sector erases.
+  uint8_t shadow[ESP_DET_JRNL_DATA_MAX]; // The structure as it's stored on flash.
+  uint32_t buf[(ESP_DET_JRNL_HDR_SIZE + ESP_DET_JRNL_DATA_MAX) / 4]; // The record buffer.
+} det_jrnl;
+
+static det_jrnl g_jrnl;
+
+/** Calculate CRC8 of a record. */
+static uint8_t ICACHE_FLASH_ATTR
+jrnl_crc(uint16 off, uint8_t len, const uint8_t *data)
+{
+  uint8_t idx;
+  uint8_t crc = (uint8_t) (off ^ (off >> 8) ^ len);
+
+  for (idx = 0; idx < len; idx++) {
+    uint8_t bit;
+    crc ^= data[idx];
+    for (bit = 0; bit < 8; bit++) {
+      crc = (uint8_t) ((crc & 0x80) ? (crc << 1) ^ 0x07 : (crc << 1));
+    }
+  }
+
+  return crc;
+}
+
+/** Return flash address of the journal sector. */
+static uint32_t ICACHE_FLASH_ATTR
+jrnl_addr(uint8_t sector)
+{
+  return (uint32_t) (ESP_DET_JRNL_SECTOR + sector) * SPI_FLASH_SEC_SIZE;
+}
+
+/**
+ * Read record at given position in the sector to the record buffer.
+ *
+ * @param sector The sector index.
+ * @param pos    The record offset in the sector.
+ * @param off    Set to the record offset in the structure.
+ * @param len    Set to the record length.
+ *
+ * @return Returns true if valid record was read.
+ */
+static bool ICACHE_FLASH_ATTR
+jrnl_rec_read(uint8_t sector, uint16 pos, uint16 *off, uint8_t *len)
+{
+  uint32_t hdr;
+  uint8_t *rec = (uint8_t *) g_jrnl.buf;
+
+  if (pos + ESP_DET_JRNL_HDR_SIZE > SPI_FLASH_SEC_SIZE) return false;
+  if (spi_flash_read(jrnl_addr(sector) + pos, &hdr, 4) != SPI_FLASH_RESULT_OK) return false;
+  if (hdr == ESP_DET_JRNL_EMPTY) return false;
+
+  *off = (uint16) (hdr & 0xFFFF);
+  *len = (uint8_t) ((hdr >> 16) & 0xFF);
+  if (*len == 0 || *off + *len > g_jrnl.size) return false;
+  if (pos + ESP_DET_JRNL_HDR_SIZE + ESP_DET_JRNL_ALIGN(*len) > SPI_FLASH_SEC_SIZE) return false;
+
+  if (spi_flash_read(jrnl_addr(sector) + pos + ESP_DET_JRNL_HDR_SIZE,
+                     g_jrnl.buf,
+                     ESP_DET_JRNL_ALIGN(*len)) != SPI_FLASH_RESULT_OK) {
+    return false;
+  }
+
+  return jrnl_crc(*off, *len, rec) == (uint8_t) (hdr >> 24);
+}
+
+/**
+ * Append record to active sector.
+ *
+ * @param off The offset in the structure.
+ * @param len The number of bytes to write.
+ *
+ * @return Error code.
+ */
+static esp_det_jrnl_err ICACHE_FLASH_ATTR
+jrnl_rec_write(uint16 off, uint8_t len)
+{
+  uint32_t *rec = g_jrnl.buf;
+  uint16 rec_len = (uint16) (ESP_DET_JRNL_HDR_SIZE + ESP_DET_JRNL_ALIGN(len));
+
+  os_memset(rec, 0xFF, rec_len);
+  os_memcpy(&rec[1], g_jrnl.data + off, len);
+  rec[0] = (uint32_t) off | ((uint32_t) len << 16) | ((uint32_t) jrnl_crc(off, len, (uint8_t *) &rec[1]) << 24);
+
+  if (spi_flash_write(jrnl_addr(g_jrnl.sector) + g_jrnl.pos, rec, rec_len) != SPI_FLASH_RESULT_OK) {
+    g_jrnl.compact = true;
+    return ESP_DET_JRNL_ERR_FLASH;
+  }
+
+  g_jrnl.pos += rec_len;
+  g_jrnl.writes++;
+  os_memcpy(g_jrnl.shadow + off, g_jrnl.data + off, len);
+
+  return ESP_DET_JRNL_OK;
+}
+
+/**
+ * Start new sector with the snapshot of the structure.
+ *
+ * @return Error code.
+ */
+static esp_det_jrnl_err ICACHE_FLASH_ATTR
+jrnl_compact()
+{
+  uint32_t hdr[2];
+  uint8_t sector = (uint8_t) ((g_jrnl.sector + 1) % ESP_DET_JRNL_SECTORS);
+
+  ESP_DET_DEBUG("Compacting journal to sector %d.\n", sector);
+
+  g_jrnl.erases++;
+  if (spi_flash_erase_sector((uint16) (ESP_DET_JRNL_SECTOR + sector)) != SPI_FLASH_RESULT_OK) {
+    return ESP_DET_JRNL_ERR_FLASH;
+  }
+
+  hdr[0] = ESP_DET_JRNL_MAGIC;
+  hdr[1] = g_jrnl.seq + 1;
+  if (spi_flash_write(jrnl_addr(sector), hdr, sizeof(hdr)) != SPI_FLASH_RESULT_OK) {
+    return ESP_DET_JRNL_ERR_FLASH;
+  }
+
+  g_jrnl.sector = sector;
+  g_jrnl.seq = hdr[1];
+  g_jrnl.pos = ESP_DET_JRNL_REC_START;
+  g_jrnl.compact = false;
+
+  return jrnl_rec_write(0, (uint8_t) g_jrnl.size);
+}
+
+esp_det_jrnl_err ICACHE_FLASH_ATTR
+esp_det_jrnl_init(void *data, uint16 size)
+{
+  if (size > ESP_DET_JRNL_DATA_MAX || ESP_DET_JRNL_SECTORS < 2) return ESP_DET_JRNL_ERR_SIZE;
+
+  os_memset(&g_jrnl, 0, sizeof(det_jrnl));
+  g_jrnl.data = data;
+  g_jrnl.size = size;
+  g_jrnl.compact = true;
+
+  return ESP_DET_JRNL_OK;
+}
+
+esp_det_jrnl_err ICACHE_FLASH_ATTR
+esp_det_jrnl_read()
+{
+  uint8_t sector;
+  uint16 off;
+  uint8_t len;
+  uint32_t hdr[2];
+  bool found = false;
+
+  // Find the valid sector with the highest sequence number.
+  for (sector = 0; sector < ESP_DET_JRNL_SECTORS; sector++) {
+    if (spi_flash_read(jrnl_addr(sector), hdr, sizeof(hdr)) != SPI_FLASH_RESULT_OK) continue;
+    if (hdr[0] != ESP_DET_JRNL_MAGIC) continue;
+    if (found && hdr[1] <= g_jrnl.seq) continue;
+
+    // The first record must be a snapshot.
+    if (!jrnl_rec_read(sector, ESP_DET_JRNL_REC_START, &off, &len)) continue;
+    if (off != 0 || len != g_jrnl.size) continue;
+
+    found = true;
+    g_jrnl.sector = sector;
+    g_jrnl.seq = hdr[1];
+  }
+
+  if (!found) {
+    g_jrnl.compact = true;
+    return ESP_DET_JRNL_ERR_EMPTY;
+  }
+
+  // Replay records. The scan is bounded by the sector size.
+  g_jrnl.pos = ESP_DET_JRNL_REC_START;
+  while (jrnl_rec_read(g_jrnl.sector, g_jrnl.pos, &off, &len)) {
+    os_memcpy(g_jrnl.shadow + off, g_jrnl.buf, len);
+    g_jrnl.pos += ESP_DET_JRNL_HDR_SIZE + ESP_DET_JRNL_ALIGN(len);
+  }
+
+  // Anything other then erased flash after the last valid record
+  // means interrupted write. Never append after it.
+  if (g_jrnl.pos + ESP_DET_JRNL_HDR_SIZE <= SPI_FLASH_SEC_SIZE) {
+    spi_flash_read(jrnl_addr(g_jrnl.sector) + g_jrnl.pos, hdr, 4);
+    g_jrnl.compact = hdr[0] != ESP_DET_JRNL_EMPTY;
+  } else {
+    g_jrnl.compact = true;
+  }
+
+  os_memcpy(g_jrnl.data, g_jrnl.shadow, g_jrnl.size);
+
+  return ESP_DET_JRNL_OK;
+}
+
+esp_det_jrnl_err ICACHE_FLASH_ATTR
+esp_det_jrnl_write()
+{
+  uint16 first, last;
+
+  if (g_jrnl.compact) return jrnl_compact();
+
+  // Find changed range of bytes.
+  for (first = 0; first < g_jrnl.size; first++) {
+    if (g_jrnl.data[first] != g_jrnl.shadow[first]) break;
+  }
+  if (first == g_jrnl.size) return ESP_DET_JRNL_OK;
+
+  for (last = g_jrnl.size; last > first; last--) {
+    if (g_jrnl.data[last - 1] != g_jrnl.shadow[last - 1]) break;
+  }
+
+  uint8_t len = (uint8_t) (last - first);
+  if (g_jrnl.pos + ESP_DET_JRNL_HDR_SIZE + ESP_DET_JRNL_ALIGN(len) > SPI_FLASH_SEC_SIZE) {
+    return jrnl_compact();
+  }
+
+  return jrnl_rec_write(first, len);
+}
+
+uint32_t ICACHE_FLASH_ATTR
+esp_det_jrnl_write_cnt()
+{
+  return g_jrnl.writes;
+}
+
+uint32_t ICACHE_FLASH_ATTR
+esp_det_jrnl_erase_cnt()
+{
+  return g_jrnl.erases;
+}
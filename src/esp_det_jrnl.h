@@ -0,0 +1,81 @@
+/*
+ * Copyright 2017 Rafal Zajac <rzajac@gmail.com>.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef ESP_DET_JRNL_H
+#define ESP_DET_JRNL_H
+
+#include <c_types.h>
+
+// The maximum size of the structure kept in the journal.
+#define ESP_DET_JRNL_DATA_MAX 128
+
+// The journal error codes.
+typedef enum {
+  ESP_DET_JRNL_OK,
+  ESP_DET_JRNL_ERR_SIZE,
+  ESP_DET_JRNL_ERR_EMPTY,
+  ESP_DET_JRNL_ERR_FLASH,
+} esp_det_jrnl_err;
+
+/**
+ * Initialize journal.
+ *
+ * @param data The pointer to the structure kept in the journal.
+ * @param size The structure size. Must not be greater then ESP_DET_JRNL_DATA_MAX.
+ *
+ * @return Error code.
+ */
+esp_det_jrnl_err ICACHE_FLASH_ATTR
+esp_det_jrnl_init(void *data, uint16 size);
+
+/**
+ * Read the latest structure version from the journal.
+ *
+ * Returns ESP_DET_JRNL_ERR_EMPTY when there is no valid journal on flash.
+ *
+ * @return Error code.
+ */
+esp_det_jrnl_err ICACHE_FLASH_ATTR
+esp_det_jrnl_read();
+
+/**
+ * Append structure changes to the journal.
+ *
+ * Only the changed range of bytes is written. Flash sector is erased
+ * only when journal sector is full and the journal is compacted.
+ *
+ * @return Error code.
+ */
+esp_det_jrnl_err ICACHE_FLASH_ATTR
+esp_det_jrnl_write();
+
+/**
+ * Return number of journal writes since boot.
+ *
+ * @return Write count.
+ */
+uint32_t ICACHE_FLASH_ATTR
+esp_det_jrnl_write_cnt();
+
+/**
+ * Return number of flash sector erases since boot.
+ *
+ * @return Erase count.
+ */
+uint32_t ICACHE_FLASH_ATTR
+esp_det_jrnl_erase_cnt();
+
+#endif //ESP_DET_JRNL_H
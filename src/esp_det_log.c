@@ -0,0 +1,153 @@
+/*
+ * Copyright 2017 Rafal Zajac <rzajac@gmail.com>.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+// The deferred log.
+//
+// Log calls store binary records in a ring buffer of pointer sized words
+// (32 bit on ESP8266):
+//
+//   | argc | format pointer | arg 0 | ... | arg argc - 1 |
+//
+// The records are formatted and printed later from a timer so network
+// and WiFi callbacks never wait for the UART.
+
+#include <esp_det.h>
+#include <stdarg.h>
+#include <stdint.h>
+
+#if ESP_DET_LOG_DEFER
+
+// The maximum number of records printed in one timer run.
+#define ESP_DET_LOG_BATCH 8
+
+// The log ring buffer.
+typedef struct {
+  uintptr_t buf[ESP_DET_LOG_WORDS]; // The records.
+  uint16 head;                     // The index of the oldest record word.
+  uint16 used;                     // The number of used words.
+  uint32_t lost;                   // The number of records which did not fit.
+  bool armed;                      // Is drain timer armed.
+  os_timer_t timer;                // The drain timer.
+} det_log;
+
+// The decoded log record.
+typedef struct {
+  uint8_t argc;                        // The number of arguments.
+  const char *fmt;                     // The format string.
+  uintptr_t arg[ESP_DET_LOG_ARGS_MAX]; // The arguments. Zero past argc.
+} det_log_rec;
+
+static det_log g_log;
+
+/**
+ * Remove word from the ring buffer.
+ *
+ * @return The word.
+ */
+static uintptr_t ICACHE_FLASH_ATTR
+log_pop()
+{
+  uintptr_t word = g_log.buf[g_log.head];
+
+  g_log.head = (uint16) ((g_log.head + 1) % ESP_DET_LOG_WORDS);
+  g_log.used--;
+
+  return word;
+}
+
+/**
+ * Remove the oldest record from the ring buffer.
+ *
+ * @param rec The decoded record.
+ *
+ * @return Returns false if ring buffer is empty.
+ */
+static bool ICACHE_FLASH_ATTR
+log_next(det_log_rec *rec)
+{
+  uint8_t idx;
+
+  if (g_log.used == 0) return false;
+
+  rec->argc = (uint8_t) log_pop();
+  rec->fmt = (const char *) log_pop();
+  for (idx = 0; idx < ESP_DET_LOG_ARGS_MAX; idx++) {
+    rec->arg[idx] = idx < rec->argc ? log_pop() : 0;
+  }
+
+  return true;
+}
+
+/** Print records from the ring buffer. */
+static void ICACHE_FLASH_ATTR
+log_drain_cb()
+{
+  uint8_t cnt;
+  det_log_rec rec;
+
+  g_log.armed = false;
+
+  if (g_log.lost > 0) {
+    os_printf("DET LOG: %u records lost\n", g_log.lost);
+    g_log.lost = 0;
+  }
+
+  for (cnt = 0; cnt < ESP_DET_LOG_BATCH && log_next(&rec); cnt++) {
+    os_printf(rec.fmt, rec.arg[0], rec.arg[1], rec.arg[2], rec.arg[3],
+              rec.arg[4], rec.arg[5], rec.arg[6], rec.arg[7]);
+  }
+
+  if (g_log.used > 0) esp_det_log_flush();
+}
+
+void ICACHE_FLASH_ATTR
+esp_det_log(const char *fmt, uint8_t argc, ...)
+{
+  va_list ap;
+  uint16 pos;
+  uint8_t idx;
+
+  if (g_log.used + 2 + argc > ESP_DET_LOG_WORDS) {
+    g_log.lost++;
+    return;
+  }
+
+  pos = (uint16) ((g_log.head + g_log.used) % ESP_DET_LOG_WORDS);
+  g_log.buf[pos] = argc;
+  pos = (uint16) ((pos + 1) % ESP_DET_LOG_WORDS);
+  g_log.buf[pos] = (uintptr_t) fmt;
+
+  va_start(ap, argc);
+  for (idx = 0; idx < argc; idx++) {
+    pos = (uint16) ((pos + 1) % ESP_DET_LOG_WORDS);
+    g_log.buf[pos] = va_arg(ap, uintptr_t);
+  }
+  va_end(ap);
+
+  g_log.used += 2 + argc;
+  if (!g_log.armed) esp_det_log_flush();
+}
+
+void ICACHE_FLASH_ATTR
+esp_det_log_flush()
+{
+  os_timer_disarm(&g_log.timer);
+  os_timer_setfn(&g_log.timer, (os_timer_func_t *) log_drain_cb, NULL);
+  os_timer_arm(&g_log.timer, ESP_DET_LOG_DELAY, false);
+  g_log.armed = true;
+}
+
+#endif
@@ -0,0 +1,516 @@
+/*
+ * Copyright 2017 Rafal Zajac <rzajac@gmail.com>.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+// The TCP command server.
+//
+// Every connection reassembles received data in a fixed buffer and handles
+// commands one by one in the order they were received, so the manager may
+// send a batch of commands without waiting for responses. Commands are
+// framed as:
+//
+//   length prefixed: | 0xFE | length (2, big endian) | command |
+//   JSON:            | { ... } | optional new line |
+//
+// Every response uses framing of the command it answers. JSON responses
+// end with a new line. Data not starting with a marker of enabled framing
+// is handled as one command per receive the way it was before framing was
+// added. Ciphertext may start with any byte, so JSON framing is enabled
+// only for plain text and length prefix only when managers opted in.
+
+#include <esp_det.h>
+#include <espconn.h>
+#include <stddef.h>
+#include "esp_det_srv.h"
+
+#if ESP_DET_SRV_TX_SIZE < ESP_DET_SRV_RES_MAX + 3
+  #error "ESP_DET_SRV_TX_SIZE too small"
+#endif
+
+// The length prefixed frame header size.
+#define ESP_DET_SRV_HDR 3
+// The free response queue space needed to handle the next command.
+#define ESP_DET_SRV_TX_NEED (ESP_DET_SRV_RES_MAX + ESP_DET_SRV_HDR)
+// The inactive connection timeout in seconds.
+#define ESP_DET_SRV_TIMEOUT 60
+
+// The command framing.
+typedef enum {
+  ESP_DET_FR_RAW,  // Not framed.
+  ESP_DET_FR_LEN,  // Length prefixed.
+  ESP_DET_FR_JSON, // JSON object.
+} det_fr;
+
+// The command server connection.
+typedef struct {
+  struct espconn *conn; // The connection. NULL when slot is free.
+  uint8 remote_ip[4];   // The peer IP.
+  int remote_port;      // The peer port.
+  uint16 rx_len;        // The number of buffered received bytes.
+  uint16 tx_len;        // The number of queued response bytes.
+  uint16 tx_busy;       // The number of queued bytes passed to espconn_send.
+  bool skip_eol;        // Skip new line ending previous JSON command.
+  bool hold;            // Is receiving on hold till responses are sent.
+  bool close;           // Close connection from the timer.
+  os_timer_t timer;     // The idle and close timer.
+  uint8_t rx[ESP_DET_SRV_RX_SIZE]; // The reassembly buffer. Must be after fields reset on connect.
+  uint8_t tx[ESP_DET_SRV_TX_SIZE]; // The response queue.
+} det_srv_conn;
+
+// The command server.
+typedef struct {
+  struct espconn conn;  // The listening connection.
+  esp_tcp tcp;          // The listening connection details.
+  esp_det_srv_cb *cb;   // The command callback.
+  uint8_t max;          // The number of connection slots in use.
+  uint8_t framing;      // The ESP_DET_SRV_FR_* flags.
+  bool run;             // Is server running.
+  struct espconn *reject; // The connection to close when there was no free slot.
+  os_timer_t timer;     // The reject timer.
+  det_srv_conn slots[ESP_DET_CMD_MAX]; // The connections.
+} det_srv;
+
+// The connection buffers are part of the slots so accepting
+// a connection never allocates memory.
+static det_srv g_srv;
+
+static void ICACHE_FLASH_ATTR srv_run(det_srv_conn *sc);
+
+/**
+ * Find connection slot.
+ *
+ * The SDK does not pass the same espconn to all callbacks of given
+ * connection so slots are matched by the peer address.
+ *
+ * @param arg The espconn structure passed to the callback.
+ *
+ * @return The slot or NULL if not found.
+ */
+static det_srv_conn *ICACHE_FLASH_ATTR
+srv_find(void *arg)
+{
+  uint8_t idx;
+  struct espconn *conn = arg;
+
+  if (!g_srv.run) return NULL;
+
+  for (idx = 0; idx < g_srv.max; idx++) {
+    det_srv_conn *sc = &g_srv.slots[idx];
+    if (sc->conn == NULL) continue;
+    if (sc->remote_port != conn->proto.tcp->remote_port) continue;
+    if (os_memcmp(sc->remote_ip, conn->proto.tcp->remote_ip, 4) != 0) continue;
+    return sc;
+  }
+
+  return NULL;
+}
+
+/** Release connection slot. */
+static void ICACHE_FLASH_ATTR
+srv_free(det_srv_conn *sc)
+{
+  os_timer_disarm(&sc->timer);
+  sc->conn = NULL;
+  sc->rx_len = 0;
+  sc->tx_len = 0;
+  sc->tx_busy = 0;
+}
+
+/** Close connection from the timer. Never disconnect in espconn callbacks. */
+static void ICACHE_FLASH_ATTR
+srv_close(det_srv_conn *sc)
+{
+  sc->close = true;
+  os_timer_disarm(&sc->timer);
+  os_timer_arm(&sc->timer, 0, false);
+}
+
+/** Returns true if byte starts a frame of enabled framing. */
+static bool ICACHE_FLASH_ATTR
+srv_framed(uint8_t c)
+{
+  if ((g_srv.framing & ESP_DET_SRV_FR_LEN) && c == ESP_DET_SRV_LEN_MAGIC) return true;
+  if ((g_srv.framing & ESP_DET_SRV_FR_JSON) && c == '{') return true;
+
+  return false;
+}
+
+/**
+ * Find the end of JSON object at the beginning of the buffer.
+ *
+ * @param buf The buffer starting with '{'.
+ * @param len The buffer length.
+ *
+ * @return The object length. Zero if object is not complete.
+ */
+static uint16 ICACHE_FLASH_ATTR
+srv_json_end(const uint8_t *buf, uint16 len)
+{
+  uint16 idx;
+  uint16 depth = 0;
+  bool str = false;
+  bool esc = false;
+
+  for (idx = 0; idx < len; idx++) {
+    uint8_t c = buf[idx];
+    if (str) {
+      if (esc) esc = false;
+      else if (c == '\\') esc = true;
+      else if (c == '"') str = false;
+    } else if (c == '"') {
+      str = true;
+    } else if (c == '{') {
+      depth++;
+    } else if (c == '}') {
+      if (--depth == 0) return (uint16) (idx + 1);
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Find the first complete command in the reassembly buffer.
+ *
+ * @param sc   The connection.
+ * @param fr   Set to command framing.
+ * @param off  Set to command offset.
+ * @param len  Set to command length.
+ * @param used Set to number of bytes to remove from the buffer.
+ *
+ * @return Returns true if complete command was found.
+ */
+static bool ICACHE_FLASH_ATTR
+srv_frame(det_srv_conn *sc, det_fr *fr, uint16 *off, uint16 *len, uint16 *used)
+{
+  uint8_t *buf = sc->rx;
+
+  if ((g_srv.framing & ESP_DET_SRV_FR_LEN) && buf[0] == ESP_DET_SRV_LEN_MAGIC) {
+    if (sc->rx_len < ESP_DET_SRV_HDR) return false;
+    *fr = ESP_DET_FR_LEN;
+    *off = ESP_DET_SRV_HDR;
+    *len = (uint16) ((buf[1] << 8) | buf[2]);
+    *used = (uint16) (ESP_DET_SRV_HDR + *len);
+    return *used <= sc->rx_len;
+  }
+
+  if ((g_srv.framing & ESP_DET_SRV_FR_JSON) && buf[0] == '{') {
+    *fr = ESP_DET_FR_JSON;
+    *off = 0;
+    *len = srv_json_end(buf, sc->rx_len);
+    *used = *len;
+    return *len > 0;
+  }
+
+  *fr = ESP_DET_FR_RAW;
+  *off = 0;
+  *len = sc->rx_len;
+  *used = sc->rx_len;
+
+  return true;
+}
+
+/**
+ * Handle command and queue its response.
+ *
+ * The caller makes sure there is ESP_DET_SRV_TX_NEED bytes free in the queue.
+ *
+ * @param sc  The connection.
+ * @param fr  The command framing.
+ * @param req The command.
+ * @param len The command length.
+ */
+static void ICACHE_FLASH_ATTR
+srv_handle(det_srv_conn *sc, det_fr fr, uint8_t *req, uint16 len)
+{
+  uint8_t *res = sc->tx + sc->tx_len + (fr == ESP_DET_FR_LEN ? ESP_DET_SRV_HDR : 0);
+  uint16 res_len = g_srv.cb(res, ESP_DET_SRV_RES_MAX, req, len);
+  if (res_len == 0) return;
+
+  if (fr == ESP_DET_FR_LEN) {
+    res[-3] = ESP_DET_SRV_LEN_MAGIC;
+    res[-2] = (uint8_t) (res_len >> 8);
+    res[-1] = (uint8_t) res_len;
+    sc->tx_len += ESP_DET_SRV_HDR;
+  }
+
+  sc->tx_len += res_len;
+  if (fr == ESP_DET_FR_JSON) sc->tx[sc->tx_len++] = '\n';
+}
+
+/**
+ * Handle all complete commands in the reassembly buffer.
+ *
+ * Stops when response queue is full. The rest is handled after
+ * queued responses are sent.
+ */
+static void ICACHE_FLASH_ATTR
+srv_process(det_srv_conn *sc)
+{
+  det_fr fr;
+  uint16 off, len, used;
+
+  while (sc->rx_len > 0 && ESP_DET_SRV_TX_SIZE - sc->tx_len >= ESP_DET_SRV_TX_NEED) {
+    if (sc->skip_eol && (sc->rx[0] == '\r' || sc->rx[0] == '\n')) {
+      used = 1;
+    } else {
+      sc->skip_eol = false;
+      if (!srv_frame(sc, &fr, &off, &len, &used)) break;
+      srv_handle(sc, fr, sc->rx + off, len);
+      sc->skip_eol = fr == ESP_DET_FR_JSON;
+    }
+
+    sc->rx_len -= used;
+    os_memmove(sc->rx, sc->rx + used, sc->rx_len);
+  }
+}
+
+/** Send queued responses if nothing is being sent. */
+static void ICACHE_FLASH_ATTR
+srv_flush(det_srv_conn *sc)
+{
+  sint8 err;
+
+  if (sc->tx_busy > 0 || sc->tx_len == 0) return;
+
+  if ((err = espconn_send(sc->conn, sc->tx, sc->tx_len)) != ESPCONN_OK) {
+    ESP_DET_ERROR("Failed sending command response with error: %d.\n", err);
+    srv_close(sc);
+    return;
+  }
+
+  sc->tx_busy = sc->tx_len;
+}
+
+/**
+ * The connection timer callback.
+ *
+ * Closes the connection or handles incomplete command as not framed
+ * when the rest of it did not arrive in ESP_DET_SRV_IDLE milliseconds.
+ */
+static void ICACHE_FLASH_ATTR
+srv_timer_cb(void *arg)
+{
+  det_srv_conn *sc = arg;
+
+  if (sc->conn == NULL) return;
+
+  if (sc->close) {
+    espconn_disconnect(sc->conn);
+    srv_free(sc);
+    return;
+  }
+
+  if (sc->rx_len > 0 && ESP_DET_SRV_TX_SIZE - sc->tx_len >= ESP_DET_SRV_TX_NEED) {
+    ESP_DET_DEBUG("Handling %d incomplete bytes as not framed command.\n", sc->rx_len);
+    srv_handle(sc, ESP_DET_FR_RAW, sc->rx, sc->rx_len);
+    sc->rx_len = 0;
+  }
+
+  srv_run(sc);
+}
+
+/** Handle received commands, send responses and manage flow control. */
+static void ICACHE_FLASH_ATTR
+srv_run(det_srv_conn *sc)
+{
+  srv_process(sc);
+  srv_flush(sc);
+  if (sc->close) return;
+
+  bool room = ESP_DET_SRV_TX_SIZE - sc->tx_len >= ESP_DET_SRV_TX_NEED;
+
+  // Stop receiving till responses are sent.
+  if (!room && !sc->hold) {
+    espconn_recv_hold(sc->conn);
+    sc->hold = true;
+  } else if (room && sc->hold) {
+    espconn_recv_unhold(sc->conn);
+    sc->hold = false;
+  }
+
+  os_timer_disarm(&sc->timer);
+  if (room && sc->rx_len > 0) {
+    // Command which does not fit in the buffer will never be complete.
+    if (sc->rx_len == ESP_DET_SRV_RX_SIZE) {
+      ESP_DET_ERROR("Command does not fit in %d bytes.\n", ESP_DET_SRV_RX_SIZE);
+      srv_close(sc);
+      return;
+    }
+    os_timer_arm(&sc->timer, ESP_DET_SRV_IDLE, false);
+  }
+}
+
+/**
+ * Receive data on command server connection.
+ *
+ * @param arg  The espconn structure.
+ * @param data The received data.
+ * @param len  The received data length.
+ */
+static void ICACHE_FLASH_ATTR
+srv_recv_cb(void *arg, char *data, unsigned short len)
+{
+  det_srv_conn *sc = srv_find(arg);
+  if (sc == NULL || sc->close) return;
+
+  if (len > ESP_DET_SRV_RX_SIZE - sc->rx_len) {
+    ESP_DET_ERROR("Command does not fit in %d bytes.\n", ESP_DET_SRV_RX_SIZE);
+    srv_close(sc);
+    return;
+  }
+
+  // Not framed command must not be merged with data received later.
+  bool raw = sc->rx_len == 0 && len > 0 && !srv_framed((uint8_t) data[0])
+             && !(sc->skip_eol && (data[0] == '\r' || data[0] == '\n'));
+
+  os_memcpy(sc->rx + sc->rx_len, data, len);
+  sc->rx_len += len;
+
+  if (raw && ESP_DET_SRV_TX_SIZE - sc->tx_len >= ESP_DET_SRV_TX_NEED) {
+    srv_handle(sc, ESP_DET_FR_RAW, sc->rx, sc->rx_len);
+    sc->rx_len = 0;
+    sc->skip_eol = false;
+  }
+
+  srv_run(sc);
+}
+
+/** The response sent callback. */
+static void ICACHE_FLASH_ATTR
+srv_sent_cb(void *arg)
+{
+  det_srv_conn *sc = srv_find(arg);
+  if (sc == NULL) return;
+
+  sc->tx_len -= sc->tx_busy;
+  os_memmove(sc->tx, sc->tx + sc->tx_busy, sc->tx_len);
+  sc->tx_busy = 0;
+
+  srv_run(sc);
+}
+
+/** The connection closed callback. */
+static void ICACHE_FLASH_ATTR
+srv_discon_cb(void *arg)
+{
+  det_srv_conn *sc = srv_find(arg);
+  if (sc != NULL) srv_free(sc);
+}
+
+/** The connection error callback. */
+static void ICACHE_FLASH_ATTR
+srv_recon_cb(void *arg, sint8 err)
+{
+  ESP_DET_DEBUG("Command connection error: %d.\n", err);
+  srv_discon_cb(arg);
+}
+
+/** Close connection which did not get a slot. */
+static void ICACHE_FLASH_ATTR
+srv_reject_cb(void *arg)
+{
+  if (g_srv.reject == NULL) return;
+
+  espconn_disconnect(g_srv.reject);
+  g_srv.reject = NULL;
+}
+
+/** The new connection callback. */
+static void ICACHE_FLASH_ATTR
+srv_connect_cb(void *arg)
+{
+  uint8_t idx;
+  struct espconn *conn = arg;
+  det_srv_conn *sc = NULL;
+
+  for (idx = 0; idx < g_srv.max; idx++) {
+    if (g_srv.slots[idx].conn == NULL) {
+      sc = &g_srv.slots[idx];
+      break;
+    }
+  }
+
+  if (sc == NULL) {
+    ESP_DET_ERROR("No free command connection slots.\n");
+    g_srv.reject = conn;
+    os_timer_disarm(&g_srv.timer);
+    os_timer_arm(&g_srv.timer, 0, false);
+    return;
+  }
+
+  os_memset(sc, 0, offsetof(det_srv_conn, rx));
+  sc->conn = conn;
+  sc->remote_port = conn->proto.tcp->remote_port;
+  os_memcpy(sc->remote_ip, conn->proto.tcp->remote_ip, 4);
+  os_timer_setfn(&sc->timer, srv_timer_cb, sc);
+
+  espconn_regist_recvcb(conn, srv_recv_cb);
+  espconn_regist_sentcb(conn, srv_sent_cb);
+  espconn_regist_disconcb(conn, srv_discon_cb);
+  espconn_regist_reconcb(conn, srv_recon_cb);
+}
+
+sint8 ICACHE_FLASH_ATTR
+esp_det_srv_start(uint16 port, uint8_t max, esp_det_srv_cb *cb, uint8_t framing)
+{
+  sint8 err;
+
+  if (g_srv.run) return ESPCONN_OK;
+  if (max > ESP_DET_CMD_MAX) max = ESP_DET_CMD_MAX;
+
+  os_memset(g_srv.slots, 0, sizeof(g_srv.slots));
+  g_srv.max = max;
+  g_srv.cb = cb;
+  g_srv.framing = framing;
+  g_srv.reject = NULL;
+  os_timer_setfn(&g_srv.timer, srv_reject_cb, NULL);
+
+  os_memset(&g_srv.conn, 0, sizeof(struct espconn));
+  os_memset(&g_srv.tcp, 0, sizeof(esp_tcp));
+  g_srv.conn.type = ESPCONN_TCP;
+  g_srv.conn.state = ESPCONN_NONE;
+  g_srv.conn.proto.tcp = &g_srv.tcp;
+  g_srv.tcp.local_port = port;
+  espconn_regist_connectcb(&g_srv.conn, srv_connect_cb);
+
+  if ((err = espconn_accept(&g_srv.conn)) != ESPCONN_OK) return err;
+
+  espconn_tcp_set_max_con_allow(&g_srv.conn, max);
+  espconn_regist_time(&g_srv.conn, ESP_DET_SRV_TIMEOUT, 0);
+  g_srv.run = true;
+
+  return ESPCONN_OK;
+}
+
+void ICACHE_FLASH_ATTR
+esp_det_srv_stop()
+{
+  uint8_t idx;
+
+  if (!g_srv.run) return;
+
+  for (idx = 0; idx < g_srv.max; idx++) {
+    det_srv_conn *sc = &g_srv.slots[idx];
+    if (sc->conn == NULL) continue;
+    espconn_disconnect(sc->conn);
+    srv_free(sc);
+  }
+
+  os_timer_disarm(&g_srv.timer);
+  g_srv.reject = NULL;
+  espconn_delete(&g_srv.conn);
+  g_srv.run = false;
+}
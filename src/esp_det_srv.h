@@ -0,0 +1,67 @@
+/*
+ * Copyright 2017 Rafal Zajac <rzajac@gmail.com>.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef ESP_DET_SRV_H
+#define ESP_DET_SRV_H
+
+#include <c_types.h>
+
+// The first byte of length prefixed frame.
+#define ESP_DET_SRV_LEN_MAGIC 0xFE
+// The maximum response length the command callback may be asked for.
+#define ESP_DET_SRV_RES_MAX 320
+
+// The framing flags.
+#define ESP_DET_SRV_FR_LEN  0x01 // Recognize length prefixed commands.
+#define ESP_DET_SRV_FR_JSON 0x02 // Recognize JSON object commands.
+
+/**
+ * Command callback.
+ *
+ * Called once for every received command in the order they were received.
+ * The command buffer may be changed by the callback.
+ *
+ * @param res     Pointer to response buffer.
+ * @param res_len The response buffer length.
+ * @param req     The command.
+ * @param req_len The command length.
+ *
+ * @return The response length. Zero for no response.
+ */
+typedef uint16 (esp_det_srv_cb)(uint8_t *res, uint16 res_len, uint8_t *req, uint16 req_len);
+
+/**
+ * Start TCP command server.
+ *
+ * Commands are framed only when they start with a marker of framing
+ * enabled in flags. Encrypted commands may start with any byte so JSON
+ * framing must be used only for plain text.
+ *
+ * @param port    The port to listen on.
+ * @param max     The maximum number of connections. Must not be greater then ESP_DET_CMD_MAX.
+ * @param cb      The command callback.
+ * @param framing The ESP_DET_SRV_FR_* flags. Zero to handle one command per receive.
+ *
+ * @return The espconn error code. ESPCONN_OK if server is already running.
+ */
+sint8 ICACHE_FLASH_ATTR
+esp_det_srv_start(uint16 port, uint8_t max, esp_det_srv_cb *cb, uint8_t framing);
+
+/** Stop TCP command server and close all connections. */
+void ICACHE_FLASH_ATTR
+esp_det_srv_stop();
+
+#endif //ESP_DET_SRV_H
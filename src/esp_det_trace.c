@@ -0,0 +1,170 @@
+/*
+ * Copyright 2017 Rafal Zajac <rzajac@gmail.com>.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+// The library event trace.
+//
+// Events are kept in a fixed size ring buffer in RAM. They can be drained
+// by the user program or dumped over UART as Chrome trace event JSON
+// (load it in chrome://tracing). In the dump every detection stage and
+// the wait for DHCP between association and IP are duration events.
+
+#include <esp_det.h>
+#include "esp_det_trace.h"
+
+#if ESP_DET_TRACE
+
+// The number of events drained at once while dumping.
+#define ESP_DET_TRACE_BATCH 8
+
+// The trace ring buffer.
+typedef struct {
+  esp_det_trace_ev ev[ESP_DET_TRACE_SIZE]; // The events.
+  uint16 head;     // The index of the oldest event.
+  uint16 cnt;      // The number of events in the buffer.
+  uint32_t lost;   // The number of overwritten events.
+} det_trace;
+
+static det_trace g_trace;
+
+// The stage names indexed by stage.
+static const char *trace_stages[] = {"??", "DM", "CN", "DS", "OP"};
+
+void ICACHE_FLASH_ATTR
+esp_det_trace_add(esp_det_tr type, uint8_t arg)
+{
+  esp_det_trace_ev *ev;
+
+  if (g_trace.cnt == ESP_DET_TRACE_SIZE) {
+    g_trace.head = (uint16) ((g_trace.head + 1) % ESP_DET_TRACE_SIZE);
+    g_trace.cnt--;
+    g_trace.lost++;
+  }
+
+  ev = &g_trace.ev[(g_trace.head + g_trace.cnt) % ESP_DET_TRACE_SIZE];
+  ev->time = system_get_time();
+  ev->type = (uint8_t) type;
+  ev->arg = arg;
+  g_trace.cnt++;
+}
+
+uint16 ICACHE_FLASH_ATTR
+esp_det_trace_drain(esp_det_trace_ev *evs, uint16 max)
+{
+  uint16 idx;
+
+  for (idx = 0; idx < max && g_trace.cnt > 0; idx++) {
+    evs[idx] = g_trace.ev[g_trace.head];
+    g_trace.head = (uint16) ((g_trace.head + 1) % ESP_DET_TRACE_SIZE);
+    g_trace.cnt--;
+  }
+
+  return idx;
+}
+
+/**
+ * Print one Chrome trace event.
+ *
+ * @param sep  The separator printed before the event.
+ * @param name The event name.
+ * @param ph   The event phase.
+ * @param ev   The trace event.
+ * @param tid  The thread ID (timeline row).
+ */
+static void ICACHE_FLASH_ATTR
+trace_print(const char *sep, const char *name, char ph, const esp_det_trace_ev *ev, uint8_t tid)
+{
+  os_printf("%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%u,\"pid\":%u,\"tid\":%d,\"args\":{\"arg\":%d}%s}\n",
+            sep, name, ph, ev->time, system_get_chip_id(), tid, ev->arg, ph == 'i' ? ",\"s\":\"t\"" : "");
+}
+
+void ICACHE_FLASH_ATTR
+esp_det_trace_dump()
+{
+  uint16 idx, cnt;
+  esp_det_trace_ev evs[ESP_DET_TRACE_BATCH];
+  const char *sep = "";
+  const char *stage = NULL;
+  bool dhcp = false;
+
+  os_printf("{\"traceEvents\":[\n");
+
+  while ((cnt = esp_det_trace_drain(evs, ESP_DET_TRACE_BATCH)) > 0) {
+    for (idx = 0; idx < cnt; idx++) {
+      esp_det_trace_ev *ev = &evs[idx];
+
+      switch (ev->type) {
+        case ESP_DET_TR_STAGE:
+          if (stage != NULL) {
+            trace_print(sep, stage, 'E', ev, 1);
+            sep = ",";
+          }
+          stage = trace_stages[ev->arg < sizeof(trace_stages) / sizeof(trace_stages[0]) ? ev->arg : 0];
+          trace_print(sep, stage, 'B', ev, 1);
+          break;
+
+        case ESP_DET_TR_WIFI:
+          if (ev->arg == EVENT_STAMODE_CONNECTED && !dhcp) {
+            trace_print(sep, "DHCP", 'B', ev, 2);
+            dhcp = true;
+          } else if ((ev->arg == EVENT_STAMODE_GOT_IP || ev->arg == EVENT_STAMODE_DISCONNECTED) && dhcp) {
+            trace_print(sep, "DHCP", 'E', ev, 2);
+            dhcp = false;
+          } else {
+            trace_print(sep, "wifi", 'i', ev, 2);
+          }
+          break;
+
+        case ESP_DET_TR_GOT_IP:
+          trace_print(sep, "gotIp", 'i', ev, 3);
+          break;
+
+        case ESP_DET_TR_DISC:
+          trace_print(sep, "disconnect", 'i', ev, 3);
+          break;
+
+        case ESP_DET_TR_BRD:
+          trace_print(sep, "broadcast", 'i', ev, 3);
+          break;
+
+        case ESP_DET_TR_CMD:
+          trace_print(sep, "command", 'i', ev, 3);
+          break;
+
+        default:
+          trace_print(sep, "unknown", 'i', ev, 3);
+      }
+
+      sep = ",";
+    }
+  }
+
+  os_printf("],\"otherData\":{\"lost\":%u}}\n", g_trace.lost);
+  g_trace.lost = 0;
+}
+
+#else
+
+uint16 ICACHE_FLASH_ATTR
+esp_det_trace_drain(esp_det_trace_ev *evs, uint16 max)
+{
+  return 0;
+}
+
+void ICACHE_FLASH_ATTR
+esp_det_trace_dump()
+{}
+
+#endif
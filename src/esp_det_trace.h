@@ -0,0 +1,39 @@
+/*
+ * Copyright 2017 Rafal Zajac <rzajac@gmail.com>.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef ESP_DET_TRACE_H
+#define ESP_DET_TRACE_H
+
+#include <esp_det.h>
+
+#if ESP_DET_TRACE
+  #define ESP_DET_TRACE_EV(type, arg) esp_det_trace_add((type), (uint8_t) (arg))
+#else
+  #define ESP_DET_TRACE_EV(type, arg) do {} while(0)
+#endif
+
+/**
+ * Add event to the trace ring buffer.
+ *
+ * When the ring buffer is full the oldest event is overwritten.
+ *
+ * @param type The event type.
+ * @param arg  The event argument.
+ */
+void ICACHE_FLASH_ATTR
+esp_det_trace_add(esp_det_tr type, uint8_t arg);
+
+#endif //ESP_DET_TRACE_H
@@ -30,18 +30,149 @@
   #define DEBUG_ON 0
 #endif
 
+// Set to 1 to store log messages in RAM as binary records (format pointer and
+// arguments) and print them later from a timer. Network callbacks then do not
+// block on UART. Arguments must be integers or pointers to strings which do
+// not change till the message is printed. At most ESP_DET_LOG_ARGS_MAX
+// arguments are allowed.
+#ifndef ESP_DET_LOG_DEFER
+  #define ESP_DET_LOG_DEFER 1
+#endif
+
+// The size of the deferred log ring buffer in 32 bit words.
+// Every record takes two words plus one word for every argument.
+#ifndef ESP_DET_LOG_WORDS
+  #define ESP_DET_LOG_WORDS 256
+#endif
+
+// The delay in milliseconds before deferred log records are printed.
+#ifndef ESP_DET_LOG_DELAY
+  #define ESP_DET_LOG_DELAY 20
+#endif
+
+// The maximum number of deferred log message arguments.
+#define ESP_DET_LOG_ARGS_MAX 8
+
+// Count macro arguments (0 to ESP_DET_LOG_ARGS_MAX).
+#define ESP_DET_NARGS(...) ESP_DET_NARGS_(0, ## __VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define ESP_DET_NARGS_(_0, _1, _2, _3, _4, _5, _6, _7, _8, N, ...) N
+
+#if ESP_DET_LOG_DEFER
+  #define ESP_DET_LOG(format, ...) esp_det_log(format, ESP_DET_NARGS(__VA_ARGS__), ## __VA_ARGS__)
+#else
+  #define ESP_DET_LOG(format, ...) os_printf(format, ## __VA_ARGS__)
+#endif
+
 #if ESP_DET_DEBUG_ON || DEBUG_ON
-  #define ESP_DET_DEBUG(format, ...) os_printf("DET DBG: " format, ## __VA_ARGS__ )
+  #define ESP_DET_DEBUG(format, ...) ESP_DET_LOG("DET DBG: " format, ## __VA_ARGS__ )
 #else
   #define ESP_DET_DEBUG(format, ...) do {} while(0)
 #endif
 
-#define ESP_DET_ERROR(format, ...) os_printf("DET ERR: " format, ## __VA_ARGS__ )
+#define ESP_DET_ERROR(format, ...) ESP_DET_LOG("DET ERR: " format, ## __VA_ARGS__ )
+
+// Set to 1 to decode commands with cJSON instead of the built in
+// single pass tokenizer. The tokenizer does not allocate memory.
+#ifndef ESP_DET_CMD_CJSON
+  #define ESP_DET_CMD_CJSON 0
+#endif
+
+// Set to 1 to keep all library state in static memory. In this mode the
+// library allocates heap memory only with ESP_DET_CMD_CJSON when a command
+// does not fit in the cJSON arena.
+// Set to 0 to allocate the state on the heap in esp_det_start.
+#ifndef ESP_DET_STATIC
+  #define ESP_DET_STATIC 1
+#endif
+
+// The maximum length of the encrypted command when ESP_DET_STATIC is set
+// and command can not be decrypted in place.
+#ifndef ESP_DET_CMD_REQ_MAX
+  #define ESP_DET_CMD_REQ_MAX 256
+#endif
+
+// The maximum size of the arena cJSON allocates from while decoding a command
+// (ESP_DET_CMD_CJSON only).
+// The whole arena is released in one step when the command is done.
+// Allocations not fitting in the arena fall back to the heap.
+#ifndef ESP_DET_CMD_ARENA
+  #define ESP_DET_CMD_ARENA 1024
+#endif
+
+// The cipher block size. Chunks passed to esp_det_crypt callbacks other
+// then the last one are multiple of it.
+#ifndef ESP_DET_CRYPT_BLOCK
+  #define ESP_DET_CRYPT_BLOCK 16
+#endif
+
+// Set to 1 to record library events in RAM ring buffer.
+// See esp_det_trace_drain and esp_det_trace_dump.
+#ifndef ESP_DET_TRACE
+  #define ESP_DET_TRACE 0
+#endif
+
+// The number of events the trace ring buffer holds.
+#ifndef ESP_DET_TRACE_SIZE
+  #define ESP_DET_TRACE_SIZE 64
+#endif
 
 // This must be changed every time flash_cfg structure changes.
-#define ESP_DET_CFG_MAGIC 16
+#define ESP_DET_CFG_MAGIC 18
+// The magic number of configuration stored with esp_cfg before the journal
+// and last connection details were added. It's imported on first boot.
+#define ESP_DET_CFG_MAGIC_V1 16
 // The esp_cfg configuration index to use.
 #define ESP_DET_CFG_IDX 0
+
+// The number of esp_cfg indexes used by the program. Every index takes
+// one flash sector starting at ESP_CFG_START_SECTOR.
+#ifndef ESP_DET_CFG_IDX_CNT
+  #define ESP_DET_CFG_IDX_CNT 2
+#endif
+
+#ifndef ESP_CFG_START_SECTOR
+  #define ESP_CFG_START_SECTOR 0xC
+#endif
+
+// Set to 0 to store configuration with esp_cfg instead of the flash journal.
+// The journal appends only changed bytes and erases flash only when it
+// moves to the next sector.
+#ifndef ESP_DET_CFG_JRNL
+  #define ESP_DET_CFG_JRNL 1
+#endif
+
+// The first flash sector used by configuration journal.
+// By default the journal starts right after the esp_cfg sectors.
+#ifndef ESP_DET_JRNL_SECTOR
+  #define ESP_DET_JRNL_SECTOR (ESP_CFG_START_SECTOR + ESP_DET_CFG_IDX_CNT)
+#endif
+
+// The number of flash sectors used by configuration journal (at least 2).
+#ifndef ESP_DET_JRNL_SECTORS
+  #define ESP_DET_JRNL_SECTORS 2
+#endif
+
+#if ESP_DET_CFG_IDX >= ESP_DET_CFG_IDX_CNT
+  #error "ESP_DET_CFG_IDX must be less than ESP_DET_CFG_IDX_CNT."
+#endif
+
+#if ESP_DET_JRNL_SECTOR < ESP_CFG_START_SECTOR + ESP_DET_CFG_IDX_CNT \
+    && ESP_DET_JRNL_SECTOR + ESP_DET_JRNL_SECTORS > ESP_CFG_START_SECTOR
+  #error "The configuration journal overlaps esp_cfg sectors."
+#endif
+
+// The RTC user memory block where the boot counter is kept (64 - 189).
+#ifndef ESP_DET_RTC_BLOCK
+  #define ESP_DET_RTC_BLOCK 64
+#endif
+
+// Write the boot counter to flash every ESP_DET_CNT_SYNC boots.
+// Between syncs it's kept in RTC memory which survives resets
+// but not power loss. Set to 1 to write it on every boot.
+#ifndef ESP_DET_CNT_SYNC
+  #define ESP_DET_CNT_SYNC 16
+#endif
+
 // The maximum detection access point name length.
 #define ESP_DET_AP_NAME_MAX 18
 // The maximum detection access point password length.
@@ -56,6 +187,124 @@
 // Maximum number of TCP connections to allow for command server.
 #define ESP_DET_CMD_MAX 2
 
+// The size of per connection buffer commands received over TCP are reassembled in.
+// Commands (with framing) longer then that close the connection.
+#ifndef ESP_DET_SRV_RX_SIZE
+  #define ESP_DET_SRV_RX_SIZE 512
+#endif
+
+// The size of per connection queue for responses waiting to be sent.
+// Must fit at least one 320 byte response with framing.
+#ifndef ESP_DET_SRV_TX_SIZE
+  #define ESP_DET_SRV_TX_SIZE 648
+#endif
+
+// Encrypted commands are recognized only with length prefix. Set to 0 for
+// managers sending encrypted commands without it, every receive is then
+// handled as one command.
+#ifndef ESP_DET_SRV_CRYPT_FRAMED
+  #define ESP_DET_SRV_CRYPT_FRAMED 1
+#endif
+
+// Milliseconds to wait for the rest of incomplete framed command before
+// buffered data is handled as one not framed command.
+#ifndef ESP_DET_SRV_IDLE
+  #define ESP_DET_SRV_IDLE 500
+#endif
+
+// The initial interval in milliseconds between discovery broadcasts in ESP_DET_ST_DS stage.
+#ifndef ESP_DET_DS_INTERVAL
+  #define ESP_DET_DS_INTERVAL 1000
+#endif
+
+// The maximum interval in milliseconds between discovery broadcasts.
+#ifndef ESP_DET_DS_INTERVAL_MAX
+  #define ESP_DET_DS_INTERVAL_MAX 4000
+#endif
+
+// The percentage the interval between discovery broadcasts grows by after every broadcast.
+// Set to 100 for constant interval.
+#ifndef ESP_DET_DS_BACKOFF
+  #define ESP_DET_DS_BACKOFF 150
+#endif
+
+// The random jitter applied to every discovery broadcast interval in percents.
+// Random generator is seeded with device MAC address so devices started at
+// the same time do not broadcast in lockstep.
+#ifndef ESP_DET_DS_JITTER
+  #define ESP_DET_DS_JITTER 25
+#endif
+
+// The number of discovery packets sent by unicast to the last known manager
+// before falling back to broadcast. Set to 0 to always broadcast.
+#ifndef ESP_DET_DS_UNICAST_MISS
+  #define ESP_DET_DS_UNICAST_MISS 3
+#endif
+
+// Set to 1 to require the nonce from the last discovery broadcast also on
+// TCP commands changing configuration in ESP_DET_ST_DS stage. Managers must
+// then wait for a broadcast before configuring the device over TCP.
+#ifndef ESP_DET_TCP_NONCE
+  #define ESP_DET_TCP_NONCE 0
+#endif
+
+// The time in milliseconds to wait for main server configuration
+// before configuration is reset.
+#ifndef ESP_DET_DS_BUDGET
+  #define ESP_DET_DS_BUDGET 10000
+#endif
+
+// The number of ESP_DET_ST_DM stage attempts before configuration is reset.
+#ifndef ESP_DET_DM_RETRY_MAX
+  #define ESP_DET_DM_RETRY_MAX 10
+#endif
+
+// The number of ESP_DET_ST_CN stage attempts before configuration is reset.
+// Configuration which connected to access point before is never reset,
+// instead library waits for access point to come back.
+#ifndef ESP_DET_CN_RETRY_MAX
+  #define ESP_DET_CN_RETRY_MAX 10
+#endif
+
+// The initial delay in milliseconds before reconnecting to access point.
+#ifndef ESP_DET_CN_DELAY
+  #define ESP_DET_CN_DELAY 1000
+#endif
+
+// The maximum delay in milliseconds between reconnection attempts.
+#ifndef ESP_DET_CN_DELAY_MAX
+  #define ESP_DET_CN_DELAY_MAX 30000
+#endif
+
+// The percentage the reconnection delay grows by after every failed attempt.
+#ifndef ESP_DET_CN_BACKOFF
+  #define ESP_DET_CN_BACKOFF 200
+#endif
+
+// The random jitter applied to every reconnection delay in percents.
+#ifndef ESP_DET_CN_JITTER
+  #define ESP_DET_CN_JITTER 50
+#endif
+
+// The maximum time in milliseconds to wait for an IP address from access point.
+#ifndef ESP_DET_IP_TIMEOUT
+  #define ESP_DET_IP_TIMEOUT 15000
+#endif
+
+// The maximum time in milliseconds to wait for an IP address when reconnecting
+// directly to the last known BSSID and channel. After it expires the library
+// falls back to regular connection with scan and DHCP.
+#ifndef ESP_DET_FAST_TIMEOUT
+  #define ESP_DET_FAST_TIMEOUT 3000
+#endif
+
+// Set to 1 to reuse the last IP, gateway and netmask when reconnecting instead
+// of waiting for DHCP. DHCP is restarted right after connecting so the lease
+// is renewed. Use only on networks where DHCP leases are stable.
+#ifndef ESP_DET_FAST_IP
+  #define ESP_DET_FAST_IP 0
+#endif
+
 // The ESP detect error codes.
 typedef enum {
   ESP_DET_OK,
@@ -76,6 +325,23 @@ typedef enum {
   ESP_DET_ERR_CFG,
 } esp_det_err;
 
+// The trace event types.
+typedef enum {
+  ESP_DET_TR_STAGE,  // Detection stage changed. The argument is the new stage.
+  ESP_DET_TR_WIFI,   // WiFi event. The argument is the SDK event number.
+  ESP_DET_TR_GOT_IP, // Got IP handled. The argument is the detection stage.
+  ESP_DET_TR_DISC,   // Disconnect handled. The argument is the disconnect reason.
+  ESP_DET_TR_BRD,    // Discovery broadcast. The argument is 1 if it was sent.
+  ESP_DET_TR_CMD,    // Command handled. The argument is 1 on success.
+} esp_det_tr;
+
+// The trace event.
+typedef struct {
+  uint32_t time; // The system_get_time() in microseconds.
+  uint8_t type;  // The esp_det_tr event type.
+  uint8_t arg;   // The event argument.
+} esp_det_trace_ev;
+
 // Structure describing main server connection.
 typedef struct {
   uint32_t ip;   // The main server IP.
@@ -84,6 +350,25 @@ typedef struct {
   char pass[ESP_DET_SRV_PASS_MAX]; // The main server password.
 } esp_det_srv;
 
+// The library runtime statistics.
+typedef struct {
+  uint8_t stage;       // The current detection stage (1 - DM, 2 - CN, 3 - DS, 4 - OP).
+  uint8_t dm_err_cnt;  // Unsuccessful switches to DM stage since stage change.
+  uint8_t cn_err_cnt;  // Unsuccessful switches to CN stage since stage change.
+  uint8_t sr_err_cnt;  // Discovery broadcasts since stage change.
+  uint32_t flash_wr;   // The number of configuration flash writes since boot.
+  uint32_t flash_er;   // The number of flash sector erases since boot.
+  uint32_t brd_cnt;    // The number of discovery broadcasts sent since boot.
+  uint32_t rcn_cnt;    // The number of scheduled reconnects since boot.
+  uint32_t disc_cnt;   // The number of disconnects since boot.
+  // The disconnect reasons seen since boot. Bits 1 - 23 are reasons 1 - 23,
+  // bits 24 - 31 are reasons 200 - 207 and bit 0 is any other reason.
+  uint32_t disc_mask;
+  uint8_t disc_last;   // The last disconnect reason.
+  uint32_t heap_min;   // The lowest free heap size seen by the library.
+  uint32_t stage_time; // The time in milliseconds spent in the current stage.
+} esp_det_stats;
+
 /**
  * Function prototype called when device is successfully configured and is connected to WiFi network.
  *
@@ -102,12 +387,33 @@ typedef void (esp_det_disconnect)();
 /**
  * Function prototype for encrypting and decrypting array of bytes.
  *
+ * The dst and src never point to the same buffer.
+ *
  * @param dst     The destination buffer.
  * @param src     The source buffer (to be encrypted or decrypted).
  * @param src_len The length of the source data.
  */
 typedef uint16 (esp_det_enc_dec)(uint8_t *dst, const uint8_t *src, uint16 src_len);
 
+// The esp_det_crypt callback flags.
+#define ESP_DET_CRYPT_FIRST 0x01 // The first chunk of the message.
+#define ESP_DET_CRYPT_LAST  0x02 // The last chunk of the message.
+
+/**
+ * Function prototype for encrypting and decrypting message in place.
+ *
+ * The message may be passed in chunks as it is received. Every chunk
+ * but the last is multiple of ESP_DET_CRYPT_BLOCK bytes.
+ *
+ * @param buf   The chunk to encrypt or decrypt in place.
+ * @param len   The chunk length.
+ * @param size  The number of bytes available at buf (room for padding).
+ * @param flags The ESP_DET_CRYPT_* flags.
+ *
+ * @return The number of bytes at buf after the operation.
+ */
+typedef uint16 (esp_det_crypt)(uint8_t *buf, uint16 len, uint16 size, uint8_t flags);
+
 /**
  * Start the detection procedure.
  *
@@ -137,6 +443,33 @@ esp_det_start(char *ap_pass,
               esp_det_enc_dec *decrypt,
               bool det_srv);
 
+/**
+ * Set in place encryption and decryption callbacks.
+ *
+ * When set they are used instead of the callbacks passed to esp_det_start.
+ * May be called before esp_det_start.
+ *
+ * @param encrypt The encryption callback or NULL.
+ * @param decrypt The decryption callback or NULL.
+ */
+void ICACHE_FLASH_ATTR
+esp_det_set_crypt(esp_det_crypt *encrypt, esp_det_crypt *decrypt);
+
+#if ESP_DET_CMD_CJSON
+/**
+ * Set cJSON allocator used by the user program.
+ *
+ * The library points cJSON at its arena while decoding a command and
+ * restores these (or cJSON defaults when not set) afterwards. They are
+ * also used when the arena is full.
+ *
+ * @param malloc_fn The malloc function or NULL.
+ * @param free_fn   The free function or NULL.
+ */
+void ICACHE_FLASH_ATTR
+esp_det_set_json_alloc(void *(*malloc_fn)(size_t size), void (*free_fn)(void *ptr));
+#endif
+
 /** Reset ESP detect library and start over. */
 void ICACHE_FLASH_ATTR
 esp_det_reset();
@@ -149,9 +482,64 @@ esp_det_reset();
 void ICACHE_FLASH_ATTR
 esp_det_get_srv(esp_det_srv *srv);
 
+/**
+ * Remove events from the trace ring buffer.
+ *
+ * Always returns 0 if library was built without ESP_DET_TRACE.
+ *
+ * @param evs The buffer to copy events to (oldest first).
+ * @param max The maximum number of events to copy.
+ *
+ * @return The number of events copied.
+ */
+uint16 ICACHE_FLASH_ATTR
+esp_det_trace_drain(esp_det_trace_ev *evs, uint16 max);
+
+/**
+ * Drain trace ring buffer and print it as Chrome trace event JSON.
+ *
+ * The output can be captured from UART and loaded in chrome://tracing.
+ */
+void ICACHE_FLASH_ATTR
+esp_det_trace_dump();
+
+/**
+ * Get library runtime statistics.
+ *
+ * The same statistics are returned by getStats command.
+ *
+ * @param stats The structure to fill.
+ */
+void ICACHE_FLASH_ATTR
+esp_det_get_stats(esp_det_stats *stats);
+
+#if ESP_DET_LOG_DEFER
+
+/**
+ * Store log record in the deferred log ring buffer.
+ *
+ * Use ESP_DET_DEBUG and ESP_DET_ERROR macros instead of calling it directly.
+ *
+ * @param fmt  The format string. Must stay valid till the record is printed.
+ * @param argc The number of arguments.
+ * @param ...  The arguments.
+ */
+void ICACHE_FLASH_ATTR
+esp_det_log(const char *fmt, uint8_t argc, ...);
+
+/** Schedule printing of deferred log records. */
+void ICACHE_FLASH_ATTR
+esp_det_log_flush();
+
+#endif
+
 /**
  * Return number of times device was started up.
  *
+ * The boot counter is kept in RTC memory and synced to flash every
+ * ESP_DET_CNT_SYNC boots. After power loss up to ESP_DET_CNT_SYNC - 1
+ * boots may be missing from the count.
+ *
  * @return Start count.
  */
 uint32_t ICACHE_FLASH_ATTR
@@ -0,0 +1,488 @@
+/*
+ * Copyright 2017 Rafal Zajac <rzajac@gmail.com>.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+
+// Host microbenchmarks of the library hot paths.
+//
+// Every benchmark runs BENCH_ROUNDS rounds of the same number of
+// operations, the number picked so one round takes at least BENCH_ROUND_NS.
+// Reported are the median and the fastest round in nanoseconds per
+// operation and the heap allocations and bytes per operation.
+//
+//   esp_det_bench [baseline]
+//
+// With baseline file the median is also compared to the one recorded
+// there. Host timings only show relative changes between two builds on
+// the same machine, not how fast the code runs on the device.
+
+#include "../src/esp_det.c"
+#include "test.h"
+#include <stdlib.h>
+#include <time.h>
+
+// The number of measured rounds.
+#define BENCH_ROUNDS 15
+// The minimum round duration in nanoseconds.
+#define BENCH_ROUND_NS 2000000
+// The maximum number of benchmarks in baseline file.
+#define BENCH_BASE_MAX 64
+
+// The benchmark.
+typedef struct {
+  const char *name;   // The name.
+  void (*setup)(void); // Prepare library state. Not measured.
+  void (*run)(void);   // Run one operation.
+} bench;
+
+// The benchmark result.
+typedef struct {
+  double med_ns;     // The median nanoseconds per operation.
+  double min_ns;     // The fastest round nanoseconds per operation.
+  double allocs;     // The allocations per operation.
+  double bytes;      // The bytes allocated per operation.
+} bench_res;
+
+// The command and response buffers.
+static uint8_t g_req[ESP_DET_CMD_REQ_MAX + 1];
+static uint8_t g_res[ESP_DET_RES_MAX + 1];
+static const char *g_cmd;
+static uint16 g_cmd_len;
+
+// The message encrypted and decrypted by crypt benchmarks.
+static const char g_msg[] = "{\"success\":true,\"code\":0,\"msg\":\"main server set\"}";
+static uint8_t g_cipher[ESP_DET_RES_MAX];
+
+// The response written by cmd_resp benchmarks.
+static det_resp g_resp;
+
+// The soft AP configurations compared by ap_config_equal benchmark.
+static struct softap_config g_ap1;
+static struct softap_config g_ap2;
+
+// Keeps results from being optimized away.
+static volatile uint32_t g_sink;
+
+static void done_cb(esp_det_err err) { g_sink += err; }
+
+/** XOR bytes with 0x5A. Stands in for esp_det_enc_dec cipher. */
+static uint16
+xor_cb(uint8_t *dst, const uint8_t *src, uint16 src_len)
+{
+  uint16 idx;
+
+  for (idx = 0; idx < src_len; idx++) dst[idx] = (uint8_t) (src[idx] ^ 0x5A);
+
+  return src_len;
+}
+
+/** XOR bytes with 0x5A in place. Stands in for esp_det_crypt cipher. */
+static uint16
+xor_crypt(uint8_t *buf, uint16 len, uint16 size, uint8_t flags)
+{
+  return xor_cb(buf, buf, len);
+}
+
+/**
+ * Boot the device to ESP_DET_ST_DM stage with erased flash.
+ *
+ * @param enc_dec The esp_det_enc_dec callback. May be NULL.
+ * @param crypt   The esp_det_crypt callback. May be NULL.
+ */
+static void
+boot(esp_det_enc_dec *enc_dec, esp_det_crypt *crypt)
+{
+  esp_det_srv_stop();
+  mock_reset();
+
+  g_cfg = NULL;
+  g_sta = NULL;
+  os_memset(&g_cfg_mem, 0, sizeof(g_cfg_mem));
+  os_memset(&g_sta_mem, 0, sizeof(g_sta_mem));
+  os_memset(g_ev, 0, sizeof(g_ev));
+  g_crypt_enc = NULL;
+  g_crypt_dec = NULL;
+
+  if (esp_det_start("password", 1, done_cb, NULL, enc_dec, enc_dec, true) != ESP_DET_OK) abort();
+  esp_det_set_crypt(crypt, crypt);
+  mock_run(0);
+}
+
+static void setup_plain() { boot(NULL, NULL); }
+
+static void setup_enc_dec() { boot(xor_cb, NULL); }
+
+static void setup_crypt() { boot(NULL, xor_crypt); }
+
+static void
+set_stage(esp_det_st stage)
+{
+  g_cfg->stage = stage;
+  g_sta->stage = stage;
+}
+
+// Commands.
+
+static void
+setup_cmd(const char *cmd, esp_det_st stage)
+{
+  setup_plain();
+  set_stage(stage);
+  g_cmd = cmd;
+  g_cmd_len = (uint16) strlen(cmd);
+}
+
+static void
+setup_set_ap_ok()
+{
+  setup_cmd("{\"cmd\":\"setAp\",\"name\":\"home\",\"pass\":\"secret123\"}", ESP_DET_ST_DM);
+}
+
+static void
+setup_set_ap_bad()
+{
+  setup_cmd("{\"cmd\":\"setAp\",\"name\":\"home\"}", ESP_DET_ST_DM);
+}
+
+static void
+setup_set_srv_ok()
+{
+  setup_cmd("{\"cmd\":\"setSrv\",\"ip\":\"192.168.1.2\",\"port\":1883,\"user\":\"bob\",\"pass\":\"pw\"}",
+            ESP_DET_ST_DS);
+}
+
+static void
+setup_set_srv_bad()
+{
+  setup_cmd("{\"cmd\":\"setSrv\",\"ip\":\"192.168.1.2\",\"port\":0,\"user\":\"bob\",\"pass\":\"pw\"}",
+            ESP_DET_ST_DS);
+}
+
+/** Handle the command. Successful commands change stage so it is set back. */
+static void
+run_cmd()
+{
+  esp_det_st stage = g_sta->stage;
+
+  os_memcpy(g_req, g_cmd, g_cmd_len);
+  g_sink += cmd_handle_cb(g_res, ESP_DET_RES_MAX, g_req, g_cmd_len);
+  set_stage(stage);
+}
+
+static void
+run_discovery()
+{
+  g_sta->nonce[0] = '\0';
+  cmd_discovery();
+  g_sink += g_sta->dis_len;
+}
+
+static void
+setup_resp()
+{
+  setup_plain();
+  g_resp = cmd_resp_tpl(true, "main server set", ESP_DET_OK);
+}
+
+static void run_resp_json() { g_sink += cmd_resp(g_res, ESP_DET_RES_MAX, &g_resp, false, 0); }
+
+static void run_resp_bin() { g_sink += cmd_resp(g_res, ESP_DET_RES_MAX, &g_resp, true, 0); }
+
+// Access point and configuration.
+
+static void
+setup_ap_equal()
+{
+  setup_plain();
+  os_memset(&g_ap1, 0, sizeof(g_ap1));
+  strcpy((char *) g_ap1.ssid, "IOT_5CCF7F010203");
+  strcpy((char *) g_ap1.password, "password");
+  g_ap1.channel = 1;
+  g_ap1.max_connection = 1;
+  g_ap2 = g_ap1;
+}
+
+static void run_ap_equal() { g_sink += ap_config_equal(&g_ap1, &g_ap2); }
+
+static void run_create_ap() { g_sink += create_ap(); }
+
+static void run_load_config() { g_sink += load_config(); }
+
+static void
+run_set_stage()
+{
+  g_sink += cfg_set_stage(g_sta->stage == ESP_DET_ST_DM ? ESP_DET_ST_CN : ESP_DET_ST_DM);
+}
+
+// Encryption.
+
+static void
+run_encrypt()
+{
+  os_memcpy(g_res, g_msg, sizeof(g_msg) - 1);
+  g_sink += encrypt(g_res, sizeof(g_msg) - 1, ESP_DET_RES_MAX);
+}
+
+/** Decrypt from the cipher buffer the way commands are received. */
+static void
+run_decrypt()
+{
+  det_rx rx;
+
+  if (has_decrypt_cb()) {
+    rx_begin(&rx, g_req, sizeof(g_req));
+    rx_feed(&rx, g_cipher, sizeof(g_msg) - 1);
+  } else {
+    // Decrypted in place, the connection buffer holds the command.
+    os_memcpy(g_req, g_cipher, sizeof(g_msg) - 1);
+    rx_begin(&rx, g_req, sizeof(g_req));
+    rx_feed(&rx, g_req, sizeof(g_msg) - 1);
+  }
+  g_sink += rx_end(&rx);
+}
+
+// Event dispatch.
+
+// The esp_eb event bus model. Handlers are attached by name to a list
+// and every trigger compares the event name with all of them, the way
+// library events were dispatched before the det_ev handler table.
+typedef struct eb_model_node {
+  const char *name;            // The event name.
+  det_ev_cb *cb;               // The event handler.
+  void *arg;                   // The event argument.
+  os_timer_t timer;            // The delayed trigger timer.
+  struct eb_model_node *next;  // The next attached handler.
+} eb_model_node;
+
+static eb_model_node g_eb_nodes[ESP_DET_EV_CNT];
+static eb_model_node *g_eb_head;
+
+static void eb_model_noop(void *arg) {}
+
+static void
+eb_model_attach(eb_model_node *node, const char *name, det_ev_cb *cb)
+{
+  eb_model_node **tail = &g_eb_head;
+
+  while (*tail != NULL) tail = &(*tail)->next;
+  node->name = name;
+  node->cb = cb;
+  node->next = NULL;
+  *tail = node;
+}
+
+static void ICACHE_FLASH_ATTR
+eb_model_timer_cb(void *arg)
+{
+  eb_model_node *node = arg;
+  node->cb(node->arg);
+}
+
+static void ICACHE_FLASH_ATTR
+eb_model_trigger_delayed(const char *name, uint32_t delay, void *arg)
+{
+  eb_model_node *node;
+
+  for (node = g_eb_head; node != NULL; node = node->next) {
+    if (os_strcmp(node->name, name) != 0) continue;
+    os_timer_disarm(&node->timer);
+    os_timer_setfn(&node->timer, (os_timer_func_t *) eb_model_timer_cb, node);
+    node->arg = arg;
+    os_timer_arm(&node->timer, delay, false);
+  }
+}
+
+/** Attach handlers in the order the library attached them to esp_eb. */
+static void
+setup_eb_model()
+{
+  setup_plain();
+  g_eb_head = NULL;
+  eb_model_attach(&g_eb_nodes[0], "espDetMain", eb_model_noop);
+  eb_model_attach(&g_eb_nodes[1], "espDetGotIp", eb_model_noop);
+  eb_model_attach(&g_eb_nodes[2], "espDetDisc", eb_model_noop);
+  eb_model_attach(&g_eb_nodes[3], "espDetUser", call_user_e_cb);
+  eb_model_attach(&g_eb_nodes[4], "espDetDiscSrv", eb_model_noop);
+}
+
+static void
+run_ev_table()
+{
+  ev_trigger(ESP_DET_EV_USER, NULL);
+  mock_timer_fire(&g_ev[ESP_DET_EV_USER].timer);
+}
+
+static void
+run_ev_eb_model()
+{
+  eb_model_trigger_delayed("espDetUser", 0, NULL);
+  mock_timer_fire(&g_eb_nodes[3].timer);
+}
+
+// Keep out of line copies of the dispatchers so nm reports their size.
+void *const bench_dispatch_fns[] = {
+  (void *) ev_trigger_delayed,
+  (void *) ev_timer_cb,
+  (void *) eb_model_trigger_delayed,
+  (void *) eb_model_timer_cb,
+};
+
+static const bench g_benches[] = {
+  {"cmd_set_ap_ok",       setup_set_ap_ok,  run_cmd},
+  {"cmd_set_ap_bad",      setup_set_ap_bad, run_cmd},
+  {"cmd_set_srv_ok",      setup_set_srv_ok, run_cmd},
+  {"cmd_set_srv_bad",     setup_set_srv_bad, run_cmd},
+  {"cmd_discovery",       setup_plain,      run_discovery},
+  {"cmd_resp_json",       setup_resp,       run_resp_json},
+  {"cmd_resp_bin",        setup_resp,       run_resp_bin},
+  {"ap_config_equal",     setup_ap_equal,   run_ap_equal},
+  {"create_ap",           setup_plain,      run_create_ap},
+  {"load_config",         setup_plain,      run_load_config},
+  {"cfg_set_stage",       setup_plain,      run_set_stage},
+  {"encrypt_none",        setup_plain,      run_encrypt},
+  {"encrypt_enc_dec",     setup_enc_dec,    run_encrypt},
+  {"encrypt_crypt",       setup_crypt,      run_encrypt},
+  {"decrypt_none",        setup_plain,      run_decrypt},
+  {"decrypt_enc_dec",     setup_enc_dec,    run_decrypt},
+  {"decrypt_crypt",       setup_crypt,      run_decrypt},
+  {"ev_dispatch_table",   setup_plain,      run_ev_table},
+  {"ev_dispatch_eb_model", setup_eb_model,  run_ev_eb_model},
+};
+
+static uint64_t
+now_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+static uint64_t
+run_round(const bench *b, uint32_t iters)
+{
+  uint32_t idx;
+  uint64_t start = now_ns();
+
+  for (idx = 0; idx < iters; idx++) b->run();
+
+  return now_ns() - start;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+  double da = *(const double *) a;
+  double db = *(const double *) b;
+
+  return (da > db) - (da < db);
+}
+
+/**
+ * Run the benchmark.
+ *
+ * @param b   The benchmark.
+ * @param res The result.
+ */
+static void
+bench_run(const bench *b, bench_res *res)
+{
+  uint8_t round;
+  uint32_t iters = 1;
+  double ns[BENCH_ROUNDS];
+
+  b->setup();
+  os_memcpy(g_cipher, g_msg, sizeof(g_msg) - 1);
+  xor_cb(g_cipher, g_cipher, sizeof(g_msg) - 1);
+
+  // Warm up and pick the number of operations per round.
+  while (run_round(b, iters) < BENCH_ROUND_NS && iters < (1u << 24)) iters *= 2;
+
+  mock_allocs = 0;
+  mock_alloc_bytes = 0;
+  for (round = 0; round < BENCH_ROUNDS; round++) {
+    ns[round] = (double) run_round(b, iters) / iters;
+  }
+
+  qsort(ns, BENCH_ROUNDS, sizeof(double), cmp_double);
+  res->med_ns = ns[BENCH_ROUNDS / 2];
+  res->min_ns = ns[0];
+  res->allocs = (double) mock_allocs / ((double) iters * BENCH_ROUNDS);
+  res->bytes = (double) mock_alloc_bytes / ((double) iters * BENCH_ROUNDS);
+}
+
+// The baseline medians.
+static char g_base_name[BENCH_BASE_MAX][32];
+static double g_base_ns[BENCH_BASE_MAX];
+static uint8_t g_base_cnt;
+
+/** Load the baseline written by earlier run. Returns false on error. */
+static bool
+base_load(const char *path)
+{
+  char line[160];
+  FILE *file = fopen(path, "r");
+
+  if (file == NULL) return false;
+
+  while (g_base_cnt < BENCH_BASE_MAX && fgets(line, sizeof(line), file) != NULL) {
+    if (line[0] == '#') continue;
+    if (sscanf(line, "%31s %lf", g_base_name[g_base_cnt], &g_base_ns[g_base_cnt]) == 2) g_base_cnt++;
+  }
+  fclose(file);
+
+  return true;
+}
+
+/** Returns the baseline median or 0 if the benchmark is not there. */
+static double
+base_find(const char *name)
+{
+  uint8_t idx;
+
+  for (idx = 0; idx < g_base_cnt; idx++) {
+    if (strcmp(g_base_name[idx], name) == 0) return g_base_ns[idx];
+  }
+
+  return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+  uint8_t idx;
+  bench_res res;
+
+  if (argc > 1 && !base_load(argv[1])) {
+    fprintf(stderr, "Can not read baseline %s\n", argv[1]);
+    return 1;
+  }
+
+  printf("# %-22s %10s %10s %10s %10s%s\n", "name", "med_ns", "min_ns", "allocs", "bytes",
+         g_base_cnt ? "    base_ns   change" : "");
+
+  for (idx = 0; idx < sizeof(g_benches) / sizeof(g_benches[0]); idx++) {
+    const bench *b = &g_benches[idx];
+
+    bench_run(b, &res);
+    printf("%-24s %10.1f %10.1f %10.2f %10.1f", b->name, res.med_ns, res.min_ns, res.allocs, res.bytes);
+
+    double base = base_find(b->name);
+    if (base > 0) printf(" %10.1f %+7.1f%%", base, (res.med_ns - base) * 100 / base);
+    printf("\n");
+  }
+
+  return 0;
+}
@@ -0,0 +1,688 @@
+/*
+ * Copyright 2017 Rafal Zajac <rzajac@gmail.com>.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+// The mocked SDK functions the library calls.
+
+#include <esp_det.h>
+#include <espconn.h>
+#include <mem.h>
+#include <stdlib.h>
+#include "test.h"
+
+// The maximum number of timers the virtual clock tracks.
+#define MOCK_TIMERS_MAX 64
+
+// The emulated station states.
+typedef enum {
+  MOCK_STA_IDLE,       // Not connected.
+  MOCK_STA_CONNECTING, // Looking for access point and associating.
+  MOCK_STA_ASSOC,      // Associated, waiting for IP.
+  MOCK_STA_GOT_IP,     // Connected.
+  MOCK_STA_LEAVING,    // Disconnect requested.
+} mock_sta_st;
+
+int test_failed;
+
+mock_ap_cfg mock_ap;
+uint8_t mock_flash[MOCK_FLASH_SIZE];
+uint8_t mock_rtc[MOCK_RTC_SIZE];
+uint32_t mock_erases;
+uint8_t mock_sent[MOCK_SENT_SIZE];
+uint16 mock_sent_len;
+uint32_t mock_sends;
+uint32 mock_sent_ip;
+int mock_holds;
+uint32_t mock_disconnects;
+uint32_t mock_cfg_writes;
+uint32_t mock_allocs;
+uint32_t mock_alloc_bytes;
+uint8 mock_opmode;
+struct softap_config mock_softap;
+struct station_config mock_station;
+struct espconn *mock_tcp_srv;
+struct espconn *mock_udp;
+
+// The virtual time in microseconds.
+static uint64_t g_now;
+// The timers ever armed. Disarmed timers stay on the list.
+static os_timer_t *g_timers[MOCK_TIMERS_MAX];
+static uint8_t g_timer_cnt;
+static uint32 g_timer_seq;
+
+// The random generator state.
+static uint32_t g_rnd;
+
+// The WiFi event handler.
+static wifi_event_handler_cb_t g_wifi_cb;
+// The emulated station.
+static mock_sta_st g_sta_st;
+static os_timer_t g_sta_timer;
+static bool g_dhcpc;
+static struct ip_info g_sta_ip;
+
+// The esp_cfg configurations.
+static void *g_cfg_ptr[4];
+static uint16_t g_cfg_size[4];
+
+// The remote address of received UDP datagram.
+static remot_info g_remote;
+
+void
+mock_reboot()
+{
+  g_timer_cnt = 0;
+  g_wifi_cb = NULL;
+  g_sta_st = MOCK_STA_IDLE;
+  g_dhcpc = true;
+  os_memset(&g_sta_ip, 0, sizeof(g_sta_ip));
+  os_memset(g_cfg_ptr, 0, sizeof(g_cfg_ptr));
+  mock_erases = 0;
+  mock_sent_len = 0;
+  mock_sends = 0;
+  mock_sent_ip = 0;
+  mock_holds = 0;
+  mock_disconnects = 0;
+  mock_cfg_writes = 0;
+  mock_allocs = 0;
+  mock_alloc_bytes = 0;
+  mock_opmode = STATION_MODE;
+  mock_tcp_srv = NULL;
+  mock_udp = NULL;
+}
+
+void
+mock_reset()
+{
+  mock_reboot();
+  g_now = 0;
+  g_rnd = 2463534242u;
+  os_memset(mock_flash, 0xFF, sizeof(mock_flash));
+  os_memset(mock_rtc, 0, sizeof(mock_rtc));
+  os_memset(&mock_ap, 0, sizeof(mock_ap));
+  os_memset(&mock_softap, 0, sizeof(mock_softap));
+  os_memset(&mock_station, 0, sizeof(mock_station));
+}
+
+// Timers.
+
+bool
+mock_timer_fire(os_timer_t *timer)
+{
+  if (!timer->armed) return false;
+
+  timer->armed = false;
+  timer->fn(timer->arg);
+
+  return true;
+}
+
+void
+mock_run(uint32 ms)
+{
+  uint8_t idx;
+  uint64_t end = g_now + (uint64_t) ms * 1000;
+
+  while (true) {
+    os_timer_t *next = NULL;
+
+    for (idx = 0; idx < g_timer_cnt; idx++) {
+      os_timer_t *t = g_timers[idx];
+      if (!t->armed || t->due > end) continue;
+      if (next == NULL || t->due < next->due || (t->due == next->due && t->seq < next->seq)) next = t;
+    }
+    if (next == NULL) break;
+
+    g_now = next->due;
+    if (next->repeat && next->ms > 0) {
+      next->due += (uint64_t) next->ms * 1000;
+    } else {
+      next->armed = false;
+    }
+    next->fn(next->arg);
+  }
+
+  g_now = end;
+}
+
+uint64_t mock_now_ms() { return g_now / 1000; }
+
+void
+os_timer_arm(os_timer_t *timer, uint32 ms, bool repeat)
+{
+  uint8_t idx;
+
+  for (idx = 0; idx < g_timer_cnt && g_timers[idx] != timer; idx++);
+  if (idx == g_timer_cnt) {
+    if (g_timer_cnt == MOCK_TIMERS_MAX) abort();
+    g_timers[g_timer_cnt++] = timer;
+  }
+
+  timer->ms = ms;
+  timer->repeat = repeat;
+  timer->due = g_now + (uint64_t) ms * 1000;
+  timer->seq = ++g_timer_seq;
+  timer->armed = true;
+}
+
+void os_timer_disarm(os_timer_t *timer) { timer->armed = false; }
+
+void os_timer_setfn(os_timer_t *timer, os_timer_func_t *fn, void *arg)
+{
+  timer->fn = fn;
+  timer->arg = arg;
+}
+
+// Heap.
+
+void *
+mock_malloc(size_t size)
+{
+  mock_allocs++;
+  mock_alloc_bytes += (uint32_t) size;
+  return malloc(size);
+}
+
+void *
+mock_zalloc(size_t size)
+{
+  mock_allocs++;
+  mock_alloc_bytes += (uint32_t) size;
+  return calloc(1, size);
+}
+
+void mock_free(void *ptr) { free(ptr); }
+
+// Utilities.
+
+size_t
+strlcpy(char *dst, const char *src, size_t size)
+{
+  size_t len = strlen(src);
+
+  if (size > 0) {
+    size_t n = len < size - 1 ? len : size - 1;
+    memcpy(dst, src, n);
+    dst[n] = '\0';
+  }
+
+  return len;
+}
+
+unsigned long
+os_random(void)
+{
+  g_rnd ^= g_rnd << 13;
+  g_rnd ^= g_rnd >> 17;
+  g_rnd ^= g_rnd << 5;
+
+  return g_rnd;
+}
+
+void ets_intr_lock(void) {}
+void ets_intr_unlock(void) {}
+
+uint32
+ipaddr_addr(const char *cp)
+{
+  unsigned int a, b, c, d;
+  char end;
+
+  if (sscanf(cp, "%u.%u.%u.%u%c", &a, &b, &c, &d, &end) != 4) return IPADDR_NONE;
+  if (a > 255 || b > 255 || c > 255 || d > 255) return IPADDR_NONE;
+
+  return a | (b << 8) | (c << 16) | (d << 24);
+}
+
+// Flash.
+
+uint32 spi_flash_get_id(void) { return 0x1640E0; }
+
+SpiFlashOpResult
+spi_flash_erase_sector(uint16 sec)
+{
+  if ((uint32) (sec + 1) * SPI_FLASH_SEC_SIZE > MOCK_FLASH_SIZE) return SPI_FLASH_RESULT_ERR;
+
+  os_memset(&mock_flash[sec * SPI_FLASH_SEC_SIZE], 0xFF, SPI_FLASH_SEC_SIZE);
+  mock_erases++;
+
+  return SPI_FLASH_RESULT_OK;
+}
+
+SpiFlashOpResult
+spi_flash_write(uint32 des_addr, uint32 *src, uint32 size)
+{
+  uint32 idx;
+
+  if ((des_addr & 3) || (size & 3) || des_addr + size > MOCK_FLASH_SIZE) return SPI_FLASH_RESULT_ERR;
+  for (idx = 0; idx < size; idx++) mock_flash[des_addr + idx] &= ((uint8_t *) src)[idx];
+
+  return SPI_FLASH_RESULT_OK;
+}
+
+SpiFlashOpResult
+spi_flash_read(uint32 src_addr, uint32 *des, uint32 size)
+{
+  if ((src_addr & 3) || src_addr + size > MOCK_FLASH_SIZE) return SPI_FLASH_RESULT_ERR;
+  os_memcpy(des, &mock_flash[src_addr], size);
+
+  return SPI_FLASH_RESULT_OK;
+}
+
+// Every esp_cfg index is kept in its own flash sector.
+
+esp_cfg_err
+esp_cfg_init(uint8_t num, void *config, uint16_t size)
+{
+  if (num >= 4 || size > SPI_FLASH_SEC_SIZE) return ESP_CFG_ERR_MEM;
+
+  g_cfg_ptr[num] = config;
+  g_cfg_size[num] = size;
+
+  return ESP_CFG_OK;
+}
+
+esp_cfg_err
+esp_cfg_read(uint8_t num)
+{
+  if (num >= 4 || g_cfg_ptr[num] == NULL) return ESP_CFG_ERR_MEM;
+  os_memcpy(g_cfg_ptr[num], &mock_flash[(ESP_CFG_START_SECTOR + num) * SPI_FLASH_SEC_SIZE], g_cfg_size[num]);
+
+  return ESP_CFG_OK;
+}
+
+esp_cfg_err
+esp_cfg_write(uint8_t num)
+{
+  uint32_t buf[SPI_FLASH_SEC_SIZE / 4];
+
+  if (num >= 4 || g_cfg_ptr[num] == NULL) return ESP_CFG_ERR_MEM;
+
+  mock_cfg_writes++;
+  os_memset(buf, 0xFF, sizeof(buf));
+  os_memcpy(buf, g_cfg_ptr[num], g_cfg_size[num]);
+  if (spi_flash_erase_sector(ESP_CFG_START_SECTOR + num) != SPI_FLASH_RESULT_OK) return ESP_CFG_ERR_FLASH;
+  if (spi_flash_write((ESP_CFG_START_SECTOR + num) * SPI_FLASH_SEC_SIZE, buf,
+                      (g_cfg_size[num] + 3) & ~3) != SPI_FLASH_RESULT_OK) return ESP_CFG_ERR_FLASH;
+
+  return ESP_CFG_OK;
+}
+
+// System.
+
+uint32 system_get_time(void) { return (uint32) g_now; }
+uint32 system_get_chip_id(void) { return 0x123456; }
+uint32 system_get_free_heap_size(void) { return 40000; }
+
+bool
+system_rtc_mem_read(uint8 des_addr, void *dst, uint16 save_size)
+{
+  if (des_addr < 64 || des_addr * 4 + save_size > MOCK_RTC_SIZE) return false;
+  os_memcpy(dst, &mock_rtc[des_addr * 4], save_size);
+  return true;
+}
+
+bool
+system_rtc_mem_write(uint8 des_addr, const void *src, uint16 save_size)
+{
+  if (des_addr < 64 || des_addr * 4 + save_size > MOCK_RTC_SIZE) return false;
+  os_memcpy(&mock_rtc[des_addr * 4], src, save_size);
+  return true;
+}
+
+// WiFi.
+
+/** Deliver WiFi event to the handler. */
+static void
+wifi_event(uint32 event, uint8 reason)
+{
+  System_Event_t ev;
+
+  os_memset(&ev, 0, sizeof(ev));
+  ev.event = event;
+
+  if (event == EVENT_STAMODE_CONNECTED) {
+    os_memcpy(ev.event_info.connected.bssid, mock_ap.bssid, 6);
+    ev.event_info.connected.channel = mock_ap.ch;
+  } else if (event == EVENT_STAMODE_DISCONNECTED) {
+    ev.event_info.disconnected.reason = reason;
+  } else if (event == EVENT_STAMODE_GOT_IP) {
+    bool dhcp = g_dhcpc || g_sta_ip.ip.addr == 0;
+    ev.event_info.got_ip.ip.addr = dhcp ? mock_ap.ip : g_sta_ip.ip.addr;
+    ev.event_info.got_ip.mask.addr = dhcp ? mock_ap.netmask : g_sta_ip.netmask.addr;
+    ev.event_info.got_ip.gw.addr = dhcp ? mock_ap.gw : g_sta_ip.gw.addr;
+  }
+
+  if (g_wifi_cb != NULL) g_wifi_cb(&ev);
+}
+
+/** Returns true if the station configuration matches the access point. */
+static bool
+sta_match()
+{
+  if (!mock_ap.up) return false;
+  if (os_strncmp((char *) mock_station.ssid, mock_ap.ssid, 32) != 0) return false;
+  if (mock_station.bssid_set && os_memcmp(mock_station.bssid, mock_ap.bssid, 6) != 0) return false;
+
+  return true;
+}
+
+/** Move the emulated station to the next state. */
+static void
+sta_step_cb(void *arg)
+{
+  switch (g_sta_st) {
+    case MOCK_STA_CONNECTING:
+      if (!sta_match()) {
+        g_sta_st = MOCK_STA_IDLE;
+        wifi_event(EVENT_STAMODE_DISCONNECTED, 201); // NO_AP_FOUND
+        return;
+      }
+      if (os_strncmp((char *) mock_station.password, mock_ap.pass, 64) != 0) {
+        g_sta_st = MOCK_STA_IDLE;
+        wifi_event(EVENT_STAMODE_DISCONNECTED, 15); // 4WAY_HANDSHAKE_TIMEOUT
+        return;
+      }
+      g_sta_st = MOCK_STA_ASSOC;
+      wifi_event(EVENT_STAMODE_CONNECTED, 0);
+      // Static address is there right after association.
+      os_timer_arm(&g_sta_timer, !g_dhcpc && g_sta_ip.ip.addr != 0 ? 0 : mock_ap.dhcp_ms, false);
+      break;
+
+    case MOCK_STA_ASSOC:
+      g_sta_st = MOCK_STA_GOT_IP;
+      wifi_event(EVENT_STAMODE_GOT_IP, 0);
+      break;
+
+    case MOCK_STA_LEAVING:
+      g_sta_st = MOCK_STA_IDLE;
+      wifi_event(EVENT_STAMODE_DISCONNECTED, 8); // ASSOC_LEAVE
+      break;
+
+    default:
+      break;
+  }
+}
+
+void
+mock_ap_down()
+{
+  mock_ap.up = false;
+  if (g_sta_st != MOCK_STA_ASSOC && g_sta_st != MOCK_STA_GOT_IP) return;
+
+  os_timer_disarm(&g_sta_timer);
+  g_sta_st = MOCK_STA_IDLE;
+  wifi_event(EVENT_STAMODE_DISCONNECTED, 200); // BEACON_TIMEOUT
+}
+
+void wifi_set_event_handler_cb(wifi_event_handler_cb_t cb) { g_wifi_cb = cb; }
+uint8 wifi_get_opmode(void) { return mock_opmode; }
+bool wifi_set_channel(uint8 channel) { return true; }
+bool wifi_softap_dhcps_stop(void) { return true; }
+bool wifi_station_set_reconnect_policy(bool set) { return true; }
+bool wifi_station_set_auto_connect(uint8 set) { return true; }
+enum dhcp_status wifi_station_dhcpc_status(void) { return g_dhcpc ? DHCP_STARTED : DHCP_STOPPED; }
+
+bool
+wifi_set_opmode_current(uint8 opmode)
+{
+  mock_opmode = opmode;
+  return true;
+}
+
+bool
+wifi_softap_get_config(struct softap_config *config)
+{
+  os_memcpy(config, &mock_softap, sizeof(struct softap_config));
+  return true;
+}
+
+bool
+wifi_softap_set_config(struct softap_config *config)
+{
+  os_memcpy(&mock_softap, config, sizeof(struct softap_config));
+  return true;
+}
+
+bool
+wifi_get_macaddr(uint8 if_index, uint8 *macaddr)
+{
+  uint8_t mac[6] = {0x5C, 0xCF, 0x7F, 0x01, 0x02, 0x03};
+  os_memcpy(macaddr, mac, sizeof(mac));
+  return true;
+}
+
+bool
+wifi_get_ip_info(uint8 if_index, struct ip_info *info)
+{
+  os_memset(info, 0, sizeof(struct ip_info));
+  if (if_index == STATION_IF) os_memcpy(info, &g_sta_ip, sizeof(struct ip_info));
+  return true;
+}
+
+bool
+wifi_set_ip_info(uint8 if_index, struct ip_info *info)
+{
+  if (if_index != STATION_IF) return true;
+
+  // The SDK refuses static address while DHCP client runs.
+  if (g_dhcpc) return false;
+  os_memcpy(&g_sta_ip, info, sizeof(struct ip_info));
+
+  return true;
+}
+
+bool
+wifi_station_get_config(struct station_config *config)
+{
+  os_memcpy(config, &mock_station, sizeof(struct station_config));
+  return true;
+}
+
+bool
+wifi_station_set_config(struct station_config *config)
+{
+  os_memcpy(&mock_station, config, sizeof(struct station_config));
+  return true;
+}
+
+bool
+wifi_station_set_config_current(struct station_config *config)
+{
+  os_memcpy(&mock_station, config, sizeof(struct station_config));
+  return true;
+}
+
+bool
+wifi_station_connect(void)
+{
+  if (g_sta_st != MOCK_STA_IDLE) return true;
+
+  g_sta_st = MOCK_STA_CONNECTING;
+  os_timer_setfn(&g_sta_timer, sta_step_cb, NULL);
+  os_timer_arm(&g_sta_timer, (mock_station.bssid_set ? 0 : mock_ap.scan_ms) + mock_ap.assoc_ms, false);
+
+  return true;
+}
+
+bool
+wifi_station_disconnect(void)
+{
+  if (g_sta_st == MOCK_STA_CONNECTING) {
+    os_timer_disarm(&g_sta_timer);
+    g_sta_st = MOCK_STA_IDLE;
+  } else if (g_sta_st == MOCK_STA_ASSOC || g_sta_st == MOCK_STA_GOT_IP) {
+    g_sta_st = MOCK_STA_LEAVING;
+    os_timer_setfn(&g_sta_timer, sta_step_cb, NULL);
+    os_timer_arm(&g_sta_timer, 0, false);
+  }
+
+  return true;
+}
+
+bool
+wifi_station_dhcpc_start(void)
+{
+  g_dhcpc = true;
+  return true;
+}
+
+bool
+wifi_station_dhcpc_stop(void)
+{
+  g_dhcpc = false;
+  return true;
+}
+
+// Network.
+
+sint8 espconn_regist_time(struct espconn *conn, uint32 interval, uint8 type_flag) { return ESPCONN_OK; }
+sint8 espconn_tcp_set_max_con_allow(struct espconn *conn, uint8 num) { return ESPCONN_OK; }
+sint8 espconn_recv_hold(struct espconn *conn) { mock_holds++; return ESPCONN_OK; }
+sint8 espconn_recv_unhold(struct espconn *conn) { mock_holds--; return ESPCONN_OK; }
+
+sint8
+espconn_create(struct espconn *conn)
+{
+  if (mock_udp != NULL) return ESPCONN_ISCONN;
+
+  mock_udp = conn;
+  return ESPCONN_OK;
+}
+
+sint8
+espconn_accept(struct espconn *conn)
+{
+  if (mock_tcp_srv != NULL) return ESPCONN_ISCONN;
+
+  mock_tcp_srv = conn;
+  return ESPCONN_OK;
+}
+
+sint8
+espconn_delete(struct espconn *conn)
+{
+  if (conn == mock_udp) mock_udp = NULL;
+  if (conn == mock_tcp_srv) mock_tcp_srv = NULL;
+
+  return ESPCONN_OK;
+}
+
+sint8
+espconn_regist_recvcb(struct espconn *conn, espconn_recv_callback cb)
+{
+  conn->recv_callback = cb;
+  return ESPCONN_OK;
+}
+
+sint8
+espconn_regist_sentcb(struct espconn *conn, espconn_sent_callback cb)
+{
+  conn->sent_callback = cb;
+  return ESPCONN_OK;
+}
+
+sint8
+espconn_regist_connectcb(struct espconn *conn, espconn_connect_callback cb)
+{
+  conn->proto.tcp->connect_callback = cb;
+  return ESPCONN_OK;
+}
+
+sint8
+espconn_regist_disconcb(struct espconn *conn, espconn_connect_callback cb)
+{
+  conn->proto.tcp->disconnect_callback = cb;
+  return ESPCONN_OK;
+}
+
+sint8
+espconn_regist_reconcb(struct espconn *conn, espconn_reconnect_callback cb)
+{
+  conn->proto.tcp->reconnect_callback = cb;
+  return ESPCONN_OK;
+}
+
+sint8
+espconn_get_connection_info(struct espconn *conn, remot_info **info, uint8 type_flags)
+{
+  if (conn != mock_udp) return ESPCONN_ARG;
+
+  *info = &g_remote;
+  return ESPCONN_OK;
+}
+
+sint8
+espconn_disconnect(struct espconn *conn)
+{
+  mock_disconnects++;
+  return ESPCONN_OK;
+}
+
+sint8
+espconn_send(struct espconn *conn, uint8 *data, uint16 len)
+{
+  if (len > MOCK_SENT_SIZE - mock_sent_len) return ESPCONN_MEM;
+
+  if (conn->type == ESPCONN_UDP) os_memcpy(&mock_sent_ip, conn->proto.udp->remote_ip, 4);
+  os_memcpy(mock_sent + mock_sent_len, data, len);
+  mock_sent_len += len;
+  mock_sends++;
+
+  return ESPCONN_OK;
+}
+
+bool
+mock_tcp_connect(struct espconn *conn, const char *ip, int port)
+{
+  uint32 addr = ipaddr_addr(ip);
+
+  if (mock_tcp_srv == NULL) return false;
+
+  conn->type = ESPCONN_TCP;
+  conn->state = ESPCONN_CONNECT;
+  os_memcpy(conn->proto.tcp->remote_ip, &addr, 4);
+  conn->proto.tcp->remote_port = port;
+  conn->proto.tcp->local_port = mock_tcp_srv->proto.tcp->local_port;
+  mock_tcp_srv->proto.tcp->connect_callback(conn);
+
+  return true;
+}
+
+void
+mock_tcp_recv(struct espconn *conn, const void *data, uint16 len)
+{
+  uint32_t acked = mock_sends;
+
+  conn->recv_callback(conn, (char *) data, len);
+  while (acked != mock_sends && conn->sent_callback != NULL) {
+    acked = mock_sends;
+    conn->sent_callback(conn);
+  }
+}
+
+bool
+mock_udp_recv(const char *ip, int port, const void *data, uint16 len)
+{
+  uint32 addr = ipaddr_addr(ip);
+
+  if (mock_udp == NULL || mock_udp->recv_callback == NULL) return false;
+
+  os_memcpy(g_remote.remote_ip, &addr, 4);
+  g_remote.remote_port = port;
+  mock_udp->recv_callback(mock_udp, (char *) data, len);
+
+  return true;
+}
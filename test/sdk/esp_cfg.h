@@ -0,0 +1,37 @@
+/*
+ * Copyright 2017 Rafal Zajac <rzajac@gmail.com>.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+// Host replacement of the esp-cfg library header.
+
+#ifndef ESP_CFG_H
+#define ESP_CFG_H
+
+#include <c_types.h>
+
+// The flash sector of the first configuration index. Every index
+// takes one sector.
+#define ESP_CFG_START_SECTOR 0xC
+
+typedef enum {
+  ESP_CFG_OK,
+  ESP_CFG_ERR_MEM,
+  ESP_CFG_ERR_FLASH,
+} esp_cfg_err;
+
+esp_cfg_err esp_cfg_init(uint8_t num, void *config, uint16_t size);
+esp_cfg_err esp_cfg_read(uint8_t num);
+esp_cfg_err esp_cfg_write(uint8_t num);
+
+#endif //ESP_CFG_H
@@ -0,0 +1,102 @@
+/*
+ * Copyright 2017 Rafal Zajac <rzajac@gmail.com>.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+// Host replacement of the NONOS SDK header. Only what the library uses.
+
+#ifndef ESPCONN_H
+#define ESPCONN_H
+
+#include <c_types.h>
+#include <ip_addr.h>
+
+enum espconn_type {
+  ESPCONN_INVALID = 0,
+  ESPCONN_TCP = 0x10,
+  ESPCONN_UDP = 0x20,
+};
+
+enum espconn_state {
+  ESPCONN_NONE,
+  ESPCONN_WAIT,
+  ESPCONN_LISTEN,
+  ESPCONN_CONNECT,
+  ESPCONN_WRITE,
+  ESPCONN_READ,
+  ESPCONN_CLOSE,
+};
+
+#define ESPCONN_OK 0
+#define ESPCONN_MEM -1
+#define ESPCONN_ARG -12
+#define ESPCONN_ISCONN -15
+
+typedef void (*espconn_connect_callback)(void *arg);
+typedef void (*espconn_reconnect_callback)(void *arg, sint8 err);
+typedef void (*espconn_recv_callback)(void *arg, char *pdata, unsigned short len);
+typedef void (*espconn_sent_callback)(void *arg);
+
+typedef struct _esp_tcp {
+  int remote_port;
+  int local_port;
+  uint8 local_ip[4];
+  uint8 remote_ip[4];
+  espconn_connect_callback connect_callback;
+  espconn_reconnect_callback reconnect_callback;
+  espconn_connect_callback disconnect_callback;
+} esp_tcp;
+
+typedef struct _esp_udp {
+  int remote_port;
+  int local_port;
+  uint8 local_ip[4];
+  uint8 remote_ip[4];
+} esp_udp;
+
+struct espconn {
+  enum espconn_type type;
+  enum espconn_state state;
+  union {
+    esp_tcp *tcp;
+    esp_udp *udp;
+  } proto;
+  espconn_recv_callback recv_callback;
+  espconn_sent_callback sent_callback;
+  uint8 link_cnt;
+  void *reverse;
+};
+
+typedef struct _remot_info {
+  enum espconn_state state;
+  int remote_port;
+  uint8 remote_ip[4];
+} remot_info;
+
+sint8 espconn_create(struct espconn *conn);
+sint8 espconn_delete(struct espconn *conn);
+sint8 espconn_send(struct espconn *conn, uint8 *data, uint16 len);
+sint8 espconn_accept(struct espconn *conn);
+sint8 espconn_disconnect(struct espconn *conn);
+sint8 espconn_regist_recvcb(struct espconn *conn, espconn_recv_callback cb);
+sint8 espconn_regist_sentcb(struct espconn *conn, espconn_sent_callback cb);
+sint8 espconn_regist_connectcb(struct espconn *conn, espconn_connect_callback cb);
+sint8 espconn_regist_disconcb(struct espconn *conn, espconn_connect_callback cb);
+sint8 espconn_regist_reconcb(struct espconn *conn, espconn_reconnect_callback cb);
+sint8 espconn_regist_time(struct espconn *conn, uint32 interval, uint8 type_flag);
+sint8 espconn_tcp_set_max_con_allow(struct espconn *conn, uint8 num);
+sint8 espconn_get_connection_info(struct espconn *conn, remot_info **info, uint8 type_flags);
+sint8 espconn_recv_hold(struct espconn *conn);
+sint8 espconn_recv_unhold(struct espconn *conn);
+
+#endif //ESPCONN_H
@@ -0,0 +1,42 @@
+/*
+ * Copyright 2017 Rafal Zajac <rzajac@gmail.com>.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+// Host replacement of the NONOS SDK header. Only what the library uses.
+
+#ifndef IP_ADDR_H
+#define IP_ADDR_H
+
+#include <c_types.h>
+
+struct ip_addr {
+  uint32 addr;
+};
+
+typedef struct ip_addr ip_addr_t;
+
+#define IP4_ADDR(ipaddr, a, b, c, d) \
+  ((ipaddr)->addr = ((uint32) (a)) | ((uint32) (b) << 8) | ((uint32) (c) << 16) | ((uint32) (d) << 24))
+#define ip4_addr1(i) (((uint8 *) (i))[0])
+#define ip4_addr2(i) (((uint8 *) (i))[1])
+#define ip4_addr3(i) (((uint8 *) (i))[2])
+#define ip4_addr4(i) (((uint8 *) (i))[3])
+#define IP2STR(ipaddr) ip4_addr1(ipaddr), ip4_addr2(ipaddr), ip4_addr3(ipaddr), ip4_addr4(ipaddr)
+#define IPSTR "%d.%d.%d.%d"
+#define IPADDR_NONE ((uint32) 0xFFFFFFFFUL)
+
+uint32 ipaddr_addr(const char *cp);
+
+#endif //IP_ADDR_H
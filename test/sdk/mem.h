@@ -0,0 +1,33 @@
+/*
+ * Copyright 2017 Rafal Zajac <rzajac@gmail.com>.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+// Host replacement of the NONOS SDK header. Only what the library uses.
+
+#ifndef MEM_H
+#define MEM_H
+
+#include <stddef.h>
+
+// The mocked allocator counts calls so tests can check for heap use.
+void *mock_malloc(size_t size);
+void *mock_zalloc(size_t size);
+void mock_free(void *ptr);
+
+#define os_malloc mock_malloc
+#define os_zalloc mock_zalloc
+#define os_free mock_free
+
+#endif //MEM_H
@@ -0,0 +1,66 @@
+/*
+ * Copyright 2017 Rafal Zajac <rzajac@gmail.com>.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+// Host replacement of the NONOS SDK header. Only what the library uses.
+
+#ifndef OSAPI_H
+#define OSAPI_H
+
+#include <c_types.h>
+#include <stdio.h>
+#include <stdarg.h>
+
+typedef void os_timer_func_t(void *arg);
+
+// The mocked timer fires when the virtual clock reaches its due time.
+typedef struct {
+  os_timer_func_t *fn; // The timer callback.
+  void *arg;           // The callback argument.
+  uint32 ms;           // The last armed delay.
+  bool armed;          // Is timer armed.
+  bool repeat;         // Is timer re-armed after it fires.
+  uint64_t due;        // The virtual time in microseconds the timer fires at.
+  uint32 seq;          // The arm order. Timers due at the same time fire in it.
+} os_timer_t;
+
+void os_timer_arm(os_timer_t *timer, uint32 ms, bool repeat);
+void os_timer_disarm(os_timer_t *timer);
+void os_timer_setfn(os_timer_t *timer, os_timer_func_t *fn, void *arg);
+
+#define os_printf printf
+#define os_sprintf sprintf
+#define os_memset memset
+#define os_memcpy memcpy
+#define os_memmove memmove
+#define os_memcmp memcmp
+#define os_strlen strlen
+#define os_strcmp strcmp
+#define os_strncmp strncmp
+#define os_strncpy strncpy
+
+void ets_intr_lock(void);
+void ets_intr_unlock(void);
+
+#define ETS_UART_INTR_DISABLE() ets_intr_lock()
+#define ETS_UART_INTR_ENABLE() ets_intr_unlock()
+
+size_t strlcpy(char *dst, const char *src, size_t size);
+unsigned long os_random(void);
+
+#define MAC2STR(a) (a)[0], (a)[1], (a)[2], (a)[3], (a)[4], (a)[5]
+#define MACSTR "%02x:%02x:%02x:%02x:%02x:%02x"
+
+#endif //OSAPI_H
@@ -0,0 +1,161 @@
+/*
+ * Copyright 2017 Rafal Zajac <rzajac@gmail.com>.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+// Host replacement of the NONOS SDK header. Only what the library uses.
+
+#ifndef USER_INTERFACE_H
+#define USER_INTERFACE_H
+
+#include <c_types.h>
+#include <ip_addr.h>
+#include <espconn.h>
+
+#define STATION_IF 0
+#define SOFTAP_IF 1
+
+#define NULL_MODE 0
+#define STATION_MODE 1
+#define SOFTAP_MODE 2
+#define STATIONAP_MODE 3
+
+#define SPI_FLASH_SEC_SIZE 4096
+
+typedef enum {
+  AUTH_OPEN,
+  AUTH_WEP,
+  AUTH_WPA_PSK,
+  AUTH_WPA2_PSK,
+} AUTH_MODE;
+
+struct softap_config {
+  uint8 ssid[32];
+  uint8 password[64];
+  uint8 ssid_len;
+  uint8 channel;
+  AUTH_MODE authmode;
+  uint8 ssid_hidden;
+  uint8 max_connection;
+  uint16 beacon_interval;
+};
+
+struct station_config {
+  uint8 ssid[32];
+  uint8 password[64];
+  uint8 bssid_set;
+  uint8 bssid[6];
+};
+
+struct ip_info {
+  struct ip_addr ip;
+  struct ip_addr netmask;
+  struct ip_addr gw;
+};
+
+enum {
+  EVENT_STAMODE_CONNECTED = 0,
+  EVENT_STAMODE_DISCONNECTED,
+  EVENT_STAMODE_AUTHMODE_CHANGE,
+  EVENT_STAMODE_GOT_IP,
+  EVENT_STAMODE_DHCP_TIMEOUT,
+  EVENT_SOFTAPMODE_STACONNECTED,
+  EVENT_SOFTAPMODE_STADISCONNECTED,
+  EVENT_SOFTAPMODE_PROBEREQRECVED,
+  EVENT_OPMODE_CHANGED,
+  EVENT_MAX,
+};
+
+typedef struct {
+  uint8 ssid[32];
+  uint8 ssid_len;
+  uint8 bssid[6];
+  uint8 channel;
+} Event_StaMode_Connected_t;
+
+typedef struct {
+  uint8 ssid[32];
+  uint8 ssid_len;
+  uint8 bssid[6];
+  uint8 reason;
+} Event_StaMode_Disconnected_t;
+
+typedef struct {
+  uint8 old_mode;
+  uint8 new_mode;
+} Event_StaMode_AuthMode_Change_t;
+
+typedef struct {
+  struct ip_addr ip;
+  struct ip_addr mask;
+  struct ip_addr gw;
+} Event_StaMode_Got_IP_t;
+
+typedef union {
+  Event_StaMode_Connected_t connected;
+  Event_StaMode_Disconnected_t disconnected;
+  Event_StaMode_AuthMode_Change_t auth_change;
+  Event_StaMode_Got_IP_t got_ip;
+} Event_Info_u;
+
+typedef struct _esp_event {
+  uint32 event;
+  Event_Info_u event_info;
+} System_Event_t;
+
+typedef void (*wifi_event_handler_cb_t)(System_Event_t *event);
+
+enum dhcp_status {
+  DHCP_STOPPED,
+  DHCP_STARTED,
+};
+
+typedef enum {
+  SPI_FLASH_RESULT_OK,
+  SPI_FLASH_RESULT_ERR,
+  SPI_FLASH_RESULT_TIMEOUT,
+} SpiFlashOpResult;
+
+void wifi_set_event_handler_cb(wifi_event_handler_cb_t cb);
+bool wifi_get_macaddr(uint8 if_index, uint8 *macaddr);
+uint8 wifi_get_opmode(void);
+bool wifi_set_opmode_current(uint8 opmode);
+bool wifi_set_channel(uint8 channel);
+bool wifi_softap_get_config(struct softap_config *config);
+bool wifi_softap_set_config(struct softap_config *config);
+bool wifi_softap_dhcps_stop(void);
+bool wifi_get_ip_info(uint8 if_index, struct ip_info *info);
+bool wifi_set_ip_info(uint8 if_index, struct ip_info *info);
+bool wifi_station_get_config(struct station_config *config);
+bool wifi_station_set_config(struct station_config *config);
+bool wifi_station_set_config_current(struct station_config *config);
+bool wifi_station_connect(void);
+bool wifi_station_disconnect(void);
+bool wifi_station_set_reconnect_policy(bool set);
+bool wifi_station_set_auto_connect(uint8 set);
+bool wifi_station_dhcpc_start(void);
+bool wifi_station_dhcpc_stop(void);
+enum dhcp_status wifi_station_dhcpc_status(void);
+
+uint32 system_get_time(void);
+uint32 system_get_chip_id(void);
+uint32 system_get_free_heap_size(void);
+bool system_rtc_mem_read(uint8 des_addr, void *dst, uint16 save_size);
+bool system_rtc_mem_write(uint8 des_addr, const void *src, uint16 save_size);
+
+uint32 spi_flash_get_id(void);
+SpiFlashOpResult spi_flash_erase_sector(uint16 sec);
+SpiFlashOpResult spi_flash_write(uint32 des_addr, uint32 *src, uint32 size);
+SpiFlashOpResult spi_flash_read(uint32 src_addr, uint32 *des, uint32 size);
+
+#endif //USER_INTERFACE_H
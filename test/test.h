@@ -0,0 +1,186 @@
+/*
+ * Copyright 2017 Rafal Zajac <rzajac@gmail.com>.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+// The host test helpers and the state of mocked SDK functions.
+//
+// The mocked SDK runs on a virtual clock. Timers fire only from mock_run
+// which advances the clock to every due timer in order, so a detection
+// cycle taking minutes on the device runs in microseconds and always
+// the same way.
+
+#ifndef ESP_DET_TEST_H
+#define ESP_DET_TEST_H
+
+#include <c_types.h>
+#include <osapi.h>
+#include <espconn.h>
+#include <user_interface.h>
+#include <stdio.h>
+
+// The number of failed checks.
+extern int test_failed;
+
+// Report failed check and continue.
+#define CHECK(cond) do { \
+  if (!(cond)) { \
+    test_failed++; \
+    printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+  } \
+} while (0)
+
+// Check two integers are equal.
+#define CHECK_INT(exp, act) do { \
+  long long e_ = (long long) (exp), a_ = (long long) (act); \
+  if (e_ != a_) { \
+    test_failed++; \
+    printf("%s:%d: %s: expected %lld got %lld\n", __FILE__, __LINE__, #act, e_, a_); \
+  } \
+} while (0)
+
+// Check NULL terminated string.
+#define CHECK_STR(exp, act) do { \
+  if (strcmp((exp), (const char *) (act)) != 0) { \
+    test_failed++; \
+    printf("%s:%d: %s: expected \"%s\" got \"%s\"\n", __FILE__, __LINE__, #act, (exp), (const char *) (act)); \
+  } \
+} while (0)
+
+// Check bytes.
+#define CHECK_MEM(exp, act, len) do { \
+  if (memcmp((exp), (act), (len)) != 0) { \
+    test_failed++; \
+    printf("%s:%d: %s: bytes differ\n", __FILE__, __LINE__, #act); \
+  } \
+} while (0)
+
+// Run test function.
+#define RUN(test) do { \
+  int failed_ = test_failed; \
+  test(); \
+  printf("%s %s\n", test_failed == failed_ ? "PASS" : "FAIL", #test); \
+} while (0)
+
+// The size of emulated flash. Covers esp_cfg and the journal sectors.
+#define MOCK_FLASH_SIZE (16 * SPI_FLASH_SEC_SIZE)
+// The size of mocked send log.
+#define MOCK_SENT_SIZE 4096
+// The size of RTC memory in bytes.
+#define MOCK_RTC_SIZE 768
+
+// The emulated access point.
+typedef struct {
+  bool up;          // Is access point up.
+  char ssid[33];    // The SSID.
+  char pass[65];    // The passphrase.
+  uint8 bssid[6];   // The BSSID.
+  uint8 ch;         // The channel.
+  uint32 ip;        // The address DHCP gives to the station.
+  uint32 netmask;   // The netmask.
+  uint32 gw;        // The gateway.
+  uint32 scan_ms;   // The time to find the access point when BSSID is not set.
+  uint32 assoc_ms;  // The time to associate.
+  uint32 dhcp_ms;   // The time to get address from DHCP.
+} mock_ap_cfg;
+
+// The emulated access point. Set up by tests, mock_reset makes it unreachable.
+extern mock_ap_cfg mock_ap;
+
+// The emulated flash. Writes can only clear bits like NOR flash does.
+extern uint8_t mock_flash[MOCK_FLASH_SIZE];
+// The emulated RTC memory.
+extern uint8_t mock_rtc[MOCK_RTC_SIZE];
+// The number of sector erases.
+extern uint32_t mock_erases;
+// The bytes passed to espconn_send.
+extern uint8_t mock_sent[MOCK_SENT_SIZE];
+// The number of bytes in mock_sent.
+extern uint16 mock_sent_len;
+// The number of espconn_send calls.
+extern uint32_t mock_sends;
+// The remote address of the last UDP espconn_send.
+extern uint32 mock_sent_ip;
+// The number of espconn_recv_hold calls not matched by espconn_recv_unhold.
+extern int mock_holds;
+// The number of espconn_disconnect calls.
+extern uint32_t mock_disconnects;
+// The number of esp_cfg_write calls.
+extern uint32_t mock_cfg_writes;
+// The number of os_malloc and os_zalloc calls.
+extern uint32_t mock_allocs;
+// The number of bytes requested from os_malloc and os_zalloc.
+extern uint32_t mock_alloc_bytes;
+// The current WiFi opmode.
+extern uint8 mock_opmode;
+// The soft access point configuration.
+extern struct softap_config mock_softap;
+// The station configuration.
+extern struct station_config mock_station;
+// The listening TCP connection. NULL if there is none.
+extern struct espconn *mock_tcp_srv;
+// The UDP connection. NULL if there is none.
+extern struct espconn *mock_udp;
+
+/** Reset mocked SDK state like after power loss. Flash is erased. */
+void mock_reset();
+
+/** Reset mocked SDK state like after reboot. Flash and RTC memory are kept. */
+void mock_reboot();
+
+/** Fire armed timer now. Returns false if timer was not armed. */
+bool mock_timer_fire(os_timer_t *timer);
+
+/** Advance the virtual clock by ms milliseconds firing due timers. */
+void mock_run(uint32 ms);
+
+/** Returns the virtual time in milliseconds. */
+uint64_t mock_now_ms();
+
+/** Make the access point unreachable. Connected station is disconnected. */
+void mock_ap_down();
+
+/**
+ * Connect TCP client to the listening connection.
+ *
+ * @param conn The client connection with proto.tcp set.
+ * @param ip   The client IP.
+ * @param port The client port.
+ *
+ * @return Returns false if nothing is listening.
+ */
+bool mock_tcp_connect(struct espconn *conn, const char *ip, int port);
+
+/**
+ * Receive data on TCP connection and confirm all responses it sends.
+ *
+ * @param conn The client connection.
+ * @param data The data.
+ * @param len  The data length.
+ */
+void mock_tcp_recv(struct espconn *conn, const void *data, uint16 len);
+
+/**
+ * Receive datagram on the UDP connection.
+ *
+ * @param ip   The sender IP.
+ * @param port The sender port.
+ * @param data The datagram.
+ * @param len  The datagram length.
+ *
+ * @return Returns false if UDP connection is not open.
+ */
+bool mock_udp_recv(const char *ip, int port, const void *data, uint16 len);
+
+#endif //ESP_DET_TEST_H
@@ -0,0 +1,476 @@
+/*
+ * Copyright 2017 Rafal Zajac <rzajac@gmail.com>.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+
+// Tests of command decoders, response writers and message receiving.
+
+#include "../src/esp_det.c"
+#include "test.h"
+
+// The test cipher XORs bytes with ESP_DET_TEST_KEY. The message is padded
+// to full blocks and the last byte is the number of padding bytes.
+#define ESP_DET_TEST_KEY 0x5A
+
+// The test_crypt calls.
+static uint8_t g_crypt_calls;
+// Set when test_crypt got chunk which is not whole blocks.
+static bool g_crypt_bad_chunk;
+
+/** Reset library state used by commands. */
+static void
+setup()
+{
+  g_cfg = &g_cfg_mem;
+  g_sta = &g_sta_mem;
+  os_memset(g_cfg, 0, sizeof(flash_cfg));
+  os_memset(g_sta, 0, sizeof(det_state));
+  g_crypt_enc = NULL;
+  g_crypt_dec = NULL;
+  g_crypt_calls = 0;
+  g_crypt_bad_chunk = false;
+}
+
+/** Encrypt message the way test_crypt decrypts it. Returns ciphertext length. */
+static uint16
+test_seal(uint8_t *dst, const char *msg)
+{
+  uint16 idx;
+  uint16 len = (uint16) strlen(msg);
+  uint8_t pad = (uint8_t) (ESP_DET_CRYPT_BLOCK - len % ESP_DET_CRYPT_BLOCK);
+
+  os_memcpy(dst, msg, len);
+  os_memset(dst + len, pad, pad);
+  for (idx = 0; idx < len + pad; idx++) dst[idx] ^= ESP_DET_TEST_KEY;
+
+  return (uint16) (len + pad);
+}
+
+/** The esp_det_crypt decryption callback. */
+static uint16
+test_crypt(uint8_t *buf, uint16 len, uint16 size, uint8_t flags)
+{
+  uint16 idx;
+
+  if (len % ESP_DET_CRYPT_BLOCK != 0) g_crypt_bad_chunk = true;
+  if (((flags & ESP_DET_CRYPT_FIRST) != 0) != (g_crypt_calls == 0)) g_crypt_bad_chunk = true;
+  g_crypt_calls++;
+
+  for (idx = 0; idx < len; idx++) buf[idx] ^= ESP_DET_TEST_KEY;
+  if ((flags & ESP_DET_CRYPT_LAST) && len > 0) len -= buf[len - 1];
+
+  return len;
+}
+
+/** The esp_det_enc_dec callback. Fails the test if buffers are shared. */
+static uint16
+test_enc_dec(uint8_t *dst, const uint8_t *src, uint16 src_len)
+{
+  uint16 idx;
+
+  CHECK(dst != src);
+  for (idx = 0; idx < src_len; idx++) dst[idx] = (uint8_t) (src[idx] ^ ESP_DET_TEST_KEY);
+
+  return src_len;
+}
+
+/** Decode JSON string. */
+static esp_det_err
+decode(det_cmd *cmd, const char *json)
+{
+  return cmd_decode(cmd, json, (uint16) strlen(json));
+}
+
+static void
+test_decode()
+{
+  det_cmd cmd;
+
+  CHECK_INT(ESP_DET_OK, decode(&cmd, " { \"cmd\" : \"setAp\", \"name\":\"my ap\",\n\"pass\":\"secret\" } "));
+  CHECK_INT(ESP_DET_CMD_ID_SET_AP, cmd.id);
+  CHECK_INT(ESP_DET_KEY_CMD | ESP_DET_KEY_NAME | ESP_DET_KEY_PASS, cmd.keys);
+  CHECK_STR("my ap", cmd.name);
+  CHECK_STR("secret", cmd.pass);
+
+  CHECK_INT(ESP_DET_OK, decode(&cmd, "{\"cmd\":\"setSrv\",\"ip\":\"10.0.0.2\",\"port\":8080,"
+                                     "\"user\":\"u\",\"pass\":\"p\"}"));
+  CHECK_INT(ESP_DET_CMD_ID_SET_SRV, cmd.id);
+  CHECK_STR("10.0.0.2", cmd.ip);
+  CHECK_INT(8080, cmd.port);
+
+  CHECK_INT(ESP_DET_OK, decode(&cmd, "{\"cmd\":\"reboot\"}"));
+  CHECK_INT(ESP_DET_CMD_ID_UNKNOWN, cmd.id);
+  CHECK_STR("reboot", cmd.cmd);
+}
+
+static void
+test_decode_skip()
+{
+  det_cmd cmd;
+
+  CHECK_INT(ESP_DET_OK, decode(&cmd, "{\"x\":{\"cmd\":\"setAp\",\"a\":[1,-2.5e3,true,false,null,{}]},"
+                                     "\"port\":\"80\",\"name\":7,\"cmd\":\"getStats\"}"));
+  CHECK_INT(ESP_DET_CMD_ID_GET_STATS, cmd.id);
+  CHECK_INT(ESP_DET_KEY_CMD, cmd.keys);
+  CHECK_INT(0, cmd.port);
+  CHECK_STR("", cmd.name);
+}
+
+static void
+test_decode_escapes()
+{
+  det_cmd cmd;
+
+  CHECK_INT(ESP_DET_OK, decode(&cmd, "{\"cmd\":\"setAp\",\"name\":\"a\\\"b\\\\c\\/d\\u0041\\t\"}"));
+  CHECK_STR("a\"b\\c/dA\t", cmd.name);
+
+  // Code points above ASCII are encoded as UTF-8.
+  CHECK_INT(ESP_DET_OK, decode(&cmd, "{\"cmd\":\"setAp\",\"name\":\"\\u00e9\\u20AC\\ud83d\\ude00\"}"));
+  CHECK_STR("\xC3\xA9\xE2\x82\xAC\xF0\x9F\x98\x80", cmd.name);
+
+  // Surrogates must come in pairs.
+  CHECK_INT(ESP_DET_ERR_CMD_BAD_JSON, decode(&cmd, "{\"cmd\":\"setAp\",\"name\":\"\\ud83d\"}"));
+  CHECK_INT(ESP_DET_ERR_CMD_BAD_JSON, decode(&cmd, "{\"cmd\":\"setAp\",\"name\":\"\\ud83d\\u0041\"}"));
+  CHECK_INT(ESP_DET_ERR_CMD_BAD_JSON, decode(&cmd, "{\"cmd\":\"setAp\",\"name\":\"\\ude00\"}"));
+  CHECK_INT(ESP_DET_ERR_CMD_BAD_JSON, decode(&cmd, "{\"cmd\":\"setAp\",\"name\":\"\\u0000\"}"));
+  CHECK_INT(ESP_DET_ERR_CMD_BAD_JSON, decode(&cmd, "{\"cmd\":\"setAp\",\"name\":\"\\u00"));
+}
+
+static void
+test_decode_malformed()
+{
+  det_cmd cmd;
+
+  CHECK_INT(ESP_DET_ERR_CMD_BAD_JSON, decode(&cmd, ""));
+  CHECK_INT(ESP_DET_ERR_CMD_BAD_JSON, decode(&cmd, "[]"));
+  CHECK_INT(ESP_DET_ERR_CMD_BAD_JSON, decode(&cmd, "{\"cmd\":\"setAp\""));
+  CHECK_INT(ESP_DET_ERR_CMD_BAD_JSON, decode(&cmd, "{\"cmd\" \"setAp\"}"));
+  CHECK_INT(ESP_DET_ERR_CMD_BAD_JSON, decode(&cmd, "{\"cmd\":\"setAp\";}"));
+  CHECK_INT(ESP_DET_ERR_CMD_BAD_JSON, decode(&cmd, "{\"x\":[1,}"));
+  CHECK_INT(ESP_DET_ERR_CMD_BAD_JSON, decode(&cmd, "{\"x\":tru}"));
+  CHECK_INT(ESP_DET_ERR_CMD_BAD_FORMAT, decode(&cmd, "{}"));
+  CHECK_INT(ESP_DET_ERR_CMD_BAD_FORMAT, decode(&cmd, "{\"name\":\"ap\"}"));
+}
+
+static void
+test_decode_limits()
+{
+  det_cmd cmd;
+  char json[160];
+  char name[ESP_DET_STA_NAME_MAX + 1];
+  char pass[ESP_DET_STA_PASS_MAX + 1];
+
+  // The longest SSID and passphrase fit.
+  os_memset(name, 'n', sizeof(name));
+  os_memset(pass, 'p', sizeof(pass));
+  name[ESP_DET_STA_NAME_MAX - 1] = '\0';
+  pass[ESP_DET_STA_PASS_MAX - 1] = '\0';
+  sprintf(json, "{\"cmd\":\"setAp\",\"name\":\"%s\",\"pass\":\"%s\"}", name, pass);
+  CHECK_INT(ESP_DET_OK, decode(&cmd, json));
+  CHECK_INT(32, strlen(cmd.name));
+  CHECK_INT(64, strlen(cmd.pass));
+
+  // One more byte is rejected, never truncated.
+  name[ESP_DET_STA_NAME_MAX - 1] = 'n';
+  name[ESP_DET_STA_NAME_MAX] = '\0';
+  sprintf(json, "{\"cmd\":\"setAp\",\"name\":\"%s\"}", name);
+  CHECK_INT(ESP_DET_ERR_CMD_BAD_FORMAT, decode(&cmd, json));
+
+  pass[ESP_DET_STA_PASS_MAX - 1] = 'p';
+  pass[ESP_DET_STA_PASS_MAX] = '\0';
+  sprintf(json, "{\"cmd\":\"setAp\",\"pass\":\"%s\"}", pass);
+  CHECK_INT(ESP_DET_ERR_CMD_BAD_FORMAT, decode(&cmd, json));
+
+  // Multi byte character which does not fit is not split.
+  name[ESP_DET_STA_NAME_MAX - 2] = '\0';
+  sprintf(json, "{\"cmd\":\"setAp\",\"name\":\"%s\\u00e9\"}", name);
+  CHECK_INT(ESP_DET_ERR_CMD_BAD_FORMAT, decode(&cmd, json));
+
+  // Numbers must fit the field.
+  CHECK_INT(ESP_DET_OK, decode(&cmd, "{\"cmd\":\"setSrv\",\"port\":65535}"));
+  CHECK_INT(65535, cmd.port);
+  CHECK_INT(ESP_DET_ERR_CMD_BAD_FORMAT, decode(&cmd, "{\"cmd\":\"setSrv\",\"port\":65537}"));
+  CHECK_INT(ESP_DET_ERR_CMD_BAD_FORMAT, decode(&cmd, "{\"cmd\":\"setSrv\",\"port\":4294967297}"));
+  CHECK_INT(ESP_DET_ERR_CMD_BAD_FORMAT, decode(&cmd, "{\"cmd\":\"setSrv\",\"port\":-80}"));
+  CHECK_INT(ESP_DET_ERR_CMD_BAD_FORMAT, decode(&cmd, "{\"cmd\":\"setSrv\",\"port\":80.5}"));
+
+  // Long unknown keys are skipped.
+  sprintf(json, "{\"%s\":1,\"cmd\":\"setAp\"}", pass);
+  CHECK_INT(ESP_DET_OK, decode(&cmd, json));
+}
+
+static void
+test_tok()
+{
+  uint32_t num;
+  char dst[4];
+  bool ovf = false;
+  det_tok tok = {"\"abcdef\",", 9, 0};
+
+  CHECK(tok_string(&tok, dst, sizeof(dst), &ovf));
+  CHECK_STR("abc", dst);
+  CHECK(ovf);
+  CHECK_INT(8, tok.pos);
+
+  det_tok num_tok = {"-12.5e1}", 8, 0};
+  CHECK(tok_number(&num_tok, &num));
+  CHECK_INT(ESP_DET_NUM_INVALID, num);
+  CHECK_INT(7, num_tok.pos);
+
+  det_tok max_tok = {"4294967295", 10, 0};
+  CHECK(tok_number(&max_tok, &num));
+  CHECK_INT(4294967295U, num);
+
+  det_tok ovf_tok = {"4294967296", 10, 0};
+  CHECK(tok_number(&ovf_tok, &num));
+  CHECK_INT(ESP_DET_NUM_INVALID, num);
+
+  det_tok bad_tok = {"-x", 2, 0};
+  CHECK(!tok_number(&bad_tok, &num));
+
+  det_tok val_tok = {" {\"a\":[1,{\"b\":\"]\"}]},", 21, 0};
+  CHECK(tok_skip_value(&val_tok));
+  CHECK_INT(20, val_tok.pos);
+}
+
+/** Write one extra JSON key or binary tag. */
+static void
+test_extra(det_wr *wr)
+{
+  wr_key(wr, 1, "n", 4294967295U);
+}
+
+static void
+test_decode_bin()
+{
+  det_cmd cmd;
+  const uint8_t set_srv[] = {ESP_DET_BIN_MAGIC, ESP_DET_CMD_ID_SET_SRV,
+                             3, 4, 10, 0, 0, 2,
+                             4, 2, 0x1F, 0x90,
+                             5, 3, 'b', 'o', 'b',
+                             99, 1, 'x',
+                             8, 7, '1', '.', '2', '.', '3', '.', '4'};
+
+  CHECK_INT(ESP_DET_OK, cmd_decode_bin(&cmd, set_srv, sizeof(set_srv)));
+  CHECK_INT(ESP_DET_CMD_ID_SET_SRV, cmd.id);
+  CHECK_INT(ESP_DET_KEY_CMD | ESP_DET_KEY_IP | ESP_DET_KEY_PORT | ESP_DET_KEY_USER | ESP_DET_KEY_MGR, cmd.keys);
+  CHECK_STR("10.0.0.2", cmd.ip);
+  CHECK_INT(8080, cmd.port);
+  CHECK_STR("bob", cmd.user);
+  CHECK_STR("1.2.3.4", cmd.mgr);
+
+  // Truncated value.
+  CHECK_INT(ESP_DET_ERR_CMD_BAD_FORMAT, cmd_decode_bin(&cmd, set_srv, 7));
+  CHECK_INT(ESP_DET_ERR_CMD_BAD_FORMAT, cmd_decode_bin(&cmd, set_srv, 1));
+
+  const uint8_t bad_port[] = {ESP_DET_BIN_MAGIC, ESP_DET_CMD_ID_SET_SRV, 4, 1, 80};
+  CHECK_INT(ESP_DET_ERR_CMD_BAD_FORMAT, cmd_decode_bin(&cmd, bad_port, sizeof(bad_port)));
+
+  const uint8_t unknown[] = {ESP_DET_BIN_MAGIC, 200};
+  CHECK_INT(ESP_DET_OK, cmd_decode_bin(&cmd, unknown, sizeof(unknown)));
+  CHECK_INT(ESP_DET_CMD_ID_UNKNOWN, cmd.id);
+  CHECK_INT(200, cmd.bin_id);
+}
+
+static void
+test_decode_bin_limits()
+{
+  det_cmd cmd;
+  uint8_t buf[4 + ESP_DET_STA_PASS_MAX];
+
+  buf[0] = ESP_DET_BIN_MAGIC;
+  buf[1] = ESP_DET_CMD_ID_SET_AP;
+  buf[2] = 1;
+  buf[3] = ESP_DET_STA_NAME_MAX - 1;
+  os_memset(buf + 4, 'n', ESP_DET_STA_PASS_MAX);
+  CHECK_INT(ESP_DET_OK, cmd_decode_bin(&cmd, buf, (uint16) (4 + buf[3])));
+  CHECK_INT(32, strlen(cmd.name));
+
+  buf[3] = ESP_DET_STA_NAME_MAX;
+  CHECK_INT(ESP_DET_ERR_CMD_BAD_FORMAT, cmd_decode_bin(&cmd, buf, (uint16) (4 + buf[3])));
+
+  buf[2] = 2;
+  buf[3] = ESP_DET_STA_PASS_MAX - 1;
+  CHECK_INT(ESP_DET_OK, cmd_decode_bin(&cmd, buf, (uint16) (4 + buf[3])));
+  CHECK_INT(64, strlen(cmd.pass));
+
+  buf[3] = ESP_DET_STA_PASS_MAX;
+  CHECK_INT(ESP_DET_ERR_CMD_BAD_FORMAT, cmd_decode_bin(&cmd, buf, (uint16) (4 + buf[3])));
+}
+
+/** Write one extra JSON key or binary tag. */
+static void
+test_writers()
+{
+  uint8_t buf[8];
+  det_wr wr = {buf, sizeof(buf), 0, false, false};
+
+  wr_num(&wr, 0);
+  wr_str(&wr, ",");
+  wr_num(&wr, 12345);
+  CHECK_INT(7, wr.len);
+  CHECK_MEM("0,12345", buf, 7);
+  CHECK(!wr.ovf);
+
+  wr_bytes(&wr, (const uint8_t *) "ab", 2);
+  CHECK(wr.ovf);
+  CHECK_INT(7, wr.len);
+
+  wr.ovf = false;
+  wr_str(&wr, "ab");
+  CHECK(wr.ovf);
+  CHECK_INT(8, wr.len);
+}
+
+static void
+test_resp()
+{
+  uint8_t buf[ESP_DET_RES_MAX + 1];
+  det_resp ok = cmd_resp_tpl(true, "ok", ESP_DET_OK);
+  det_resp fail = cmd_resp_tpl(false, "bad", 0x1234);
+  uint16 len;
+
+  setup();
+
+  len = cmd_resp(buf, ESP_DET_RES_MAX, &ok, false, ESP_DET_CMD_ID_SET_AP);
+  buf[len] = '\0';
+  CHECK_STR("{\"success\":true,\"code\":0,\"msg\":\"ok\"}", buf);
+
+  ok.extra = test_extra;
+  len = cmd_resp(buf, ESP_DET_RES_MAX, &ok, false, ESP_DET_CMD_ID_GET_STATS);
+  buf[len] = '\0';
+  CHECK_STR("{\"success\":true,\"code\":0,\"msg\":\"ok\",\"n\":4294967295}", buf);
+
+  len = cmd_resp(buf, ESP_DET_RES_MAX, &fail, true, ESP_DET_CMD_ID_SET_SRV);
+  CHECK_INT(ESP_DET_BIN_HDR, len);
+  CHECK_MEM("\xA5\x02\x00\x12\x34", buf, ESP_DET_BIN_HDR);
+
+  len = cmd_resp(buf, ESP_DET_RES_MAX, &ok, true, ESP_DET_CMD_ID_GET_STATS);
+  CHECK_INT(ESP_DET_BIN_HDR + 6, len);
+  CHECK_MEM("\x01\x04\xFF\xFF\xFF\xFF", buf + ESP_DET_BIN_HDR, 6);
+
+  // Response which does not fit is never sent truncated.
+  CHECK_INT(0, cmd_resp(buf, 20, &fail, false, ESP_DET_CMD_ID_SET_AP));
+}
+
+static void
+test_resp_encrypt_cb()
+{
+  uint8_t buf[ESP_DET_RES_MAX];
+  det_resp ok = cmd_resp_tpl(true, "ok", ESP_DET_OK);
+
+  setup();
+  g_sta->encrypt_cb = test_enc_dec;
+
+  uint16 len = cmd_resp(buf, sizeof(buf), &ok, false, ESP_DET_CMD_ID_SET_AP);
+  CHECK_INT(36, len);
+  CHECK_INT('{' ^ ESP_DET_TEST_KEY, buf[0]);
+
+  // The callback may pad the response up to the next block.
+  CHECK_INT(36, cmd_resp(buf, 36 + ESP_DET_CRYPT_BLOCK, &ok, false, ESP_DET_CMD_ID_SET_AP));
+  CHECK_INT(0, cmd_resp(buf, 36 + ESP_DET_CRYPT_BLOCK - 1, &ok, false, ESP_DET_CMD_ID_SET_AP));
+}
+
+static void
+test_rx_plain()
+{
+  uint8_t buf[16];
+  det_rx rx;
+
+  setup();
+  rx_begin(&rx, buf, sizeof(buf));
+  rx_feed(&rx, (const uint8_t *) "{\"a\"", 4);
+  rx_feed(&rx, (const uint8_t *) ":1}", 3);
+  CHECK_INT(7, rx_end(&rx));
+  CHECK_STR("{\"a\":1}", buf);
+
+  rx_begin(&rx, buf, sizeof(buf));
+  rx_feed(&rx, (const uint8_t *) "0123456789", 10);
+  rx_feed(&rx, (const uint8_t *) "0123456789", 10);
+  CHECK(rx.ovf);
+  CHECK_INT(0, rx_end(&rx));
+}
+
+static void
+test_rx_chunked()
+{
+  uint8_t enc[128];
+  uint8_t buf[128];
+  uint16 chunks[] = {7, 20, 3, 1};
+  const char *msg = "{\"cmd\":\"setAp\",\"name\":\"my ap\",\"pass\":\"secret\"}";
+  uint16 len, pos = 0;
+  uint8_t idx;
+  det_rx rx;
+
+  setup();
+  g_crypt_dec = test_crypt;
+  len = test_seal(enc, msg);
+
+  rx_begin(&rx, buf, sizeof(buf));
+  for (idx = 0; idx < sizeof(chunks) / sizeof(chunks[0]); idx++) {
+    rx_feed(&rx, enc + pos, chunks[idx]);
+    pos += chunks[idx];
+  }
+  rx_feed(&rx, enc + pos, len - pos);
+
+  // The last block is held back till the end.
+  CHECK(rx.len - rx.done > 0);
+  CHECK(rx.len - rx.done <= ESP_DET_CRYPT_BLOCK);
+
+  CHECK_INT(strlen(msg), rx_end(&rx));
+  CHECK_STR(msg, buf);
+  CHECK(!g_crypt_bad_chunk);
+  CHECK(g_crypt_calls > 1);
+}
+
+static void
+test_rx_enc_dec_cb()
+{
+  uint8_t enc[32];
+  uint8_t buf[32];
+  uint16 idx;
+  det_rx rx;
+  const char *msg = "{\"cmd\":\"getStats\"}";
+
+  setup();
+  g_sta->decrypt_cb = test_enc_dec;
+  for (idx = 0; idx < strlen(msg); idx++) enc[idx] = (uint8_t) (msg[idx] ^ ESP_DET_TEST_KEY);
+
+  rx_begin(&rx, buf, sizeof(buf));
+  rx_feed(&rx, enc, (uint16) strlen(msg));
+  CHECK_INT(strlen(msg), rx_end(&rx));
+  CHECK_STR(msg, buf);
+}
+
+int
+main()
+{
+  RUN(test_decode);
+  RUN(test_decode_skip);
+  RUN(test_decode_escapes);
+  RUN(test_decode_malformed);
+  RUN(test_decode_limits);
+  RUN(test_tok);
+  RUN(test_decode_bin);
+  RUN(test_decode_bin_limits);
+  RUN(test_writers);
+  RUN(test_resp);
+  RUN(test_resp_encrypt_cb);
+  RUN(test_rx_plain);
+  RUN(test_rx_chunked);
+  RUN(test_rx_enc_dec_cb);
+
+  return test_failed != 0;
+}
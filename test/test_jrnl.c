@@ -0,0 +1,247 @@
+/*
+ * Copyright 2017 Rafal Zajac <rzajac@gmail.com>.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+// Tests of the append only flash journal.
+
+#include "../src/esp_det_jrnl.c"
+#include "test.h"
+
+// The structure kept in the journal.
+typedef struct STORE_ATTR {
+  uint32_t cnt;
+  uint8_t stage;
+  char name[33];
+  uint32_t ip;
+} test_data;
+
+static test_data g_data;
+
+/** Returns flash address of the next record in the active sector. */
+static uint32_t
+next_addr()
+{
+  return jrnl_addr(g_jrnl.sector) + g_jrnl.pos;
+}
+
+/** Start with erased flash and empty journal. */
+static void
+setup()
+{
+  mock_reset();
+  os_memset(&g_data, 0, sizeof(g_data));
+  CHECK_INT(ESP_DET_JRNL_OK, esp_det_jrnl_init(&g_data, sizeof(g_data)));
+}
+
+/** Forget RAM state and replay the journal as after reboot. */
+static esp_det_jrnl_err
+reboot()
+{
+  os_memset(&g_data, 0xAA, sizeof(g_data));
+  esp_det_jrnl_init(&g_data, sizeof(g_data));
+  return esp_det_jrnl_read();
+}
+
+static void
+test_init_size()
+{
+  uint8_t big[ESP_DET_JRNL_DATA_MAX + 1];
+  CHECK_INT(ESP_DET_JRNL_ERR_SIZE, esp_det_jrnl_init(big, sizeof(big)));
+}
+
+static void
+test_read_empty()
+{
+  setup();
+  CHECK_INT(ESP_DET_JRNL_ERR_EMPTY, esp_det_jrnl_read());
+}
+
+static void
+test_snapshot_and_replay()
+{
+  setup();
+  esp_det_jrnl_read();
+
+  g_data.cnt = 1;
+  strcpy(g_data.name, "ap");
+  CHECK_INT(ESP_DET_JRNL_OK, esp_det_jrnl_write());
+  CHECK_INT(1, esp_det_jrnl_erase_cnt());
+  CHECK_INT(ESP_DET_JRNL_REC_START + ESP_DET_JRNL_HDR_SIZE + ESP_DET_JRNL_ALIGN(sizeof(test_data)), g_jrnl.pos);
+
+  CHECK_INT(ESP_DET_JRNL_OK, reboot());
+  CHECK_INT(1, g_data.cnt);
+  CHECK_STR("ap", g_data.name);
+  CHECK(!g_jrnl.compact);
+}
+
+static void
+test_only_changed_range()
+{
+  setup();
+  esp_det_jrnl_read();
+  esp_det_jrnl_write();
+
+  uint16 pos = g_jrnl.pos;
+  g_data.stage = 3;
+  CHECK_INT(ESP_DET_JRNL_OK, esp_det_jrnl_write());
+  CHECK_INT(pos + ESP_DET_JRNL_HDR_SIZE + 4, g_jrnl.pos);
+
+  // Nothing changed.
+  CHECK_INT(ESP_DET_JRNL_OK, esp_det_jrnl_write());
+  CHECK_INT(pos + ESP_DET_JRNL_HDR_SIZE + 4, g_jrnl.pos);
+  CHECK_INT(2, esp_det_jrnl_write_cnt());
+  CHECK_INT(1, esp_det_jrnl_erase_cnt());
+
+  CHECK_INT(ESP_DET_JRNL_OK, reboot());
+  CHECK_INT(3, g_data.stage);
+  CHECK_INT(0, g_data.cnt);
+}
+
+static void
+test_compaction()
+{
+  uint32_t idx;
+
+  setup();
+  esp_det_jrnl_read();
+  esp_det_jrnl_write();
+  uint8_t first = g_jrnl.sector;
+  uint32_t seq = g_jrnl.seq;
+
+  // Every write changes 4 bytes so it takes 8 bytes of flash.
+  for (idx = 1; idx <= SPI_FLASH_SEC_SIZE / 8; idx++) {
+    g_data.cnt = idx;
+    CHECK_INT(ESP_DET_JRNL_OK, esp_det_jrnl_write());
+  }
+
+  CHECK_INT(2, esp_det_jrnl_erase_cnt());
+  CHECK(g_jrnl.sector != first);
+  CHECK_INT(seq + 1, g_jrnl.seq);
+
+  CHECK_INT(ESP_DET_JRNL_OK, reboot());
+  CHECK_INT(SPI_FLASH_SEC_SIZE / 8, g_data.cnt);
+  CHECK(g_jrnl.sector != first);
+}
+
+static void
+test_bad_crc()
+{
+  setup();
+  esp_det_jrnl_read();
+  esp_det_jrnl_write();
+  g_data.cnt = 1;
+  esp_det_jrnl_write();
+  uint32_t addr = next_addr();
+  g_data.cnt = 2;
+  esp_det_jrnl_write();
+
+  // Corrupt the data of the last record.
+  mock_flash[addr + ESP_DET_JRNL_HDR_SIZE] ^= 0x01;
+
+  CHECK_INT(ESP_DET_JRNL_OK, reboot());
+  CHECK_INT(1, g_data.cnt);
+  CHECK(g_jrnl.compact);
+}
+
+static void
+test_interrupted_write()
+{
+  setup();
+  esp_det_jrnl_read();
+  esp_det_jrnl_write();
+  g_data.cnt = 5;
+  esp_det_jrnl_write();
+
+  // The record header was written but power was lost before the data.
+  uint32_t hdr = 0x00040000;
+  spi_flash_write(next_addr(), &hdr, 4);
+
+  CHECK_INT(ESP_DET_JRNL_OK, reboot());
+  CHECK_INT(5, g_data.cnt);
+  CHECK(g_jrnl.compact);
+
+  // Next write must not append after the garbage.
+  uint8_t sector = g_jrnl.sector;
+  g_data.cnt = 6;
+  CHECK_INT(ESP_DET_JRNL_OK, esp_det_jrnl_write());
+  CHECK(g_jrnl.sector != sector);
+
+  CHECK_INT(ESP_DET_JRNL_OK, reboot());
+  CHECK_INT(6, g_data.cnt);
+}
+
+static void
+test_stale_sector_ignored()
+{
+  setup();
+  esp_det_jrnl_read();
+  g_data.cnt = 1;
+  esp_det_jrnl_write();
+
+  // Force compaction to the other sector.
+  g_jrnl.compact = true;
+  g_data.cnt = 2;
+  esp_det_jrnl_write();
+
+  CHECK_INT(ESP_DET_JRNL_OK, reboot());
+  CHECK_INT(2, g_data.cnt);
+
+  // Snapshot of the newer sector is broken so the older one is used.
+  mock_flash[jrnl_addr(g_jrnl.sector) + ESP_DET_JRNL_REC_START + ESP_DET_JRNL_HDR_SIZE] ^= 0x01;
+  CHECK_INT(ESP_DET_JRNL_OK, reboot());
+  CHECK_INT(1, g_data.cnt);
+}
+
+static void
+test_clear_of_esp_cfg()
+{
+  uint32_t idx;
+  uint32_t prog = 0x12345678;
+  uint32_t back = 0;
+
+  setup();
+  esp_det_jrnl_read();
+
+  // The program keeps its own configuration in the last esp_cfg index.
+  CHECK_INT(ESP_CFG_OK, esp_cfg_init(ESP_DET_CFG_IDX_CNT - 1, &prog, sizeof(prog)));
+  CHECK_INT(ESP_CFG_OK, esp_cfg_write(ESP_DET_CFG_IDX_CNT - 1));
+
+  // Fill both journal sectors so each one is erased.
+  for (idx = 0; idx < 2 * SPI_FLASH_SEC_SIZE / 8; idx++) {
+    g_data.cnt = idx;
+    CHECK_INT(ESP_DET_JRNL_OK, esp_det_jrnl_write());
+  }
+  CHECK(esp_det_jrnl_erase_cnt() > ESP_DET_JRNL_SECTORS);
+
+  CHECK_INT(ESP_CFG_OK, esp_cfg_init(ESP_DET_CFG_IDX_CNT - 1, &back, sizeof(back)));
+  CHECK_INT(ESP_CFG_OK, esp_cfg_read(ESP_DET_CFG_IDX_CNT - 1));
+  CHECK_INT(prog, back);
+}
+
+int
+main()
+{
+  RUN(test_init_size);
+  RUN(test_read_empty);
+  RUN(test_snapshot_and_replay);
+  RUN(test_only_changed_range);
+  RUN(test_compaction);
+  RUN(test_bad_crc);
+  RUN(test_interrupted_write);
+  RUN(test_stale_sector_ignored);
+  RUN(test_clear_of_esp_cfg);
+
+  return test_failed != 0;
+}
@@ -0,0 +1,125 @@
+/*
+ * Copyright 2017 Rafal Zajac <rzajac@gmail.com>.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+
+// Tests of the deferred log ring buffer.
+
+// The rest of the tests log synchronously.
+#undef ESP_DET_LOG_DEFER
+#define ESP_DET_LOG_DEFER 1
+
+#include "../src/esp_det_log.c"
+#include "test.h"
+
+/** Start with empty ring buffer. */
+static void
+setup()
+{
+  mock_reset();
+  os_memset(&g_log, 0, sizeof(g_log));
+}
+
+static void
+test_record_format()
+{
+  det_log_rec rec;
+  const char *fmt = "DET DBG: %s %u\n";
+
+  setup();
+  esp_det_log(fmt, 2, (uintptr_t) "ap", (uintptr_t) 42);
+
+  // | argc | format pointer | arg 0 | arg 1 |
+  CHECK_INT(4, g_log.used);
+  CHECK_INT(2, g_log.buf[0]);
+  CHECK(g_log.buf[1] == (uintptr_t) fmt);
+  CHECK_STR("ap", (const char *) g_log.buf[2]);
+  CHECK_INT(42, g_log.buf[3]);
+  CHECK(g_log.armed);
+
+  CHECK(log_next(&rec));
+  CHECK_INT(2, rec.argc);
+  CHECK(rec.fmt == fmt);
+  CHECK_STR("ap", (const char *) rec.arg[0]);
+  CHECK_INT(42, rec.arg[1]);
+  CHECK_INT(0, rec.arg[2]);
+  CHECK_INT(0, g_log.used);
+  CHECK(!log_next(&rec));
+}
+
+static void
+test_wrap()
+{
+  uintptr_t idx;
+  det_log_rec rec;
+
+  setup();
+
+  // Every record takes 3 words so they cross the end of the ring.
+  for (idx = 0; idx <= ESP_DET_LOG_WORDS; idx++) {
+    esp_det_log("%u\n", 1, idx);
+    CHECK(log_next(&rec));
+    CHECK_INT(1, rec.argc);
+    CHECK_INT(idx, rec.arg[0]);
+  }
+  CHECK(g_log.head != 0);
+  CHECK_INT(0, g_log.lost);
+}
+
+static void
+test_lost()
+{
+  uint16 idx;
+
+  setup();
+
+  // Records with eight arguments take ten words.
+  for (idx = 0; idx < ESP_DET_LOG_WORDS / 10 + 2; idx++) {
+    esp_det_log("", 8, (uintptr_t) 1, (uintptr_t) 2, (uintptr_t) 3, (uintptr_t) 4,
+                (uintptr_t) 5, (uintptr_t) 6, (uintptr_t) 7, (uintptr_t) 8);
+  }
+  CHECK_INT(ESP_DET_LOG_WORDS / 10 * 10, g_log.used);
+  CHECK_INT(2, g_log.lost);
+}
+
+static void
+test_drain()
+{
+  uint8_t idx;
+
+  setup();
+  for (idx = 0; idx < ESP_DET_LOG_BATCH + 2; idx++) esp_det_log("", 0);
+  CHECK_INT(2 * (ESP_DET_LOG_BATCH + 2), g_log.used);
+
+  // One timer run prints a batch and schedules the rest.
+  mock_run(ESP_DET_LOG_DELAY);
+  CHECK_INT(2 * 2, g_log.used);
+  CHECK(g_log.armed);
+
+  mock_run(ESP_DET_LOG_DELAY);
+  CHECK_INT(0, g_log.used);
+  CHECK(!g_log.armed);
+}
+
+int
+main()
+{
+  RUN(test_record_format);
+  RUN(test_wrap);
+  RUN(test_lost);
+  RUN(test_drain);
+
+  return test_failed != 0;
+}
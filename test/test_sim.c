@@ -0,0 +1,720 @@
+/*
+ * Copyright 2017 Rafal Zajac <rzajac@gmail.com>.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+
+// Detection cycle tests. The library runs against the emulated access
+// point, network and flash on the virtual clock.
+
+#include "../src/esp_det.c"
+#include "test.h"
+
+// The manager address.
+#define TEST_MGR "192.168.1.10"
+
+// The done_cb calls and the last error passed to it.
+static uint32_t g_done_cnt;
+static esp_det_err g_done_err;
+// The disc_cb calls.
+static uint32_t g_disc_cnt;
+
+// The manager TCP connection.
+static struct espconn g_cli;
+static esp_tcp g_cli_tcp;
+
+static void
+done_cb(esp_det_err err)
+{
+  g_done_cnt++;
+  g_done_err = err;
+}
+
+static void
+disc_cb()
+{
+  g_disc_cnt++;
+}
+
+/** Bring the access point up. */
+static void
+ap_up()
+{
+  uint8_t bssid[6] = {0x10, 0x20, 0x30, 0x40, 0x50, 0x60};
+
+  mock_ap.up = true;
+  strcpy(mock_ap.ssid, "home");
+  strcpy(mock_ap.pass, "secret123");
+  os_memcpy(mock_ap.bssid, bssid, 6);
+  mock_ap.ch = 6;
+  mock_ap.ip = ipaddr_addr("192.168.1.50");
+  mock_ap.netmask = ipaddr_addr("255.255.255.0");
+  mock_ap.gw = ipaddr_addr("192.168.1.1");
+  mock_ap.scan_ms = 2000;
+  mock_ap.assoc_ms = 100;
+  mock_ap.dhcp_ms = 500;
+}
+
+/** XOR bytes with 0x5A. Used for both encryption and decryption. */
+static uint16
+xor_cb(uint8_t *dst, const uint8_t *src, uint16 src_len)
+{
+  uint16 idx;
+
+  for (idx = 0; idx < src_len; idx++) dst[idx] = (uint8_t) (src[idx] ^ 0x5A);
+
+  return src_len;
+}
+
+/**
+ * Boot the device with encryption callbacks.
+ *
+ * @param det_srv Set to true to detect main server.
+ * @param crypt   The encryption and decryption callback. May be NULL.
+ */
+static void
+boot_crypt(bool det_srv, esp_det_enc_dec *crypt)
+{
+  esp_det_srv_stop();
+  mock_reboot();
+
+  g_cfg = NULL;
+  g_sta = NULL;
+  os_memset(&g_cfg_mem, 0, sizeof(g_cfg_mem));
+  os_memset(&g_sta_mem, 0, sizeof(g_sta_mem));
+  os_memset(g_ev, 0, sizeof(g_ev));
+  g_crypt_enc = NULL;
+  g_crypt_dec = NULL;
+  g_done_cnt = 0;
+  g_done_err = ESP_DET_OK;
+  g_disc_cnt = 0;
+
+  CHECK_INT(ESP_DET_OK, esp_det_start("password", 1, done_cb, disc_cb, crypt, crypt, det_srv));
+  mock_run(0);
+}
+
+/**
+ * Boot the device. Flash and RTC memory keep what previous boot left.
+ *
+ * @param det_srv Set to true to detect main server.
+ */
+static void
+boot(bool det_srv)
+{
+  boot_crypt(det_srv, NULL);
+}
+
+/** Power up device with erased flash. */
+static void
+power_up(bool det_srv)
+{
+  mock_reset();
+  ap_up();
+  boot(det_srv);
+}
+
+/**
+ * Run till the library gets to the stage.
+ *
+ * @param stage  The stage.
+ * @param max_ms The maximum time to wait.
+ *
+ * @return Returns false if the stage was not reached in time.
+ */
+static bool
+run_to_stage(esp_det_st stage, uint32 max_ms)
+{
+  uint32 ms;
+
+  for (ms = 0; ms < max_ms && g_sta->stage != stage; ms += 10) mock_run(10);
+
+  return g_sta->stage == stage;
+}
+
+/** Run till done_cb is called. Returns false if it was not called in max_ms. */
+static bool
+run_to_done(uint32 max_ms)
+{
+  uint32 ms;
+  uint32_t done = g_done_cnt;
+
+  for (ms = 0; ms < max_ms && g_done_cnt == done; ms += 10) mock_run(10);
+
+  return g_done_cnt != done;
+}
+
+/**
+ * Send command over TCP and return the response.
+ *
+ * @param cmd The command.
+ * @param res The response buffer of MOCK_SENT_SIZE + 1 bytes.
+ */
+static void
+tcp_cmd(const char *cmd, char *res)
+{
+  os_memset(&g_cli, 0, sizeof(g_cli));
+  os_memset(&g_cli_tcp, 0, sizeof(g_cli_tcp));
+  g_cli.proto.tcp = &g_cli_tcp;
+
+  mock_sent_len = 0;
+  res[0] = '\0';
+  if (!mock_tcp_connect(&g_cli, TEST_MGR, 40001)) return;
+
+  mock_tcp_recv(&g_cli, cmd, (uint16) strlen(cmd));
+  os_memcpy(res, mock_sent, mock_sent_len);
+  res[mock_sent_len] = '\0';
+  if (g_cli.proto.tcp->disconnect_callback) g_cli.proto.tcp->disconnect_callback(&g_cli);
+}
+
+/**
+ * Send command over UDP and return the response.
+ *
+ * @param cmd The command.
+ * @param res The response buffer of MOCK_SENT_SIZE + 1 bytes. Empty if there was no response.
+ */
+static void
+udp_cmd(const char *cmd, char *res)
+{
+  mock_sent_len = 0;
+  mock_sent_ip = 0;
+  CHECK(mock_udp_recv(TEST_MGR, 40002, cmd, (uint16) strlen(cmd)));
+  os_memcpy(res, mock_sent, mock_sent_len);
+  res[mock_sent_len] = '\0';
+}
+
+/**
+ * Run till discovery is sent and return the nonce it carries.
+ *
+ * @param nonce The buffer of ESP_DET_NONCE_MAX bytes.
+ *
+ * @return Returns false if no discovery was sent.
+ */
+static bool
+wait_discovery(char *nonce)
+{
+  uint32 ms;
+  char *pos;
+
+  mock_sent_len = 0;
+  for (ms = 0; ms < ESP_DET_DS_INTERVAL_MAX * 2 && mock_sent_len == 0; ms += 10) mock_run(10);
+  if (mock_sent_len == 0) return false;
+
+  mock_sent[mock_sent_len] = '\0';
+  pos = strstr((char *) mock_sent, "\"nonce\":\"");
+  if (pos == NULL) return false;
+  strlcpy(nonce, pos + 9, ESP_DET_NONCE_MAX);
+
+  return true;
+}
+
+/** Provision device through the soft AP and run it to ESP_DET_ST_DS. */
+static void
+to_discovery()
+{
+  char res[MOCK_SENT_SIZE + 1];
+
+  tcp_cmd("{\"cmd\":\"setAp\",\"name\":\"home\",\"pass\":\"secret123\"}", res);
+  CHECK_STR("{\"success\":true,\"code\":0,\"msg\":\"access point set\"}\n", res);
+  CHECK(run_to_stage(ESP_DET_ST_DS, 20000));
+}
+
+/** Configure main server over UDP. */
+static void
+set_srv()
+{
+  char nonce[ESP_DET_NONCE_MAX];
+  char cmd[160];
+  char res[MOCK_SENT_SIZE + 1];
+
+  CHECK(wait_discovery(nonce));
+  sprintf(cmd, "{\"cmd\":\"setSrv\",\"ip\":\"192.168.1.2\",\"port\":1883,"
+               "\"user\":\"bob\",\"pass\":\"pw\",\"nonce\":\"%s\"}", nonce);
+  udp_cmd(cmd, res);
+  CHECK_STR("{\"success\":true,\"code\":0,\"msg\":\"main server set\"}", res);
+}
+
+static void
+test_detect_cycle()
+{
+  esp_det_srv srv;
+  char nonce[ESP_DET_NONCE_MAX];
+
+  power_up(true);
+
+  // Detect me: soft AP named after the MAC and command server.
+  CHECK_INT(ESP_DET_ST_DM, g_sta->stage);
+  CHECK_INT(STATIONAP_MODE, mock_opmode);
+  CHECK_STR("IOT_5CCF7F010203", mock_softap.ssid);
+  CHECK_STR("password", mock_softap.password);
+  CHECK(mock_tcp_srv != NULL);
+  CHECK_INT(ESP_DET_CMD_PORT, mock_tcp_srv->proto.tcp->local_port);
+
+  // Connect: setAp, then scan, associate and DHCP.
+  to_discovery();
+  CHECK_STR("home", g_cfg->ap_name);
+  CHECK_INT(6, g_cfg->ap_ch);
+  CHECK_INT(mock_ap.ip, g_cfg->ip);
+
+  // Detect main server: discovery broadcast to the subnet.
+  CHECK(wait_discovery(nonce));
+  CHECK_INT(ipaddr_addr("192.168.1.255"), mock_sent_ip);
+  CHECK(strstr((char *) mock_sent, "\"cmd\":\"iotDiscovery\",\"mac\":\"5CCF7F010203\"") != NULL);
+
+  // Operational: setSrv over UDP, soft AP and command server are gone.
+  set_srv();
+  CHECK_INT(ipaddr_addr(TEST_MGR), mock_sent_ip);
+  CHECK(run_to_done(1000));
+  CHECK_INT(ESP_DET_OK, g_done_err);
+  CHECK_INT(ESP_DET_ST_OP, g_sta->stage);
+  CHECK_INT(STATION_MODE, mock_opmode);
+  CHECK(mock_tcp_srv == NULL);
+
+  mock_run(ESP_DET_SLOW_CALL);
+  CHECK(mock_udp == NULL);
+
+  esp_det_get_srv(&srv);
+  CHECK_INT(ipaddr_addr("192.168.1.2"), srv.ip);
+  CHECK_INT(1883, srv.port);
+  CHECK_STR("bob", srv.user);
+  CHECK_STR("pw", srv.pass);
+}
+
+static void
+test_reboot_operational()
+{
+  power_up(true);
+  to_discovery();
+  set_srv();
+  CHECK(run_to_done(1000));
+
+  // Reconnects straight to the known BSSID and channel, no scan.
+  boot(true);
+  CHECK_INT(ESP_DET_ST_OP, g_sta->stage);
+  CHECK_INT(1, mock_station.bssid_set);
+  CHECK(run_to_done(mock_ap.assoc_ms + mock_ap.dhcp_ms + 100));
+  CHECK_INT(1, g_cfg->load_cnt);
+  CHECK(mock_tcp_srv == NULL);
+}
+
+static void
+test_fast_fallback()
+{
+  power_up(true);
+  to_discovery();
+  set_srv();
+  CHECK(run_to_done(1000));
+
+  // The access point was replaced. The directed connect to the old
+  // BSSID fails and the library falls back to scan.
+  mock_ap.bssid[5] = 0x61;
+  boot(true);
+  CHECK_INT(1, mock_station.bssid_set);
+  CHECK(run_to_done(ESP_DET_FAST_TIMEOUT + mock_ap.scan_ms + mock_ap.assoc_ms + mock_ap.dhcp_ms));
+  CHECK_INT(0, mock_station.bssid_set);
+  CHECK_INT(0x61, g_cfg->ap_bssid[5]);
+}
+
+static void
+test_wrong_credentials()
+{
+  char res[MOCK_SENT_SIZE + 1];
+
+  power_up(true);
+  tcp_cmd("{\"cmd\":\"setAp\",\"name\":\"home\",\"pass\":\"wrong\"}", res);
+  CHECK(run_to_stage(ESP_DET_ST_CN, 1000));
+
+  // Credentials which never worked are reset after the retries.
+  CHECK(run_to_stage(ESP_DET_ST_DM, 10 * 60 * 1000));
+  CHECK_STR("", g_cfg->ap_name);
+  CHECK(g_sta->rcn_cnt > 0);
+  CHECK_INT(0, g_done_cnt);
+}
+
+static void
+test_ip_timeout()
+{
+  char res[MOCK_SENT_SIZE + 1];
+
+  power_up(true);
+  mock_ap.dhcp_ms = ESP_DET_IP_TIMEOUT * 2;
+  tcp_cmd("{\"cmd\":\"setAp\",\"name\":\"home\",\"pass\":\"secret123\"}", res);
+  CHECK(run_to_stage(ESP_DET_ST_CN, 1000));
+
+  // Associated but no address: the IP timeout resets new credentials.
+  uint64_t start = mock_now_ms();
+  CHECK(run_to_stage(ESP_DET_ST_DM, ESP_DET_IP_TIMEOUT + 1000));
+  CHECK(mock_now_ms() - start >= ESP_DET_IP_TIMEOUT);
+  CHECK_STR("", g_cfg->ap_name);
+}
+
+static void
+test_ap_down()
+{
+  uint32_t rcn;
+
+  power_up(true);
+  to_discovery();
+  set_srv();
+  CHECK(run_to_done(1000));
+
+  mock_ap_down();
+  mock_run(ESP_DET_FAST_CALL);
+  CHECK_INT(1, g_disc_cnt);
+  CHECK_INT(ESP_DET_ST_CN, g_sta->stage);
+
+  // Configuration which worked is kept. Reconnects back off to the cap.
+  mock_run(10 * 60 * 1000);
+  CHECK_INT(ESP_DET_ST_CN, g_sta->stage);
+  CHECK_STR("home", g_cfg->ap_name);
+  CHECK(g_sta->ap_down);
+  CHECK_INT(ESP_DET_CN_DELAY_MAX, g_sta->cn_ivl);
+  rcn = g_sta->rcn_cnt;
+  CHECK(rcn > ESP_DET_CN_RETRY_MAX);
+  CHECK(rcn < 10 * 60 * 1000 / (ESP_DET_CN_DELAY_MAX / 2));
+
+  ap_up();
+  CHECK(run_to_done(ESP_DET_CN_DELAY_MAX * 2));
+  CHECK_INT(ESP_DET_ST_OP, g_sta->stage);
+  CHECK(!g_sta->ap_down);
+}
+
+static void
+test_nonce()
+{
+  char nonce[ESP_DET_NONCE_MAX];
+  char next[ESP_DET_NONCE_MAX];
+  char cmd[80];
+  char res[MOCK_SENT_SIZE + 1];
+
+  power_up(true);
+  to_discovery();
+  CHECK(wait_discovery(nonce));
+
+  // Commands without the nonce of the last discovery are dropped.
+  udp_cmd("{\"cmd\":\"getStats\"}", res);
+  CHECK_STR("", res);
+  udp_cmd("{\"cmd\":\"getStats\",\"nonce\":\"00000000\"}", res);
+  CHECK_STR("", res);
+
+  sprintf(cmd, "{\"cmd\":\"getStats\",\"nonce\":\"%s\"}", nonce);
+  udp_cmd(cmd, res);
+  CHECK(strncmp(res, "{\"success\":true,\"code\":0,\"msg\":\"stats\",\"stage\":3,", 49) == 0);
+
+  // The nonce is accepted once, the next discovery carries a new one.
+  udp_cmd(cmd, res);
+  CHECK_STR("", res);
+  CHECK(wait_discovery(next));
+  CHECK(strcmp(nonce, next) != 0);
+  CHECK_INT(ESP_DET_ST_DS, g_sta->stage);
+}
+
+static void
+test_tcp_nonce()
+{
+  char nonce[ESP_DET_NONCE_MAX];
+  char cmd[160];
+  char res[MOCK_SENT_SIZE + 1];
+
+  power_up(true);
+  to_discovery();
+  CHECK(wait_discovery(nonce));
+
+  // TCP commands need the nonce only when ESP_DET_TCP_NONCE is set.
+  tcp_cmd("{\"cmd\":\"setSrv\",\"ip\":\"192.168.1.2\",\"port\":1883,"
+          "\"user\":\"bob\",\"pass\":\"pw\"}", res);
+#if ESP_DET_TCP_NONCE
+  CHECK_STR("{\"success\":false,\"code\":13,\"msg\":\"bad nonce\"}\n", res);
+  CHECK_INT(ESP_DET_ST_DS, g_sta->stage);
+
+  sprintf(cmd, "{\"cmd\":\"setSrv\",\"ip\":\"192.168.1.2\",\"port\":1883,"
+               "\"user\":\"bob\",\"pass\":\"pw\",\"nonce\":\"%s\"}", nonce);
+  tcp_cmd(cmd, res);
+#else
+  (void) cmd;
+#endif
+  CHECK_STR("{\"success\":true,\"code\":0,\"msg\":\"main server set\"}\n", res);
+  CHECK(run_to_done(1000));
+  CHECK_INT(ESP_DET_ST_OP, g_sta->stage);
+}
+
+static void
+test_long_fields()
+{
+  char nonce[ESP_DET_NONCE_MAX];
+  char cmd[200];
+  char res[MOCK_SENT_SIZE + 1];
+
+  power_up(true);
+
+  // Values which do not fit the configuration are rejected, not cut.
+  tcp_cmd("{\"cmd\":\"setAp\",\"name\":\"home_network_name1\",\"pass\":\"secret123\"}", res);
+  CHECK_STR("{\"success\":false,\"code\":13,\"msg\":\"name too long\"}\n", res);
+  tcp_cmd("{\"cmd\":\"setAp\",\"name\":\"home\",\"pass\":\"secret123secret123\"}", res);
+  CHECK_STR("{\"success\":false,\"code\":13,\"msg\":\"pass too long\"}\n", res);
+  CHECK_INT(ESP_DET_ST_DM, g_sta->stage);
+
+  // The longest password which fits is kept whole.
+  strcpy(mock_ap.pass, "secret123secret12");
+  tcp_cmd("{\"cmd\":\"setAp\",\"name\":\"home\",\"pass\":\"secret123secret12\"}", res);
+  CHECK_STR("{\"success\":true,\"code\":0,\"msg\":\"access point set\"}\n", res);
+  CHECK_STR("secret123secret12", g_cfg->ap_pass);
+  CHECK(run_to_stage(ESP_DET_ST_DS, 20000));
+
+  CHECK(wait_discovery(nonce));
+  sprintf(cmd, "{\"cmd\":\"setSrv\",\"ip\":\"192.168.1.2\",\"port\":1883,"
+               "\"user\":\"bob\",\"pass\":\"password12\",\"nonce\":\"%s\"}", nonce);
+  udp_cmd(cmd, res);
+  CHECK_STR("{\"success\":false,\"code\":13,\"msg\":\"pass too long\"}", res);
+  CHECK_INT(ESP_DET_ST_DS, g_sta->stage);
+}
+
+static void
+test_import_v1()
+{
+  flash_cfg_v1 old;
+  esp_det_srv srv;
+
+  mock_reset();
+  ap_up();
+
+  // Configuration and station settings left by the esp_cfg only version.
+  os_memset(&old, 0, sizeof(old));
+  old.magic = ESP_DET_CFG_MAGIC_V1;
+  old.load_cnt = 7;
+  old.srv_ip = ipaddr_addr("192.168.1.2");
+  old.srv_port = 1883;
+  old.stage = ESP_DET_ST_OP;
+  strcpy(old.srv_user, "bob");
+  strcpy(old.srv_pass, "pw");
+  strcpy(old.ap_name, "home");
+  strcpy(old.ap_pass, "secret123");
+  CHECK_INT(ESP_CFG_OK, esp_cfg_init(ESP_DET_CFG_IDX, &old, sizeof(old)));
+  CHECK_INT(ESP_CFG_OK, esp_cfg_write(ESP_DET_CFG_IDX));
+  os_memset(&mock_station, 0, sizeof(mock_station));
+  strcpy((char *) mock_station.ssid, "home");
+  strcpy((char *) mock_station.password, "secret123");
+
+  boot(true);
+  CHECK_INT(ESP_DET_ST_OP, g_sta->stage);
+  CHECK_INT(ESP_DET_CFG_MAGIC, g_cfg->magic);
+  CHECK_INT(8, g_cfg->load_cnt);
+  CHECK_STR("home", g_cfg->ap_name);
+  CHECK_STR("secret123", g_cfg->ap_pass);
+  CHECK_INT(0, g_cfg->ap_ch);
+  CHECK_INT(0, g_cfg->mgr_ip);
+  CHECK(run_to_done(mock_ap.scan_ms + mock_ap.assoc_ms + mock_ap.dhcp_ms + 100));
+  CHECK_INT(ESP_DET_OK, g_done_err);
+
+  esp_det_get_srv(&srv);
+  CHECK_INT(ipaddr_addr("192.168.1.2"), srv.ip);
+  CHECK_INT(1883, srv.port);
+  CHECK_STR("bob", srv.user);
+  CHECK_STR("pw", srv.pass);
+
+  // The converted configuration is read back from the journal.
+  boot(true);
+  CHECK_INT(ESP_DET_ST_OP, g_sta->stage);
+  CHECK_INT(9, g_cfg->load_cnt);
+  CHECK_STR("home", g_cfg->ap_name);
+  CHECK_INT(6, g_cfg->ap_ch);
+  CHECK(run_to_done(mock_ap.assoc_ms + mock_ap.dhcp_ms + 100));
+}
+
+static void
+test_discovery_unicast()
+{
+  char nonce[ESP_DET_NONCE_MAX];
+  char res[MOCK_SENT_SIZE + 1];
+
+  power_up(true);
+  tcp_cmd("{\"cmd\":\"setAp\",\"name\":\"home\",\"pass\":\"secret123\",\"mgr\":\"" TEST_MGR "\"}", res);
+  CHECK_STR("{\"success\":true,\"code\":0,\"msg\":\"access point set\"}\n", res);
+  CHECK(run_to_stage(ESP_DET_ST_DS, 20000));
+
+  // The known manager is tried first, then discovery falls back to broadcast.
+  CHECK(wait_discovery(nonce));
+  CHECK_INT(ipaddr_addr(TEST_MGR), mock_sent_ip);
+  g_sta->sr_err_cnt = ESP_DET_DS_UNICAST_MISS;
+  CHECK(wait_discovery(nonce));
+  CHECK_INT(ipaddr_addr("192.168.1.255"), mock_sent_ip);
+
+  // The counter saturates so it never wraps back to unicast.
+  g_sta->sr_err_cnt = 0xFF;
+  CHECK(wait_discovery(nonce));
+  CHECK_INT(ipaddr_addr("192.168.1.255"), mock_sent_ip);
+  CHECK_INT(0xFF, g_sta->sr_err_cnt);
+}
+
+static void
+test_udp_mgr_write()
+{
+  esp_det_stats stats;
+  uint32_t flash_wr;
+
+  power_up(true);
+  to_discovery();
+  esp_det_get_stats(&stats);
+  flash_wr = stats.flash_wr;
+
+  // The manager address goes to flash with the main server configuration.
+  set_srv();
+  esp_det_get_stats(&stats);
+  CHECK_INT(flash_wr + 1, stats.flash_wr);
+  CHECK_INT(ipaddr_addr(TEST_MGR), g_cfg->mgr_ip);
+  CHECK_INT(ESP_DET_ST_OP, g_cfg->stage);
+
+  boot(true);
+  CHECK_INT(ipaddr_addr(TEST_MGR), g_cfg->mgr_ip);
+}
+
+static void
+test_ip_timeout_known()
+{
+  power_up(true);
+  to_discovery();
+  set_srv();
+  CHECK(run_to_done(1000));
+
+  // The fast reconnect times out waiting for DHCP and falls back to scan.
+  // The disconnect it makes is not another failed attempt.
+  mock_ap.dhcp_ms = ESP_DET_FAST_TIMEOUT + 1000;
+  boot(true);
+  CHECK(run_to_done(ESP_DET_FAST_TIMEOUT + mock_ap.scan_ms + mock_ap.assoc_ms + mock_ap.dhcp_ms + 100));
+  CHECK_INT(ESP_DET_OK, g_done_err);
+  CHECK_INT(ESP_DET_ST_OP, g_sta->stage);
+  CHECK_INT(0, g_disc_cnt);
+  CHECK_INT(0, g_sta->rcn_cnt);
+
+  // Known access point without DHCP: every timeout schedules one reconnect.
+  mock_ap_down();
+  ap_up();
+  mock_ap.dhcp_ms = ESP_DET_IP_TIMEOUT * 10;
+  mock_run(ESP_DET_FAST_CALL);
+  CHECK_INT(ESP_DET_ST_CN, g_sta->stage);
+  uint32_t rcn = g_sta->rcn_cnt;
+  mock_run(ESP_DET_CN_DELAY * 2 + mock_ap.scan_ms + ESP_DET_IP_TIMEOUT);
+  CHECK_INT(rcn + 1, g_sta->rcn_cnt);
+}
+
+static void
+test_crypt_framed()
+{
+  const char *cmd = "{\"cmd\":\"setAp\",\"name\":\"home\",\"pass\":\"secret123\"}";
+  const char *exp = "{\"success\":true,\"code\":0,\"msg\":\"access point set\"}";
+  uint8_t req[128];
+  uint8_t res[MOCK_SENT_SIZE + 1];
+  uint16 len = (uint16) strlen(cmd);
+
+  mock_reset();
+  ap_up();
+  boot_crypt(true, xor_cb);
+
+  // Encrypted commands are recognized with length prefix by default.
+  req[0] = 0xFE;
+  req[1] = (uint8_t) (len >> 8);
+  req[2] = (uint8_t) len;
+  xor_cb(req + 3, (const uint8_t *) cmd, len);
+
+  os_memset(&g_cli, 0, sizeof(g_cli));
+  os_memset(&g_cli_tcp, 0, sizeof(g_cli_tcp));
+  g_cli.proto.tcp = &g_cli_tcp;
+  mock_sent_len = 0;
+  CHECK(mock_tcp_connect(&g_cli, TEST_MGR, 40001));
+  mock_tcp_recv(&g_cli, req, 3 + 10);
+  CHECK_INT(0, mock_sent_len);
+  mock_tcp_recv(&g_cli, req + 3 + 10, len - 10);
+
+  CHECK_INT(3 + strlen(exp), mock_sent_len);
+  CHECK_INT(0xFE, mock_sent[0]);
+  CHECK_INT(strlen(exp), (mock_sent[1] << 8) | mock_sent[2]);
+  xor_cb(res, mock_sent + 3, (uint16) (mock_sent_len - 3));
+  res[mock_sent_len - 3] = '\0';
+  CHECK_STR(exp, res);
+  if (g_cli.proto.tcp->disconnect_callback) g_cli.proto.tcp->disconnect_callback(&g_cli);
+}
+
+static void
+test_bin_unknown()
+{
+  char res[MOCK_SENT_SIZE + 1];
+
+  // Unknown binary command ID comes back as sent.
+  power_up(true);
+  tcp_cmd("\xA5\xC8", res);
+  CHECK(mock_sent_len >= ESP_DET_BIN_HDR);
+  CHECK_INT(ESP_DET_BIN_MAGIC, (uint8_t) res[0]);
+  CHECK_INT(200, (uint8_t) res[1]);
+  CHECK_INT(0, res[2]);
+  CHECK_INT(ESP_DET_ERR_CMD, ((uint8_t) res[3] << 8) | (uint8_t) res[4]);
+}
+
+static void
+test_no_alloc()
+{
+  char res[MOCK_SENT_SIZE + 1];
+
+  // The whole detection cycle with commands over TCP and UDP.
+  power_up(true);
+  tcp_cmd("{\"cmd\":\"getStats\"}", res);
+  CHECK(strncmp(res, "{\"success\":true,\"code\":0,\"msg\":\"stats\",\"stage\":1,", 49) == 0);
+  to_discovery();
+  set_srv();
+  CHECK(run_to_done(1000));
+  mock_run(ESP_DET_SLOW_CALL);
+
+  CHECK_INT(0, mock_allocs);
+  CHECK_INT(0, mock_alloc_bytes);
+}
+
+static void
+test_stage_time()
+{
+  esp_det_stats stats;
+
+  power_up(true);
+  to_discovery();
+  set_srv();
+  CHECK(run_to_done(1000));
+
+  // The system time wraps every 71.6 minutes.
+  mock_run(3 * 60 * 60 * 1000);
+  esp_det_get_stats(&stats);
+  CHECK_INT(ESP_DET_ST_OP, stats.stage);
+  CHECK(stats.stage_time >= 3 * 60 * 60 * 1000);
+  CHECK(stats.stage_time < 3 * 60 * 60 * 1000 + 1000);
+}
+
+int
+main()
+{
+  RUN(test_detect_cycle);
+  RUN(test_reboot_operational);
+  RUN(test_fast_fallback);
+  RUN(test_wrong_credentials);
+  RUN(test_ip_timeout);
+  RUN(test_ap_down);
+  RUN(test_nonce);
+  RUN(test_tcp_nonce);
+  RUN(test_long_fields);
+  RUN(test_import_v1);
+  RUN(test_discovery_unicast);
+  RUN(test_udp_mgr_write);
+  RUN(test_ip_timeout_known);
+  RUN(test_crypt_framed);
+  RUN(test_bin_unknown);
+  RUN(test_no_alloc);
+  RUN(test_stage_time);
+
+  return test_failed != 0;
+}
@@ -0,0 +1,294 @@
+/*
+ * Copyright 2017 Rafal Zajac <rzajac@gmail.com>.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+// Tests of the TCP command server framing and flow control.
+
+#include "../src/esp_det_srv.c"
+#include "test.h"
+
+// The command which gets ESP_DET_SRV_RES_MAX byte response.
+#define BIG_CMD "{big}"
+
+static esp_tcp g_tcp;
+static struct espconn g_conn;
+
+/** Respond with the command wrapped in angle brackets. */
+static uint16
+echo_cb(uint8_t *res, uint16 res_len, uint8_t *req, uint16 req_len)
+{
+  if (req_len == sizeof(BIG_CMD) - 1 && os_memcmp(req, BIG_CMD, req_len) == 0) {
+    os_memset(res, 'x', res_len);
+    return res_len;
+  }
+
+  res[0] = '<';
+  os_memcpy(res + 1, req, req_len);
+  res[req_len + 1] = '>';
+
+  return (uint16) (req_len + 2);
+}
+
+/** Start server and open one connection. */
+static det_srv_conn *
+setup(uint8_t framing)
+{
+  esp_det_srv_stop();
+  mock_reset();
+  CHECK_INT(ESPCONN_OK, esp_det_srv_start(ESP_DET_CMD_PORT, ESP_DET_CMD_MAX, echo_cb, framing));
+
+  os_memset(&g_tcp, 0, sizeof(g_tcp));
+  os_memset(&g_conn, 0, sizeof(g_conn));
+  g_tcp.remote_port = 5000;
+  g_tcp.remote_ip[0] = 192;
+  g_tcp.remote_ip[3] = 10;
+  g_conn.proto.tcp = &g_tcp;
+  srv_connect_cb(&g_conn);
+
+  return srv_find(&g_conn);
+}
+
+/** Pass data to the receive callback. */
+static void
+recv_str(const char *data, uint16 len)
+{
+  srv_recv_cb(&g_conn, (char *) data, len);
+}
+
+/** Report all sends as done. */
+static void
+drain()
+{
+  uint8_t cnt = 0;
+  det_srv_conn *sc = srv_find(&g_conn);
+
+  while (sc != NULL && sc->tx_busy > 0 && cnt++ < 100) srv_sent_cb(&g_conn);
+}
+
+/** Check sent bytes and forget them. */
+static void
+check_sent(const char *exp, uint16 len)
+{
+  CHECK_INT(len, mock_sent_len);
+  if (mock_sent_len == len) CHECK_MEM(exp, mock_sent, len);
+  mock_sent_len = 0;
+}
+
+static void
+test_json_end()
+{
+  CHECK_INT(2, srv_json_end((const uint8_t *) "{}", 2));
+  CHECK_INT(8, srv_json_end((const uint8_t *) "{\"a\":{}}\n{", 10));
+  CHECK_INT(9, srv_json_end((const uint8_t *) "{\"a\":\"}\"}", 9));
+  CHECK_INT(11, srv_json_end((const uint8_t *) "{\"a\":\"\\\"}\"}", 11));
+  CHECK_INT(0, srv_json_end((const uint8_t *) "{\"a\":{}", 7));
+  CHECK_INT(0, srv_json_end((const uint8_t *) "{\"a\":\"}", 7));
+}
+
+static void
+test_frame()
+{
+  det_fr fr;
+  uint16 off, len, used;
+  det_srv_conn *sc = setup(ESP_DET_SRV_FR_LEN | ESP_DET_SRV_FR_JSON);
+
+  os_memcpy(sc->rx, "\xFE\x00\x03" "abc\xFE", 7);
+  sc->rx_len = 2;
+  CHECK(!srv_frame(sc, &fr, &off, &len, &used));
+  sc->rx_len = 5;
+  CHECK(!srv_frame(sc, &fr, &off, &len, &used));
+  sc->rx_len = 7;
+  CHECK(srv_frame(sc, &fr, &off, &len, &used));
+  CHECK_INT(ESP_DET_FR_LEN, fr);
+  CHECK_INT(3, off);
+  CHECK_INT(3, len);
+  CHECK_INT(6, used);
+
+  os_memcpy(sc->rx, "{\"a\":1}\n{", 9);
+  sc->rx_len = 9;
+  CHECK(srv_frame(sc, &fr, &off, &len, &used));
+  CHECK_INT(ESP_DET_FR_JSON, fr);
+  CHECK_INT(0, off);
+  CHECK_INT(7, len);
+  CHECK_INT(7, used);
+
+  os_memcpy(sc->rx, "\xA5\x01", 2);
+  sc->rx_len = 2;
+  CHECK(srv_frame(sc, &fr, &off, &len, &used));
+  CHECK_INT(ESP_DET_FR_RAW, fr);
+  CHECK_INT(2, len);
+
+  // Framing not enabled.
+  g_srv.framing = 0;
+  os_memcpy(sc->rx, "{\"a\"", 4);
+  sc->rx_len = 4;
+  CHECK(srv_frame(sc, &fr, &off, &len, &used));
+  CHECK_INT(ESP_DET_FR_RAW, fr);
+  CHECK_INT(4, len);
+}
+
+static void
+test_json_pipelined()
+{
+  setup(ESP_DET_SRV_FR_LEN | ESP_DET_SRV_FR_JSON);
+
+  recv_str("{\"a\":\"}\"}\n{\"b\"", 14);
+  CHECK_INT(1, mock_sends);
+  recv_str(":1}\r\n", 5);
+  drain();
+
+  check_sent("<{\"a\":\"}\"}>\n<{\"b\":1}>\n", 22);
+}
+
+static void
+test_len_prefixed()
+{
+  setup(ESP_DET_SRV_FR_LEN | ESP_DET_SRV_FR_JSON);
+
+  recv_str("\xFE\x00\x03xy", 5);
+  CHECK_INT(0, mock_sent_len);
+  recv_str("z\xFE\x00\x01q", 5);
+  drain();
+
+  check_sent("\xFE\x00\x05<xyz>\xFE\x00\x03<q>", 14);
+}
+
+static void
+test_raw()
+{
+  det_srv_conn *sc = setup(ESP_DET_SRV_FR_LEN | ESP_DET_SRV_FR_JSON);
+
+  // Every receive not starting with frame marker is one command.
+  recv_str("\xA5\x01{", 3);
+  check_sent("<\xA5\x01{>", 5);
+  CHECK_INT(0, sc->rx_len);
+}
+
+static void
+test_crypt_not_framed()
+{
+  det_srv_conn *sc = setup(0);
+
+  // Ciphertext starting with frame markers is never buffered.
+  recv_str("{\x01\x02", 3);
+  drain();
+  check_sent("<{\x01\x02>", 5);
+
+  recv_str("\xFE\x00\x09zz", 5);
+  drain();
+  check_sent("<\xFE\x00\x09zz>", 7);
+  CHECK_INT(0, sc->rx_len);
+  CHECK(!sc->timer.armed);
+}
+
+static void
+test_idle_flush()
+{
+  det_srv_conn *sc = setup(ESP_DET_SRV_FR_LEN | ESP_DET_SRV_FR_JSON);
+
+  recv_str("{abc", 4);
+  CHECK_INT(0, mock_sent_len);
+  CHECK(sc->timer.armed);
+  CHECK_INT(ESP_DET_SRV_IDLE, sc->timer.ms);
+
+  CHECK(mock_timer_fire(&sc->timer));
+  check_sent("<{abc>", 6);
+  CHECK_INT(0, sc->rx_len);
+}
+
+static void
+test_back_pressure()
+{
+  uint8_t idx;
+  char data[8 * (sizeof(BIG_CMD) - 1)];
+  det_srv_conn *sc = setup(ESP_DET_SRV_FR_LEN | ESP_DET_SRV_FR_JSON);
+
+  for (idx = 0; idx < 8; idx++) os_memcpy(data + idx * 5, BIG_CMD, 5);
+  recv_str(data, sizeof(data));
+
+  // Only as many commands as fit in the response queue are handled.
+  CHECK_INT(1, mock_holds);
+  CHECK(sc->rx_len > 0);
+
+  drain();
+  CHECK_INT(0, mock_holds);
+  CHECK_INT(0, sc->rx_len);
+  CHECK_INT(8 * (ESP_DET_SRV_RES_MAX + 1), mock_sent_len);
+}
+
+static void
+test_too_long()
+{
+  char data[ESP_DET_SRV_RX_SIZE + 1];
+  det_srv_conn *sc = setup(ESP_DET_SRV_FR_LEN | ESP_DET_SRV_FR_JSON);
+
+  data[0] = '{';
+  os_memset(data + 1, ' ', sizeof(data) - 1);
+  recv_str(data, sizeof(data));
+
+  CHECK(sc->close);
+  CHECK(mock_timer_fire(&sc->timer));
+  CHECK_INT(1, mock_disconnects);
+  CHECK(srv_find(&g_conn) == NULL);
+}
+
+static void
+test_reject()
+{
+  uint8_t idx;
+  esp_tcp tcp[ESP_DET_CMD_MAX + 1];
+  struct espconn conn[ESP_DET_CMD_MAX + 1];
+
+  setup(ESP_DET_SRV_FR_LEN | ESP_DET_SRV_FR_JSON);
+  for (idx = 0; idx < ESP_DET_CMD_MAX; idx++) {
+    os_memset(&tcp[idx], 0, sizeof(esp_tcp));
+    os_memset(&conn[idx], 0, sizeof(struct espconn));
+    tcp[idx].remote_port = 6000 + idx;
+    conn[idx].proto.tcp = &tcp[idx];
+    srv_connect_cb(&conn[idx]);
+  }
+
+  // Connection without a slot is closed from the timer.
+  CHECK_INT(0, mock_disconnects);
+  CHECK(g_srv.reject == &conn[ESP_DET_CMD_MAX - 1]);
+  CHECK(mock_timer_fire(&g_srv.timer));
+  CHECK_INT(1, mock_disconnects);
+  CHECK(g_srv.reject == NULL);
+
+  // Slot is freed and reused.
+  srv_discon_cb(&g_conn);
+  CHECK(srv_find(&g_conn) == NULL);
+  srv_connect_cb(&conn[ESP_DET_CMD_MAX - 1]);
+  CHECK(srv_find(&conn[ESP_DET_CMD_MAX - 1]) != NULL);
+}
+
+int
+main()
+{
+  RUN(test_json_end);
+  RUN(test_frame);
+  RUN(test_json_pipelined);
+  RUN(test_len_prefixed);
+  RUN(test_raw);
+  RUN(test_crypt_not_framed);
+  RUN(test_idle_flush);
+  RUN(test_back_pressure);
+  RUN(test_too_long);
+  RUN(test_reject);
+
+  esp_det_srv_stop();
+
+  return test_failed != 0;
+}